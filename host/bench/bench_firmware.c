@@ -0,0 +1,251 @@
+// Micro-benchmarks of the firmware's hot paths on the host: decoding a
+// sensor frame (next to the float conversion it replaced), encoding a
+// telemetry batch as JSON and as CBOR, and serving /api/history. Also
+// prints the encoded telemetry sizes next to the "%f" strings the MQTT
+// client used to publish, one per value.
+//
+//     bench_firmware                  prints ns/op for every benchmark
+//     bench_firmware --check <file>   also fails if one is more than
+//                                     BENCH_TOLERANCE times its baseline
+//
+// baselines.txt holds the numbers of a Release build on the machine that
+// last updated it; rerun and commit them when a change is expected to move
+// them. Host numbers track relative changes, they do not predict the
+// ESP32-S3.
+
+#include "../../main/app_main.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "mock.h"
+
+#define BENCH_RUNS 5
+#define BENCH_TOLERANCE 3.0
+
+typedef struct
+{
+    const char *name;
+    void (*run)(uint32_t iterations);
+    uint32_t iterations;
+} Benchmark;
+
+static volatile uint32_t sink;
+
+// Two valid frames, 21.50 degC and 45.00 %RH as read from the sensor and
+// the next temperature step; alternating between them defeats hoisting.
+static uint8_t frames[2][AHT20_FRAME_LENGTH] = {
+    {0x1C, 0x73, 0x33, 0x45, 0xB8, 0x52, 0x00},
+    {0x1C, 0x73, 0x33, 0x45, 0xB8, 0x53, 0x00},
+};
+
+// Includes the CRC check the float path never did.
+static void benchDecode(uint32_t iterations)
+{
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        int16_t temperature_value;
+        uint16_t humidity_value;
+        if (aht20Decode(frames[i & 0x01], &temperature_value, &humidity_value) == AHT20_DECODE_OK)
+            sink += temperature_value + humidity_value;
+    }
+}
+
+// The float conversion aht20Decode() replaced, for comparison.
+static void decodeFloat(const uint8_t *data, int16_t *temperature_value, uint16_t *humidity_value)
+{
+    uint32_t raw_humidity = ((uint32_t)data[1] << 12) | ((uint32_t)data[2] << 4) | (data[3] >> 4);
+    uint32_t raw_temperature = ((uint32_t)(data[3] & 0x0F) << 16) | ((uint32_t)data[4] << 8) | data[5];
+    *humidity_value = ((float)raw_humidity * 100) / 0x100000 * 100;
+    *temperature_value = (((float)raw_temperature * 200 / 0x100000) - 50) * 100;
+}
+
+static void benchDecodeFloat(uint32_t iterations)
+{
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        int16_t temperature_value;
+        uint16_t humidity_value;
+        decodeFloat(frames[i & 0x01], &temperature_value, &humidity_value);
+        sink += temperature_value + humidity_value;
+    }
+}
+
+static TelemetrySample batch[MQTT_REPLAY_BATCH_SIZE];
+
+// JSON sends the batch as two messages, one per topic.
+static void benchFormatBatch(uint32_t iterations)
+{
+    char payload[MQTT_PAYLOAD_MAX];
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        batch[0].timestamp = i;
+        sink += formatTelemetryBatch(payload, sizeof(payload), 7, batch, MQTT_REPLAY_BATCH_SIZE, true);
+        sink += formatTelemetryBatch(payload, sizeof(payload), 7, batch, MQTT_REPLAY_BATCH_SIZE, false);
+    }
+}
+
+static void benchEncodeBatch(uint32_t iterations)
+{
+    uint8_t payload[MQTT_PAYLOAD_MAX];
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        batch[0].timestamp = i;
+        sink += encodeTelemetryBatch(payload, sizeof(payload), 7, batch, MQTT_REPLAY_BATCH_SIZE);
+    }
+}
+
+static void benchHistory(const char *uri, uint32_t iterations)
+{
+    int fd = mockHttpdConnect();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        MockHttpResponse response;
+        if (mockHttpdRequest(fd, HTTP_GET, uri, NULL, NULL, &response) != ESP_OK)
+        {
+            fprintf(stderr, "%s failed\n", uri);
+            exit(1);
+        }
+        sink += response.length;
+        mockHttpResponseFree(&response);
+    }
+    mockHttpdDisconnect(fd);
+}
+
+static void benchHistorySamples(uint32_t iterations)
+{
+    benchHistory("/api/history", iterations);
+}
+
+static void benchHistoryBuckets(uint32_t iterations)
+{
+    benchHistory("/api/history?buckets=64", iterations);
+}
+
+// The sizes follow from the formats, so they are printed, not checked.
+// Room-temperature samples 10 s apart, early in the first hour.
+static void printPayloadSizes(void)
+{
+    static const size_t counts[] = {1, MQTT_BATCH_SIZE, MQTT_REPLAY_BATCH_SIZE};
+    TelemetrySample samples[MQTT_REPLAY_BATCH_SIZE];
+    for (size_t i = 0; i < MQTT_REPLAY_BATCH_SIZE; i++)
+        samples[i] = (TelemetrySample){1000 + i * 10, 2150 + i, 4500 + i};
+
+    printf("\n%-20s %12s %12s %12s\n", "payload bytes", "%f strings", "json", "cbor");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        int strings = 0;
+        for (size_t j = 0; j < counts[i]; j++)
+        {
+            strings += snprintf(NULL, 0, "%f", samples[j].temperature / 100.f);
+            strings += snprintf(NULL, 0, "%f", samples[j].humidity / 100.f);
+        }
+
+        char json[MQTT_PAYLOAD_MAX];
+        uint8_t cbor[MQTT_PAYLOAD_MAX];
+        int json_length = formatTelemetryBatch(json, sizeof(json), 7, samples, counts[i], true) +
+                          formatTelemetryBatch(json, sizeof(json), 7, samples, counts[i], false);
+        int cbor_length = encodeTelemetryBatch(cbor, sizeof(cbor), 7, samples, counts[i]);
+
+        char name[32];
+        snprintf(name, sizeof(name), "%u record%s", (unsigned)counts[i], counts[i] > 1 ? "s" : "");
+        printf("%-20s %12d %12d %12d\n", name, strings, json_length, cbor_length);
+    }
+}
+
+static const Benchmark benchmarks[] = {
+    {"aht20_decode", benchDecode, 2000000},
+    {"aht20_decode_float", benchDecodeFloat, 2000000},
+    {"json_format_batch", benchFormatBatch, 20000},
+    {"cbor_encode_batch", benchEncodeBatch, 200000},
+    {"history_samples", benchHistorySamples, 200},
+    {"history_buckets", benchHistoryBuckets, 200},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static double nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Best of BENCH_RUNS, which filters out most scheduling noise.
+static double measure(const Benchmark *benchmark)
+{
+    benchmark->run(benchmark->iterations / 10);
+
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        double started = nowNs();
+        benchmark->run(benchmark->iterations);
+        double ns_per_op = (nowNs() - started) / benchmark->iterations;
+        if (run == 0 || ns_per_op < best)
+            best = ns_per_op;
+    }
+    return best;
+}
+
+static double baselineOf(const char *path, const char *name)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        exit(1);
+    }
+
+    char line[128];
+    double baseline = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char entry[64];
+        double value;
+        if (line[0] != '#' && sscanf(line, "%63s %lf", entry, &value) == 2 && strcmp(entry, name) == 0)
+            baseline = value;
+    }
+    fclose(file);
+    return baseline;
+}
+
+int main(int argc, char **argv)
+{
+    const char *baselines = argc == 3 && strcmp(argv[1], "--check") == 0 ? argv[2] : NULL;
+    if (argc != 1 && baselines == NULL)
+    {
+        fprintf(stderr, "usage: %s [--check <baselines>]\n", argv[0]);
+        return 2;
+    }
+
+    // Only the server; the sampling and network tasks would add noise.
+    esp_log_level_set("*", ESP_LOG_WARN);
+    StartWWWServer();
+    for (uint32_t i = 0; i < HISTORY_DEPTH; i++)
+        historyAppend(i * 10, 2150 + i % 50, 4500 + i % 70);
+    for (size_t i = 0; i < 2; i++)
+        frames[i][6] = aht20Crc8(frames[i], 6);
+    for (size_t i = 0; i < MQTT_REPLAY_BATCH_SIZE; i++)
+        batch[i] = (TelemetrySample){1000 + i * 10, -1234 + i, 4500 + i};
+
+    int regressions = 0;
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        double ns_per_op = measure(&benchmarks[i]);
+        printf("%-20s %12.1f ns/op", benchmarks[i].name, ns_per_op);
+
+        double baseline = baselines != NULL ? baselineOf(baselines, benchmarks[i].name) : 0;
+        if (baseline > 0)
+        {
+            bool regressed = ns_per_op > baseline * BENCH_TOLERANCE;
+            printf("  baseline %10.1f  %+6.0f%%%s", baseline, (ns_per_op / baseline - 1) * 100,
+                   regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+        }
+        printf("\n");
+    }
+
+    printPayloadSizes();
+    return regressions > 0;
+}
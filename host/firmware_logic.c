@@ -0,0 +1,10 @@
+// Every driver-independent header of the firmware, compiled for the host.
+// Headers have no include guards, so each one is included exactly once.
+
+#include "aht20_decode.h"
+#include "ess_trigger.h"
+#include "history.h"
+#include "cbor.h"
+#include "template.h"
+#include "asset_pack.h"
+#include "duty_cycle.h"
@@ -0,0 +1,266 @@
+// A small recursive descent JSON parser behind the cJSON API. Strings
+// keep their escapes undecoded except for \" and \\, which is all the
+// firmware's request bodies need.
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+
+#define JSON_MAX_DEPTH 16
+
+typedef struct
+{
+    const char *at;
+    const char *end;
+    int depth;
+} Parser;
+
+static void skipSpace(Parser *parser)
+{
+    while (parser->at < parser->end && isspace((unsigned char)*parser->at))
+        parser->at++;
+}
+
+static bool consume(Parser *parser, const char *literal)
+{
+    size_t length = strlen(literal);
+    if ((size_t)(parser->end - parser->at) < length || memcmp(parser->at, literal, length) != 0)
+        return false;
+    parser->at += length;
+    return true;
+}
+
+static char *parseString(Parser *parser)
+{
+    if (!consume(parser, "\""))
+        return NULL;
+
+    const char *start = parser->at;
+    while (parser->at < parser->end && *parser->at != '"')
+        parser->at += *parser->at == '\\' ? 2 : 1;
+    if (parser->at >= parser->end)
+        return NULL;
+
+    char *string = malloc(parser->at - start + 1);
+    size_t length = 0;
+    for (const char *c = start; c < parser->at; c++)
+    {
+        if (*c == '\\' && (c[1] == '"' || c[1] == '\\'))
+            c++;
+        string[length++] = *c;
+    }
+    string[length] = '\0';
+    parser->at++;
+    return string;
+}
+
+static cJSON *parseValue(Parser *parser);
+
+// Parses the members of an array or object up to the closing bracket.
+static bool parseMembers(Parser *parser, cJSON *item, char close, bool named)
+{
+    skipSpace(parser);
+    if (parser->at < parser->end && *parser->at == close)
+    {
+        parser->at++;
+        return true;
+    }
+
+    cJSON *last = NULL;
+    while (1)
+    {
+        char *name = NULL;
+        if (named)
+        {
+            skipSpace(parser);
+            name = parseString(parser);
+            skipSpace(parser);
+            if (name == NULL || !consume(parser, ":"))
+            {
+                free(name);
+                return false;
+            }
+        }
+
+        cJSON *child = parseValue(parser);
+        if (child == NULL)
+        {
+            free(name);
+            return false;
+        }
+        child->string = name;
+        child->prev = last;
+        if (last != NULL)
+            last->next = child;
+        else
+            item->child = child;
+        last = child;
+
+        skipSpace(parser);
+        if (consume(parser, ","))
+            continue;
+        return parser->at < parser->end && *parser->at++ == close;
+    }
+}
+
+static cJSON *parseValue(Parser *parser)
+{
+    skipSpace(parser);
+    if (parser->at >= parser->end || ++parser->depth > JSON_MAX_DEPTH)
+        return NULL;
+
+    cJSON *item = calloc(1, sizeof(*item));
+    bool ok = true;
+    char c = *parser->at;
+    if (c == '{' || c == '[')
+    {
+        parser->at++;
+        item->type = c == '{' ? cJSON_Object : cJSON_Array;
+        ok = parseMembers(parser, item, c == '{' ? '}' : ']', c == '{');
+    }
+    else if (c == '"')
+    {
+        item->type = cJSON_String;
+        item->valuestring = parseString(parser);
+        ok = item->valuestring != NULL;
+    }
+    else if (consume(parser, "true"))
+    {
+        item->type = cJSON_True;
+        item->valueint = 1;
+    }
+    else if (consume(parser, "false"))
+    {
+        item->type = cJSON_False;
+    }
+    else if (consume(parser, "null"))
+    {
+        item->type = cJSON_NULL;
+    }
+    else
+    {
+        // strtod needs a terminated copy, the input may not be.
+        char number[64];
+        size_t length = 0;
+        while (parser->at + length < parser->end && length < sizeof(number) - 1 &&
+               strchr("+-0123456789.eE", parser->at[length]) != NULL)
+            length++;
+        memcpy(number, parser->at, length);
+        number[length] = '\0';
+
+        char *end;
+        item->type = cJSON_Number;
+        item->valuedouble = strtod(number, &end);
+        item->valueint = item->valuedouble >= 2147483647.0    ? 2147483647
+                         : item->valuedouble <= -2147483648.0 ? -2147483647 - 1
+                                                              : (int)item->valuedouble;
+        ok = length > 0 && end == number + length;
+        parser->at += length;
+    }
+
+    parser->depth--;
+    if (!ok)
+    {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON *cJSON_ParseWithLength(const char *value, size_t buffer_length)
+{
+    if (value == NULL)
+        return NULL;
+
+    Parser parser = {value, value + buffer_length, 0};
+    cJSON *item = parseValue(&parser);
+    skipSpace(&parser);
+    if (item != NULL && parser.at < parser.end && *parser.at != '\0')
+    {
+        cJSON_Delete(item);
+        return NULL;
+    }
+    return item;
+}
+
+cJSON *cJSON_Parse(const char *value)
+{
+    return value != NULL ? cJSON_ParseWithLength(value, strlen(value)) : NULL;
+}
+
+void cJSON_Delete(cJSON *item)
+{
+    while (item != NULL)
+    {
+        cJSON *next = item->next;
+        cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+cJSON *cJSON_GetObjectItemCaseSensitive(const cJSON *object, const char *string)
+{
+    if (object == NULL || string == NULL)
+        return NULL;
+
+    for (cJSON *child = object->child; child != NULL; child = child->next)
+    {
+        if (child->string != NULL && strcmp(child->string, string) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+int cJSON_GetArraySize(const cJSON *array)
+{
+    int size = 0;
+    for (const cJSON *child = array != NULL ? array->child : NULL; child != NULL; child = child->next)
+        size++;
+    return size;
+}
+
+cJSON_bool cJSON_IsFalse(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_False;
+}
+
+cJSON_bool cJSON_IsTrue(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_True;
+}
+
+cJSON_bool cJSON_IsBool(const cJSON *item)
+{
+    return item != NULL && (item->type == cJSON_True || item->type == cJSON_False);
+}
+
+cJSON_bool cJSON_IsNull(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_NULL;
+}
+
+cJSON_bool cJSON_IsNumber(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Number;
+}
+
+cJSON_bool cJSON_IsString(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_String;
+}
+
+cJSON_bool cJSON_IsArray(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Array;
+}
+
+cJSON_bool cJSON_IsObject(const cJSON *item)
+{
+    return item != NULL && item->type == cJSON_Object;
+}
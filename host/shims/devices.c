@@ -0,0 +1,260 @@
+// GPIO levels and an AHT20 humidity and temperature sensor on I2C port 0,
+// modelled after the datasheet: 0xE1 calibrates, 0xAC triggers a
+// conversion, reads return the status byte followed by the 7-byte frame.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "mock.h"
+#include "mock_internal.h"
+
+#define AHT20_ADDRESS 0x38
+#define AHT20_CMD_TRIGGER 0xAC
+#define AHT20_CMD_CALIBRATE 0xE1
+#define AHT20_CMD_SOFTRESET 0xBA
+#define AHT20_BUSY 0x80
+#define AHT20_CALIBRATED 0x08
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct
+{
+    bool output[GPIO_NUM_MAX];
+    int level[GPIO_NUM_MAX];
+} gpio;
+
+static struct
+{
+    bool installed;
+    bool converting;
+    unsigned busy_left;
+} aht20;
+
+static bool validPin(gpio_num_t pin)
+{
+    return pin >= 0 && pin < GPIO_NUM_MAX;
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    if (config->pin_bit_mask == 0 || config->pin_bit_mask >> GPIO_NUM_MAX != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&devices_lock);
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+        if (config->pin_bit_mask & (1ULL << pin))
+            gpio.output[pin] = config->mode & GPIO_MODE_OUTPUT;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    if (!validPin(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&devices_lock);
+    gpio.output[gpio_num] = mode & GPIO_MODE_OUTPUT;
+    pthread_mutex_unlock(&devices_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (!validPin(gpio_num))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&devices_lock);
+    gpio.level[gpio_num] = level != 0;
+    pthread_mutex_unlock(&devices_lock);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    return mockGpioLevel(gpio_num);
+}
+
+int mockGpioLevel(gpio_num_t pin)
+{
+    if (!validPin(pin))
+        return 0;
+
+    pthread_mutex_lock(&devices_lock);
+    int level = gpio.level[pin];
+    pthread_mutex_unlock(&devices_lock);
+    return level;
+}
+
+bool mockGpioIsOutput(gpio_num_t pin)
+{
+    if (!validPin(pin))
+        return false;
+
+    pthread_mutex_lock(&devices_lock);
+    bool output = gpio.output[pin];
+    pthread_mutex_unlock(&devices_lock);
+    return output;
+}
+
+static uint8_t crc8(const uint8_t *data, size_t length)
+{
+    uint8_t crc = 0xFF;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+    }
+    return crc;
+}
+
+void mockAht20Defaults(MockShared *state)
+{
+    // 21.50 degC, 45.00 %RH
+    state->aht20.humidity_raw = 471860;
+    state->aht20.temperature_raw = 374866;
+}
+
+// Raw values are rounded up, so the firmware's truncating conversion gives
+// the requested reading back.
+void mockAht20Set(int32_t centi_celsius, uint32_t centi_percent)
+{
+    uint32_t humidity_raw = (uint32_t)(((uint64_t)centi_percent << 20) + 9999) / 10000;
+    uint32_t temperature_raw = (uint32_t)((((uint64_t)(centi_celsius + 5000)) << 20) + 19999) / 20000;
+    mockAht20SetRaw(humidity_raw, temperature_raw);
+}
+
+void mockAht20SetRaw(uint32_t humidity_raw, uint32_t temperature_raw)
+{
+    pthread_mutex_lock(&devices_lock);
+    mockShared()->aht20.humidity_raw = humidity_raw & 0xFFFFF;
+    mockShared()->aht20.temperature_raw = temperature_raw & 0xFFFFF;
+    pthread_mutex_unlock(&devices_lock);
+}
+
+void mockAht20SetBusyPolls(unsigned polls)
+{
+    mockShared()->aht20.busy_polls = polls;
+}
+
+void mockAht20SetCalibrated(bool calibrated)
+{
+    mockShared()->aht20.uncalibrated = !calibrated;
+}
+
+void mockAht20SetPresent(bool present)
+{
+    mockShared()->aht20.absent = !present;
+}
+
+void mockAht20CorruptNextFrame(void)
+{
+    mockShared()->aht20.corrupt_next = true;
+}
+
+unsigned mockAht20Transfers(void)
+{
+    pthread_mutex_lock(&devices_lock);
+    unsigned transfers = mockShared()->aht20.transfers;
+    pthread_mutex_unlock(&devices_lock);
+    return transfers;
+}
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config)
+{
+    return port < I2C_NUM_MAX && config->mode == I2C_MODE_MASTER ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode, size_t slv_rx_buf_len, size_t slv_tx_buf_len,
+                             int intr_alloc_flags)
+{
+    if (port >= I2C_NUM_MAX)
+        return ESP_ERR_INVALID_ARG;
+    if (port == I2C_NUM_0)
+        aht20.installed = true;
+    return ESP_OK;
+}
+
+// Returns the device's ACK: false for the wrong port, address or a missing
+// sensor.
+static bool aht20Addressed(i2c_port_t port, uint8_t device_address)
+{
+    MockShared *state = mockShared();
+    state->aht20.transfers++;
+    return aht20.installed && port == I2C_NUM_0 && device_address == AHT20_ADDRESS && !state->aht20.absent;
+}
+
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t device_address, const uint8_t *write_buffer,
+                                     size_t write_size, TickType_t ticks_to_wait)
+{
+    MockShared *state = mockShared();
+    pthread_mutex_lock(&devices_lock);
+    esp_err_t err = aht20Addressed(port, device_address) ? ESP_OK : ESP_FAIL;
+    if (err == ESP_OK && write_size > 0)
+    {
+        switch (write_buffer[0])
+        {
+        case AHT20_CMD_CALIBRATE:
+            state->aht20.uncalibrated = false;
+            break;
+        case AHT20_CMD_TRIGGER:
+            aht20.converting = true;
+            aht20.busy_left = state->aht20.busy_polls;
+            break;
+        case AHT20_CMD_SOFTRESET:
+            aht20.converting = false;
+            break;
+        default:
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return err;
+}
+
+esp_err_t i2c_master_read_from_device(i2c_port_t port, uint8_t device_address, uint8_t *read_buffer,
+                                      size_t read_size, TickType_t ticks_to_wait)
+{
+    MockShared *state = mockShared();
+    pthread_mutex_lock(&devices_lock);
+    esp_err_t err = aht20Addressed(port, device_address) ? ESP_OK : ESP_FAIL;
+    if (err == ESP_OK)
+    {
+        bool busy = aht20.converting && aht20.busy_left > 0;
+        if (busy)
+            aht20.busy_left--;
+
+        uint32_t humidity = state->aht20.humidity_raw;
+        uint32_t temperature = state->aht20.temperature_raw;
+        uint8_t frame[7] = {
+            (busy ? AHT20_BUSY : 0) | (state->aht20.uncalibrated ? 0 : AHT20_CALIBRATED) | 0x10,
+            humidity >> 12,
+            humidity >> 4,
+            (humidity & 0x0F) << 4 | temperature >> 16,
+            temperature >> 8,
+            temperature,
+        };
+        frame[6] = crc8(frame, 6);
+
+        // A full frame ends the conversion.
+        if (read_size >= sizeof(frame) && !busy)
+        {
+            aht20.converting = false;
+            if (state->aht20.corrupt_next)
+            {
+                frame[6] ^= 0x5A;
+                state->aht20.corrupt_next = false;
+            }
+        }
+
+        memset(read_buffer, 0xFF, read_size);
+        memcpy(read_buffer, frame, read_size < sizeof(frame) ? read_size : sizeof(frame));
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return err;
+}
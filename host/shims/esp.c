@@ -0,0 +1,398 @@
+// esp_system, esp_log, esp_timer, the default event loop and deep sleep.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_event.h"
+#include "esp_heap_caps.h"
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mock.h"
+#include "mock_internal.h"
+
+// Bounds of the RTC_DATA_ATTR section, if the program has one.
+extern uint8_t __start_rtc_data[] __attribute__((weak));
+extern uint8_t __stop_rtc_data[] __attribute__((weak));
+
+static MockShared *shared;
+
+static void mapShared(void)
+{
+    shared = mmap(NULL, sizeof(MockShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        abort();
+
+    memset(shared->pack, 0xFF, sizeof(shared->pack));
+    memset(shared->tlog, 0xFF, sizeof(shared->tlog));
+    mockAht20Defaults(shared);
+}
+
+MockShared *mockShared(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, mapShared);
+    return shared;
+}
+
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static const char letters[] = "NEWIDV";
+    if (level > log_level)
+        return;
+
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    fprintf(stderr, "%c (%lld) %s: %s\n", letters[level], (long long)(esp_timer_get_time() / 1000), tag, line);
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:
+        return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:
+        return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_HTTPD_HANDLERS_FULL:
+        return "ESP_ERR_HTTPD_HANDLERS_FULL";
+    case ESP_ERR_HTTPD_HANDLER_EXISTS:
+        return "ESP_ERR_HTTPD_HANDLER_EXISTS";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 200 * 1024;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return 180 * 1024;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void esp_restart(void)
+{
+    fprintf(stderr, "esp_restart() called\n");
+    abort();
+}
+
+int64_t esp_timer_get_time(void)
+{
+    static int64_t started_us;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_us = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+    if (__atomic_load_n(&started_us, __ATOMIC_RELAXED) == 0)
+    {
+        int64_t unset = 0;
+        __atomic_compare_exchange_n(&started_us, &unset, now_us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    return now_us - started_us;
+}
+
+// One-shot timers, dispatched one after another on a single thread like
+// ESP_TIMER_TASK on the target.
+struct esp_timer
+{
+    esp_timer_create_args_t args;
+    int64_t due_us; // 0 while stopped
+    struct esp_timer *next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct esp_timer *list;
+    bool running;
+} timers = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *runTimers(void *arg)
+{
+    pthread_mutex_lock(&timers.lock);
+    while (1)
+    {
+        struct esp_timer *due = NULL;
+        for (struct esp_timer *timer = timers.list; timer != NULL; timer = timer->next)
+        {
+            if (timer->due_us != 0 && (due == NULL || timer->due_us < due->due_us))
+                due = timer;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        if (due != NULL && due->due_us <= now_us)
+        {
+            due->due_us = 0;
+            pthread_mutex_unlock(&timers.lock);
+            due->args.callback(due->args.arg);
+            pthread_mutex_lock(&timers.lock);
+            continue;
+        }
+
+        if (due == NULL)
+        {
+            pthread_cond_wait(&timers.changed, &timers.lock);
+        }
+        else
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            int64_t wait_ns = (due->due_us - now_us) * 1000 + deadline.tv_nsec;
+            deadline.tv_sec += wait_ns / 1000000000;
+            deadline.tv_nsec = wait_ns % 1000000000;
+            pthread_cond_timedwait(&timers.changed, &timers.lock, &deadline);
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL)
+        return ESP_ERR_NO_MEM;
+    timer->args = *create_args;
+
+    pthread_mutex_lock(&timers.lock);
+    timer->next = timers.list;
+    timers.list = timer;
+    if (!timers.running)
+    {
+        pthread_t thread;
+        timers.running = pthread_create(&thread, NULL, runTimers, NULL) == 0;
+        if (timers.running)
+            pthread_detach(thread);
+    }
+    pthread_mutex_unlock(&timers.lock);
+
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    pthread_mutex_lock(&timers.lock);
+    esp_err_t err = timer->due_us != 0 ? ESP_ERR_INVALID_STATE : ESP_OK;
+    if (err == ESP_OK)
+    {
+        timer->due_us = esp_timer_get_time() + (int64_t)timeout_us;
+        if (timer->due_us == 0)
+            timer->due_us = 1;
+        pthread_cond_signal(&timers.changed);
+    }
+    pthread_mutex_unlock(&timers.lock);
+    return err;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timers.lock);
+    esp_err_t err = timer->due_us == 0 ? ESP_ERR_INVALID_STATE : ESP_OK;
+    timer->due_us = 0;
+    pthread_mutex_unlock(&timers.lock);
+    return err;
+}
+
+// The default event loop: posts are copied into a queue and handlers run
+// on the loop's task.
+#define EVENT_QUEUE_DEPTH 32
+#define EVENT_HANDLERS_MAX 16
+#define EVENT_DATA_MAX 128
+
+typedef struct
+{
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void *arg;
+} EventHandler;
+
+typedef struct
+{
+    esp_event_base_t base;
+    int32_t id;
+    uint8_t data[EVENT_DATA_MAX];
+} Event;
+
+static struct
+{
+    pthread_mutex_t lock;
+    QueueHandle_t queue;
+    EventHandler handlers[EVENT_HANDLERS_MAX];
+    size_t count;
+} events = {PTHREAD_MUTEX_INITIALIZER};
+
+static void eventLoopTask(void *param)
+{
+    Event event;
+    while (1)
+    {
+        if (xQueueReceive(events.queue, &event, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        for (size_t i = 0;; i++)
+        {
+            pthread_mutex_lock(&events.lock);
+            EventHandler handler = i < events.count ? events.handlers[i] : (EventHandler){0};
+            pthread_mutex_unlock(&events.lock);
+            if (handler.handler == NULL)
+                break;
+
+            if (strcmp(handler.base, event.base) == 0 && (handler.id == ESP_EVENT_ANY_ID || handler.id == event.id))
+                handler.handler(handler.arg, event.base, event.id, event.data);
+        }
+    }
+}
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    pthread_mutex_lock(&events.lock);
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (events.queue == NULL)
+    {
+        events.queue = xQueueCreate(EVENT_QUEUE_DEPTH, sizeof(Event));
+        err = events.queue != NULL &&
+                      xTaskCreate(eventLoopTask, "sys_evt", 2304, NULL, 20, NULL) == pdPASS
+                  ? ESP_OK
+                  : ESP_FAIL;
+    }
+    pthread_mutex_unlock(&events.lock);
+    return err;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+                                              esp_event_handler_t event_handler, void *event_handler_arg,
+                                              esp_event_handler_instance_t *instance)
+{
+    pthread_mutex_lock(&events.lock);
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (events.count < EVENT_HANDLERS_MAX)
+    {
+        events.handlers[events.count] = (EventHandler){event_base, event_id, event_handler, event_handler_arg};
+        if (instance != NULL)
+            *instance = &events.handlers[events.count];
+        events.count++;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&events.lock);
+    return err;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data,
+                         size_t event_data_size, TickType_t ticks_to_wait)
+{
+    if (events.queue == NULL)
+        return ESP_ERR_INVALID_STATE;
+    if (event_data_size > EVENT_DATA_MAX)
+        return ESP_ERR_INVALID_ARG;
+
+    Event event = {.base = event_base, .id = event_id};
+    if (event_data != NULL)
+        memcpy(event.data, event_data, event_data_size);
+    return xQueueSend(events.queue, &event, ticks_to_wait) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    mockShared()->rtc.timer_us = time_in_us;
+    return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void)
+{
+    return mockShared()->rtc.size > 0 ? ESP_SLEEP_WAKEUP_TIMER : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+static size_t rtcSize(void)
+{
+    return __start_rtc_data != NULL ? (size_t)(__stop_rtc_data - __start_rtc_data) : 0;
+}
+
+// Only RTC memory survives; the process ends here.
+void esp_deep_sleep_start(void)
+{
+    MockShared *state = mockShared();
+    size_t size = rtcSize();
+    if (size > MOCK_RTC_SIZE)
+        abort();
+
+    memcpy(state->rtc.image, __start_rtc_data, size);
+    state->rtc.size = size;
+    state->rtc.slept = true;
+    fflush(NULL);
+    _exit(0);
+}
+
+bool mockWake(void (*entry)(void), uint64_t *sleep_us)
+{
+    MockShared *state = mockShared();
+    state->rtc.slept = false;
+    fflush(NULL);
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (state->rtc.size == rtcSize() && state->rtc.size > 0)
+            memcpy(__start_rtc_data, state->rtc.image, state->rtc.size);
+        entry();
+        fflush(NULL);
+        _exit(1);
+    }
+
+    int status = 0;
+    if (child < 0 || waitpid(child, &status, 0) != child)
+        return false;
+
+    if (sleep_us != NULL)
+        *sleep_us = state->rtc.timer_us;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && state->rtc.slept;
+}
@@ -0,0 +1,534 @@
+// FreeRTOS on POSIX threads. Every task is a detached thread; blocking
+// calls wait on condition variables with absolute deadlines derived from
+// the tick period, so timeouts behave like on the target at 100 Hz.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define TASK_NAME_MAX 16
+
+struct tskTaskControlBlock
+{
+    char name[TASK_NAME_MAX];
+    TaskFunction_t function;
+    void *param;
+    UBaseType_t priority;
+    UBaseType_t number;
+    bool deleted;
+
+    uint32_t notifications;
+    pthread_cond_t notified;
+
+    struct tskTaskControlBlock *next;
+};
+
+struct QueueDefinition
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t length;
+    UBaseType_t item_size; // 0 for semaphores, which only count
+    UBaseType_t count;
+    UBaseType_t first;
+    uint8_t *items;
+};
+
+struct EventGroupDef_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EventBits_t bits;
+};
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static struct tskTaskControlBlock *tasks;
+static UBaseType_t task_count;
+static UBaseType_t task_numbers;
+static __thread struct tskTaskControlBlock *current_task;
+
+static int64_t monotonicUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static int64_t started_us;
+static pthread_once_t started_once = PTHREAD_ONCE_INIT;
+
+static void recordStart(void)
+{
+    started_us = monotonicUs();
+}
+
+// Ticks count from the first task or tick query.
+static int64_t startUs(void)
+{
+    pthread_once(&started_once, recordStart);
+    return started_us;
+}
+
+static void initCondition(pthread_cond_t *condition)
+{
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(condition, &attributes);
+    pthread_condattr_destroy(&attributes);
+}
+
+// portMAX_DELAY waits forever; a NULL deadline stands for that.
+static const struct timespec *tickDeadline(TickType_t ticks, struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY)
+        return NULL;
+
+    int64_t us = monotonicUs() + (int64_t)ticks * 1000000 / configTICK_RATE_HZ;
+    deadline->tv_sec = us / 1000000;
+    deadline->tv_nsec = us % 1000000 * 1000;
+    return deadline;
+}
+
+static bool waitUntil(pthread_cond_t *condition, pthread_mutex_t *lock, const struct timespec *deadline)
+{
+    if (deadline == NULL)
+        return pthread_cond_wait(condition, lock) == 0;
+    return pthread_cond_timedwait(condition, lock, deadline) != ETIMEDOUT;
+}
+
+static struct tskTaskControlBlock *registerTask(const char *name, TaskFunction_t function, void *param,
+                                                UBaseType_t priority)
+{
+    struct tskTaskControlBlock *task = calloc(1, sizeof(*task));
+    if (task == NULL)
+        return NULL;
+
+    strncpy(task->name, name, TASK_NAME_MAX - 1);
+    task->function = function;
+    task->param = param;
+    task->priority = priority;
+    initCondition(&task->notified);
+
+    pthread_mutex_lock(&tasks_lock);
+    task->number = ++task_numbers;
+    task->next = tasks;
+    tasks = task;
+    task_count++;
+    pthread_mutex_unlock(&tasks_lock);
+    return task;
+}
+
+// Threads that were not created as tasks, like the test's main thread,
+// become one on first use.
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (current_task == NULL)
+        current_task = registerTask("main", NULL, NULL, 1);
+    return current_task;
+}
+
+static void *runTask(void *arg)
+{
+    current_task = arg;
+    current_task->function(current_task->param);
+
+    // Returning from a task function is an error on the target.
+    abort();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *param,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    startUs();
+    struct tskTaskControlBlock *task = registerTask(name, function, param, priority);
+    if (task == NULL)
+        return pdFAIL;
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int err = pthread_create(&thread, &attributes, runTask, task);
+    pthread_attr_destroy(&attributes);
+    if (err != 0)
+        return pdFAIL;
+
+    if (created_task != NULL)
+        *created_task = task;
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *param,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    return xTaskCreatePinnedToCore(function, name, stack_depth, param, priority, created_task, tskNO_AFFINITY);
+}
+
+// Only tasks deleting themselves are supported. The control block stays
+// allocated, since handles to it may still be around.
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task != NULL && task != current_task)
+        abort();
+
+    pthread_mutex_lock(&tasks_lock);
+    current_task->deleted = true;
+    task_count--;
+    pthread_mutex_unlock(&tasks_lock);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+    {
+        sched_yield();
+        return;
+    }
+    usleep((useconds_t)((uint64_t)ticks * 1000000 / configTICK_RATE_HZ));
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)((monotonicUs() - startUs()) * configTICK_RATE_HZ / 1000000);
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake_time, TickType_t time_increment)
+{
+    *previous_wake_time += time_increment;
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(*previous_wake_time - now) > 0)
+        vTaskDelay(*previous_wake_time - now);
+}
+
+const char *pcTaskGetName(TaskHandle_t task)
+{
+    return (task != NULL ? task : xTaskGetCurrentTaskHandle())->name;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    pthread_mutex_lock(&tasks_lock);
+    UBaseType_t count = task_count;
+    pthread_mutex_unlock(&tasks_lock);
+    return count;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *task_status_array, UBaseType_t array_size, uint32_t *total_run_time)
+{
+    UBaseType_t count = 0;
+    pthread_mutex_lock(&tasks_lock);
+    if (array_size >= task_count)
+    {
+        for (struct tskTaskControlBlock *task = tasks; task != NULL; task = task->next)
+        {
+            if (task->deleted)
+                continue;
+
+            task_status_array[count++] = (TaskStatus_t){
+                .xHandle = task,
+                .pcTaskName = task->name,
+                .xTaskNumber = task->number,
+                .eCurrentState = task == current_task ? eRunning : eBlocked,
+                .uxCurrentPriority = task->priority,
+                .uxBasePriority = task->priority,
+                .usStackHighWaterMark = 1024,
+                .xCoreID = tskNO_AFFINITY,
+            };
+        }
+    }
+    pthread_mutex_unlock(&tasks_lock);
+
+    if (total_run_time != NULL)
+        *total_run_time = 0;
+    return count;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return 1024;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&tasks_lock);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&tasks_lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait)
+{
+    struct tskTaskControlBlock *task = xTaskGetCurrentTaskHandle();
+    struct timespec storage;
+    const struct timespec *deadline = tickDeadline(ticks_to_wait, &storage);
+
+    pthread_mutex_lock(&tasks_lock);
+    while (task->notifications == 0 && ticks_to_wait > 0 && waitUntil(&task->notified, &tasks_lock, deadline))
+        ;
+
+    uint32_t value = task->notifications;
+    if (value > 0)
+        task->notifications = clear_count_on_exit ? 0 : value - 1;
+    pthread_mutex_unlock(&tasks_lock);
+    return value;
+}
+
+// One lock for all critical sections, recursive like nested sections on
+// the target. Interrupts do not exist here.
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    pthread_mutex_lock(&critical_lock);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+static QueueHandle_t createQueue(UBaseType_t length, UBaseType_t item_size, UBaseType_t count)
+{
+    QueueHandle_t queue = calloc(1, sizeof(*queue));
+    if (queue == NULL)
+        return NULL;
+
+    queue->items = item_size > 0 ? calloc(length, item_size) : NULL;
+    if (item_size > 0 && queue->items == NULL)
+    {
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    initCondition(&queue->changed);
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->count = count;
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    return length > 0 ? createQueue(length, item_size, 0) : NULL;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    free(queue->items);
+    free(queue);
+}
+
+static BaseType_t queueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool front,
+                            bool overwrite)
+{
+    struct timespec storage;
+    const struct timespec *deadline = tickDeadline(ticks_to_wait, &storage);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length && !overwrite && ticks_to_wait > 0 &&
+           waitUntil(&queue->changed, &queue->lock, deadline))
+        ;
+
+    BaseType_t sent = pdFALSE;
+    if (queue->count < queue->length || overwrite)
+    {
+        if (queue->item_size > 0 && item != NULL)
+        {
+            UBaseType_t slot;
+            if (overwrite && queue->count == queue->length)
+                slot = (queue->first + queue->count - 1) % queue->length;
+            else if (front)
+                slot = queue->first = (queue->first + queue->length - 1) % queue->length;
+            else
+                slot = (queue->first + queue->count) % queue->length;
+            memcpy(queue->items + slot * queue->item_size, item, queue->item_size);
+        }
+        if (queue->count < queue->length)
+            queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+        sent = pdTRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return sent;
+}
+
+static BaseType_t queueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait, bool peek)
+{
+    struct timespec storage;
+    const struct timespec *deadline = tickDeadline(ticks_to_wait, &storage);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && ticks_to_wait > 0 && waitUntil(&queue->changed, &queue->lock, deadline))
+        ;
+
+    BaseType_t received = pdFALSE;
+    if (queue->count > 0)
+    {
+        if (queue->item_size > 0)
+            memcpy(buffer, queue->items + queue->first * queue->item_size, queue->item_size);
+        if (!peek)
+        {
+            queue->first = (queue->first + 1) % queue->length;
+            queue->count--;
+            pthread_cond_broadcast(&queue->changed);
+        }
+        received = pdTRUE;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return received;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    return queueSend(queue, item, ticks_to_wait, false, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    return queueSend(queue, item, ticks_to_wait, false, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    return queueSend(queue, item, ticks_to_wait, true, false);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+    return queueSend(queue, item, 0, false, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    return queueReceive(queue, buffer, ticks_to_wait, false);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    return queueReceive(queue, buffer, ticks_to_wait, true);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return createQueue(1, 0, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return createQueue(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return createQueue(max_count, 0, initial_count);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    return queueReceive(semaphore, NULL, ticks_to_wait, false);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return queueSend(semaphore, NULL, 0, false, false);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    vQueueDelete(semaphore);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    EventGroupHandle_t group = calloc(1, sizeof(*group));
+    if (group == NULL)
+        return NULL;
+
+    pthread_mutex_init(&group->lock, NULL);
+    initCondition(&group->changed);
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->changed);
+    free(group);
+}
+
+static bool bitsSatisfied(EventBits_t bits, EventBits_t wanted, BaseType_t wait_for_all_bits)
+{
+    return wait_for_all_bits ? (bits & wanted) == wanted : (bits & wanted) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits_to_wait_for, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all_bits, TickType_t ticks_to_wait)
+{
+    struct timespec storage;
+    const struct timespec *deadline = tickDeadline(ticks_to_wait, &storage);
+
+    pthread_mutex_lock(&group->lock);
+    while (!bitsSatisfied(group->bits, bits_to_wait_for, wait_for_all_bits) && ticks_to_wait > 0 &&
+           waitUntil(&group->changed, &group->lock, deadline))
+        ;
+
+    EventBits_t bits = group->bits;
+    if (clear_on_exit && bitsSatisfied(bits, bits_to_wait_for, wait_for_all_bits))
+        group->bits &= ~bits_to_wait_for;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits_to_set)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits |= bits_to_set;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits_to_clear)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits;
+    group->bits &= ~bits_to_clear;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
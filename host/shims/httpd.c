@@ -0,0 +1,654 @@
+// esp_http_server without a network. The calling thread of
+// mockHttpdRequest() plays the server task: handlers, open_fn and close_fn
+// all run under one lock, and closes triggered from elsewhere are queued for
+// a thread that takes the same lock, like the control socket of the real
+// server.
+//
+// Each session holds a real, unconnected socket, so descriptor numbers are
+// reused the way lwIP reuses them: only after close(). With a close_fn set,
+// closing it is up to the firmware, as on the device.
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_http_server.h"
+#include "mock.h"
+
+#define MOCK_SESSIONS 16
+#define MOCK_CONTROL_DEPTH 32
+
+typedef struct
+{
+    bool open;
+    int fd;
+    bool websocket;
+    char *output;
+    size_t length;
+    size_t capacity;
+} Session;
+
+// The request's aux: what the client sent and what the handler answers.
+typedef struct
+{
+    int fd;
+    const char *headers;
+    const char *body;
+    size_t body_read;
+    MockHttpResponse *response;
+} RequestAux;
+
+typedef struct
+{
+    httpd_work_fn_t work;
+    void *arg;
+    int fd; // for closes, when work is NULL
+} ControlMessage;
+
+static struct
+{
+    pthread_mutex_t task;      // held by whoever acts as the server task
+    pthread_mutex_t lock;      // sessions and control queue
+    pthread_cond_t changed;    // new output or a queued control message
+    bool started;
+    httpd_config_t config;
+    httpd_uri_t *handlers;
+    size_t handler_count;
+    Session sessions[MOCK_SESSIONS];
+    ControlMessage control[MOCK_CONTROL_DEPTH];
+    size_t control_count;
+} server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static Session *findSession(int fd)
+{
+    for (size_t i = 0; i < MOCK_SESSIONS; i++)
+    {
+        if (server.sessions[i].open && server.sessions[i].fd == fd)
+            return &server.sessions[i];
+    }
+    return NULL;
+}
+
+static void appendOutput(Session *session, const void *data, size_t length)
+{
+    if (session->length + length + 1 > session->capacity)
+    {
+        size_t capacity = (session->length + length + 1) * 2;
+        char *output = realloc(session->output, capacity);
+        if (output == NULL)
+            abort();
+        session->output = output;
+        session->capacity = capacity;
+    }
+    memcpy(session->output + session->length, data, length);
+    session->length += length;
+    session->output[session->length] = '\0';
+    pthread_cond_broadcast(&server.changed);
+}
+
+// Runs as the server task.
+static void closeSession(int fd)
+{
+    pthread_mutex_lock(&server.lock);
+    bool open = findSession(fd) != NULL;
+    pthread_mutex_unlock(&server.lock);
+    if (!open)
+        return;
+
+    if (server.config.close_fn != NULL)
+        server.config.close_fn(&server, fd);
+    else
+        close(fd);
+
+    pthread_mutex_lock(&server.lock);
+    Session *session = findSession(fd);
+    free(session->output);
+    *session = (Session){0};
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void *controlTask(void *arg)
+{
+    pthread_mutex_lock(&server.lock);
+    while (1)
+    {
+        while (server.control_count == 0)
+            pthread_cond_wait(&server.changed, &server.lock);
+
+        ControlMessage message = server.control[0];
+        memmove(server.control, server.control + 1, --server.control_count * sizeof(ControlMessage));
+        pthread_mutex_unlock(&server.lock);
+
+        pthread_mutex_lock(&server.task);
+        if (message.work != NULL)
+            message.work(message.arg);
+        else
+            closeSession(message.fd);
+        pthread_mutex_unlock(&server.task);
+
+        pthread_mutex_lock(&server.lock);
+    }
+    return NULL;
+}
+
+static esp_err_t queueControl(ControlMessage message)
+{
+    pthread_mutex_lock(&server.lock);
+    esp_err_t err = server.started && server.control_count < MOCK_CONTROL_DEPTH ? ESP_OK : ESP_FAIL;
+    if (err == ESP_OK)
+    {
+        server.control[server.control_count++] = message;
+        pthread_cond_broadcast(&server.changed);
+    }
+    pthread_mutex_unlock(&server.lock);
+    return err;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    if (server.started || config->max_open_sockets > MOCK_SESSIONS)
+        return ESP_ERR_HTTPD_TASK;
+
+    server.handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    if (server.handlers == NULL)
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, controlTask, NULL) != 0)
+        return ESP_ERR_HTTPD_TASK;
+    pthread_detach(thread);
+
+    server.config = *config;
+    server.started = true;
+    *handle = &server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    if (handle != &server || uri_handler == NULL || uri_handler->uri == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < server.handler_count; i++)
+    {
+        if (server.handlers[i].method == uri_handler->method && strcmp(server.handlers[i].uri, uri_handler->uri) == 0)
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    }
+    if (server.handler_count == server.config.max_uri_handlers)
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+
+    httpd_uri_t *copy = &server.handlers[server.handler_count];
+    *copy = *uri_handler;
+    copy->uri = strdup(uri_handler->uri);
+    if (copy->uri == NULL)
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+
+    server.handler_count++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg)
+{
+    return work != NULL ? queueControl((ControlMessage){.work = work, .arg = arg}) : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    pthread_mutex_lock(&server.lock);
+    bool open = findSession(sockfd) != NULL;
+    pthread_mutex_unlock(&server.lock);
+    return open ? queueControl((ControlMessage){.fd = sockfd}) : ESP_ERR_NOT_FOUND;
+}
+
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags)
+{
+    pthread_mutex_lock(&server.lock);
+    Session *session = findSession(sockfd);
+    if (session != NULL)
+        appendOutput(session, buf, buf_len);
+    pthread_mutex_unlock(&server.lock);
+    return session != NULL ? (int)buf_len : HTTPD_SOCK_ERR_INVALID;
+}
+
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    size_t length = strlen(uri_template);
+    if (length > 0 && uri_template[length - 1] == '*')
+        return match_upto >= length - 1 && strncmp(uri_template, uri_to_match, length - 1) == 0;
+    return length == match_upto && strncmp(uri_template, uri_to_match, match_upto) == 0;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return r != NULL ? ((RequestAux *)r->aux)->fd : -1;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    RequestAux *aux = r->aux;
+    size_t length = r->content_len - aux->body_read;
+    if (length > buf_len)
+        length = buf_len;
+
+    memcpy(buf, aux->body + aux->body_read, length);
+    aux->body_read += length;
+    return length;
+}
+
+// Finds "Field: value\r\n" in the request headers; the value's length is
+// returned in *length.
+static const char *findHeader(httpd_req_t *r, const char *field, size_t *length)
+{
+    const char *line = ((RequestAux *)r->aux)->headers;
+    size_t field_length = strlen(field);
+    while (line != NULL && *line != '\0')
+    {
+        const char *end = strstr(line, "\r\n");
+        if (end == NULL)
+            end = line + strlen(line);
+
+        if (strncasecmp(line, field, field_length) == 0 && line[field_length] == ':')
+        {
+            const char *value = line + field_length + 1;
+            while (value < end && *value == ' ')
+                value++;
+            *length = end - value;
+            return value;
+        }
+        line = *end != '\0' ? end + 2 : end;
+    }
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    size_t length = 0;
+    return findHeader(r, field, &length) != NULL ? length : 0;
+}
+
+static esp_err_t copyValue(const char *value, size_t length, char *out, size_t size)
+{
+    if (size == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(out, value, copied);
+    out[copied] = '\0';
+    return copied < length ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    size_t length = 0;
+    const char *value = findHeader(r, field, &length);
+    return value != NULL ? copyValue(value, length, val, val_size) : ESP_ERR_NOT_FOUND;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *query = strchr(r->uri, '?');
+    return query != NULL ? strlen(query + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    const char *query = strchr(r->uri, '?');
+    return query != NULL ? copyValue(query + 1, strlen(query + 1), buf, buf_len) : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t key_length = strlen(key);
+    const char *pair = qry;
+    while (pair != NULL && *pair != '\0')
+    {
+        const char *end = strchr(pair, '&');
+        if (end == NULL)
+            end = pair + strlen(pair);
+
+        if (strncmp(pair, key, key_length) == 0 && pair[key_length] == '=')
+            return copyValue(pair + key_length + 1, end - pair - key_length - 1, val, val_size);
+        pair = *end != '\0' ? end + 1 : end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+static MockHttpResponse *responseOf(httpd_req_t *r)
+{
+    return ((RequestAux *)r->aux)->response;
+}
+
+static void appendBody(MockHttpResponse *response, const char *data, size_t length)
+{
+    char *body = realloc(response->body, response->length + length + 1);
+    if (body == NULL)
+        abort();
+
+    memcpy(body + response->length, data, length);
+    response->body = body;
+    response->length += length;
+    body[response->length] = '\0';
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    copyValue(status, strlen(status), responseOf(r)->status, sizeof(responseOf(r)->status));
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    copyValue(type, strlen(type), responseOf(r)->type, sizeof(responseOf(r)->type));
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    MockHttpResponse *response = responseOf(r);
+    size_t used = strlen(response->headers);
+    int length = snprintf(response->headers + used, sizeof(response->headers) - used, "%s: %s\r\n", field, value);
+    return length > 0 && (size_t)length < sizeof(response->headers) - used ? ESP_OK : ESP_ERR_HTTPD_RESP_HDR;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    MockHttpResponse *response = responseOf(r);
+    if (response->complete || response->chunked)
+        return ESP_ERR_HTTPD_INVALID_REQ;
+
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    if (buf != NULL && buf_len > 0)
+        appendBody(response, buf, buf_len);
+    response->complete = true;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    MockHttpResponse *response = responseOf(r);
+    if (response->complete)
+        return ESP_ERR_HTTPD_INVALID_REQ;
+
+    if (buf_len == HTTPD_RESP_USE_STRLEN)
+        buf_len = buf != NULL ? strlen(buf) : 0;
+    response->chunked = true;
+    if (buf == NULL || buf_len == 0)
+        response->complete = true;
+    else
+        appendBody(response, buf, buf_len);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str)
+{
+    return httpd_resp_send(r, str, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *r, const char *str)
+{
+    return httpd_resp_send_chunk(r, str, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg)
+{
+    static const struct
+    {
+        httpd_err_code_t code;
+        const char *status;
+        const char *message;
+    } errors[] = {
+        {HTTPD_400_BAD_REQUEST, "400 Bad Request", "Bad request syntax"},
+        {HTTPD_404_NOT_FOUND, "404 Not Found", "This URI does not exist"},
+        {HTTPD_405_METHOD_NOT_ALLOWED, "405 Method Not Allowed", "Request method for this URI is not handled by server"},
+        {HTTPD_408_REQ_TIMEOUT, "408 Request Timeout", "Server closed this connection"},
+        {HTTPD_500_INTERNAL_SERVER_ERROR, "500 Internal Server Error", "Server has encountered an unexpected error"},
+    };
+
+    const char *status = "500 Internal Server Error";
+    const char *message = "Server has encountered an unexpected error";
+    for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++)
+    {
+        if (errors[i].code == error)
+        {
+            status = errors[i].status;
+            message = errors[i].message;
+        }
+    }
+
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_send(req, msg != NULL ? msg : message, HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt, size_t max_len)
+{
+    RequestAux *aux = req->aux;
+    size_t length = req->content_len - aux->body_read;
+    pkt->type = HTTPD_WS_TYPE_TEXT;
+    pkt->final = true;
+    pkt->len = length;
+    if (max_len == 0)
+        return ESP_OK;
+    if (length > max_len)
+        return ESP_ERR_INVALID_SIZE;
+
+    httpd_req_recv(req, (char *)pkt->payload, length);
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame)
+{
+    pthread_mutex_lock(&server.lock);
+    Session *session = findSession(fd);
+    bool sent = session != NULL && session->websocket;
+    if (sent)
+    {
+        appendOutput(session, frame->payload, frame->len);
+        appendOutput(session, "\n", 1);
+    }
+    pthread_mutex_unlock(&server.lock);
+    return sent ? ESP_OK : ESP_FAIL;
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd)
+{
+    pthread_mutex_lock(&server.lock);
+    Session *session = findSession(fd);
+    httpd_ws_client_info_t info = session == NULL     ? HTTPD_WS_CLIENT_INVALID
+                                  : session->websocket ? HTTPD_WS_CLIENT_WEBSOCKET
+                                                       : HTTPD_WS_CLIENT_HTTP;
+    pthread_mutex_unlock(&server.lock);
+    return info;
+}
+
+// Like the real server, an open_fn error refuses the connection; -1 then.
+int mockHttpdConnect(void)
+{
+    pthread_mutex_lock(&server.task);
+    pthread_mutex_lock(&server.lock);
+    int fd = -1;
+    size_t open_count = 0;
+    for (size_t i = 0; i < MOCK_SESSIONS; i++)
+        open_count += server.sessions[i].open;
+
+    for (size_t i = 0; i < MOCK_SESSIONS && fd < 0 && server.started && open_count < server.config.max_open_sockets; i++)
+    {
+        if (!server.sessions[i].open)
+        {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0)
+                abort();
+            server.sessions[i] = (Session){.open = true, .fd = fd};
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if (fd >= 0 && server.config.open_fn != NULL && server.config.open_fn(&server, fd) != ESP_OK)
+    {
+        pthread_mutex_lock(&server.lock);
+        *findSession(fd) = (Session){0};
+        pthread_mutex_unlock(&server.lock);
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&server.task);
+    return fd;
+}
+
+void mockHttpdDisconnect(int fd)
+{
+    pthread_mutex_lock(&server.task);
+    closeSession(fd);
+    pthread_mutex_unlock(&server.task);
+}
+
+bool mockHttpdIsOpen(int fd)
+{
+    pthread_mutex_lock(&server.lock);
+    bool open = findSession(fd) != NULL;
+    pthread_mutex_unlock(&server.lock);
+    return open;
+}
+
+static const httpd_uri_t *findHandler(const char *uri, httpd_method_t method, bool *uri_known)
+{
+    size_t path_length = strcspn(uri, "?");
+    *uri_known = false;
+    for (size_t i = 0; i < server.handler_count; i++)
+    {
+        const httpd_uri_t *handler = &server.handlers[i];
+        bool matches = server.config.uri_match_fn != NULL
+                           ? server.config.uri_match_fn(handler->uri, uri, path_length)
+                           : strlen(handler->uri) == path_length && strncmp(handler->uri, uri, path_length) == 0;
+        if (!matches)
+            continue;
+
+        *uri_known = true;
+        if (handler->method == method)
+            return handler;
+    }
+    return NULL;
+}
+
+esp_err_t mockHttpdRequest(int fd, httpd_method_t method, const char *uri, const char *headers, const char *body,
+                           MockHttpResponse *response)
+{
+    MockHttpResponse discarded;
+    if (response == NULL)
+        response = &discarded;
+    *response = (MockHttpResponse){.status = "200 OK", .type = "text/html"};
+
+    if (strlen(uri) > HTTPD_MAX_URI_LEN)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&server.task);
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (mockHttpdIsOpen(fd))
+    {
+        RequestAux aux = {.fd = fd, .headers = headers, .body = body != NULL ? body : "", .response = response};
+        httpd_req_t *request = calloc(1, sizeof(httpd_req_t));
+        if (request == NULL)
+            abort();
+        request->handle = &server;
+        request->method = method;
+        request->content_len = strlen(aux.body);
+        request->aux = &aux;
+        strcpy((char *)request->uri, uri);
+
+        bool uri_known;
+        const httpd_uri_t *handler = findHandler(uri, method, &uri_known);
+        if (handler == NULL)
+        {
+            err = httpd_resp_send_err(request, uri_known ? HTTPD_405_METHOD_NOT_ALLOWED : HTTPD_404_NOT_FOUND, NULL);
+        }
+        else
+        {
+            request->user_ctx = handler->user_ctx;
+            size_t length;
+            const char *upgrade = findHeader(request, "Upgrade", &length);
+            if (handler->is_websocket && method == HTTP_GET && upgrade != NULL && strncasecmp(upgrade, "websocket", 9) == 0)
+            {
+                pthread_mutex_lock(&server.lock);
+                findSession(fd)->websocket = true;
+                pthread_mutex_unlock(&server.lock);
+                strcpy(response->status, "101 Switching Protocols");
+                response->complete = true;
+            }
+            err = handler->handler(request);
+        }
+        free(request);
+
+        if (err != ESP_OK)
+            closeSession(fd);
+    }
+    pthread_mutex_unlock(&server.task);
+
+    if (response == &discarded)
+        mockHttpResponseFree(response);
+    return err;
+}
+
+void mockHttpResponseFree(MockHttpResponse *response)
+{
+    free(response->body);
+    response->body = NULL;
+    response->length = 0;
+}
+
+size_t mockHttpdTakeOutput(int fd, char *buffer, size_t size)
+{
+    size_t length = 0;
+    pthread_mutex_lock(&server.lock);
+    Session *session = findSession(fd);
+    if (session != NULL && session->output != NULL && size > 0)
+    {
+        length = session->length < size - 1 ? session->length : size - 1;
+        memcpy(buffer, session->output, length);
+        memmove(session->output, session->output + length, session->length - length);
+        session->length -= length;
+        session->output[session->length] = '\0';
+    }
+    if (size > 0)
+        buffer[length] = '\0';
+    pthread_mutex_unlock(&server.lock);
+    return length;
+}
+
+bool mockHttpdWaitOutput(int fd, const char *text, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&server.lock);
+    bool found = false;
+    while (1)
+    {
+        Session *session = findSession(fd);
+        found = session != NULL && session->output != NULL && strstr(session->output, text) != NULL;
+        if (found || session == NULL || pthread_cond_timedwait(&server.changed, &server.lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&server.lock);
+    return found;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#define IRAM_ATTR
+// RTC memory is a section of its own, so a simulated deep sleep can carry
+// it over to the next wake-up, see mockWake().
+#define RTC_DATA_ATTR __attribute__((section("rtc_data")))
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_data")))
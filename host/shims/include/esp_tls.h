@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+#include "mbedtls/ssl.h"
+
+// Client connections to the in-process HTTPS server, see mockTlsSetResponse().
+
+#define ESP_ERR_ESP_TLS_BASE 0x8000
+#define ESP_ERR_ESP_TLS_CANNOT_CREATE_SOCKET (ESP_ERR_ESP_TLS_BASE + 0x03)
+
+typedef struct
+{
+    bool keep_alive_enable;
+    int keep_alive_idle;
+    int keep_alive_interval;
+    int keep_alive_count;
+} tls_keep_alive_cfg_t;
+
+typedef struct esp_tls_client_session
+{
+    mbedtls_ssl_session saved_session;
+} esp_tls_client_session_t;
+
+typedef struct
+{
+    const unsigned char *cacert_buf;
+    unsigned int cacert_bytes;
+    int timeout_ms;
+    bool is_plain_tcp;
+    tls_keep_alive_cfg_t *keep_alive_cfg;
+    esp_err_t (*crt_bundle_attach)(void *conf);
+    esp_tls_client_session_t *client_session;
+} esp_tls_cfg_t;
+
+typedef struct esp_tls_last_error
+{
+    esp_err_t last_error;
+    int esp_tls_error_code;
+    int esp_tls_flags;
+} esp_tls_last_error_t;
+
+typedef esp_tls_last_error_t *esp_tls_error_handle_t;
+
+typedef struct esp_tls
+{
+    struct MockTlsConnection *connection;
+    esp_tls_error_handle_t error_handle;
+} esp_tls_t;
+
+esp_tls_t *esp_tls_init(void);
+// 1 once connected, -1 on failure.
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_t *tls);
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen);
+// 0 once the server closed the connection.
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen);
+int esp_tls_conn_destroy(esp_tls_t *tls);
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t h, int *esp_tls_code, int *esp_tls_flags);
+esp_tls_client_session_t *esp_tls_get_client_session(esp_tls_t *tls);
+void esp_tls_free_client_session(esp_tls_client_session_t *client_session);
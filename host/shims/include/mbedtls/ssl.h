@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Only what esp_tls.h exposes of a saved session: the secret that a
+// resumed handshake reuses.
+typedef struct mbedtls_ssl_session
+{
+    unsigned char id[32];
+    size_t id_len;
+    unsigned char master[48];
+} mbedtls_ssl_session;
@@ -0,0 +1,103 @@
+// Controls of the host shims for tests and benchmarks: the devices behind
+// the drivers, the far side of the network stacks, and what the firmware
+// sent.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// AHT20 on I2C port 0. A trigger starts a conversion that stays busy for
+// the given number of status polls; the frame then carries the reading.
+void mockAht20Set(int32_t centi_celsius, uint32_t centi_percent);
+void mockAht20SetRaw(uint32_t humidity_raw, uint32_t temperature_raw);
+void mockAht20SetBusyPolls(unsigned polls);
+void mockAht20SetCalibrated(bool calibrated);
+void mockAht20SetPresent(bool present); // absent devices NACK every transfer
+void mockAht20CorruptNextFrame(void);
+unsigned mockAht20Transfers(void);
+
+int mockGpioLevel(gpio_num_t pin);
+bool mockGpioIsOutput(gpio_num_t pin);
+
+typedef struct
+{
+    char status[48];
+    char type[64];
+    char headers[512]; // "Name: value\r\n" lines set by the handler
+    char *body;
+    size_t length;
+    bool chunked;
+    bool complete;
+} MockHttpResponse;
+
+// Returns the session's descriptor, a real socket that is not connected,
+// after open_fn accepted it.
+int mockHttpdConnect(void);
+// Closes the session as the server would, through close_fn, which owns
+// closing the descriptor.
+void mockHttpdDisconnect(int fd);
+bool mockHttpdIsOpen(int fd);
+// headers are "Name: value\r\n" lines, or NULL. Returns what the handler
+// returned; the server closes the session when that is not ESP_OK.
+esp_err_t mockHttpdRequest(int fd, httpd_method_t method, const char *uri, const char *headers, const char *body,
+                           MockHttpResponse *response);
+void mockHttpResponseFree(MockHttpResponse *response);
+// Takes what was written to the session with httpd_socket_send(), and the
+// payload of WebSocket frames, each followed by a newline.
+size_t mockHttpdTakeOutput(int fd, char *buffer, size_t size);
+bool mockHttpdWaitOutput(int fd, const char *text, int timeout_ms);
+
+// A central's side of the GAP events.
+void mockBleConnect(uint16_t conn_handle);
+void mockBleDisconnect(uint16_t conn_handle);
+void mockBleSubscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void mockBleSetMtu(uint16_t conn_handle, uint16_t mtu);
+// GATT accesses by a connected central. Return what the access callback
+// returned, or BLE_HS_ENOENT for an unknown handle.
+int mockBleWrite(uint16_t conn_handle, uint16_t attr_handle, const void *data, size_t length);
+int mockBleRead(uint16_t conn_handle, uint16_t attr_handle, void *data, size_t size, size_t *length);
+// Notifications fail with rc until set back to 0.
+void mockBleSetNotifyResult(int rc);
+// Count of notifications sent on the attribute, and a copy of the last.
+unsigned mockBleNotifications(uint16_t attr_handle, void *last, size_t size, size_t *length);
+bool mockBleSynced(void);
+bool mockBleAdvertising(void);
+const char *mockBleDeviceName(void);
+
+void mockWifiSetReachable(bool reachable);
+
+// The broker's side of the MQTT session.
+void mockMqttConnect(void);
+void mockMqttDisconnect(void);
+void mockMqttRefuse(const char *topic, bool refuse);
+// QoS 1 messages are acknowledged right away, unless held back until
+// mockMqttAckAll().
+void mockMqttSetManualAcks(bool manual);
+void mockMqttAckAll(void);
+// Count of messages accepted on the topic, and a copy of the last.
+unsigned mockMqttPublished(const char *topic, void *last, size_t size, size_t *length);
+
+// The HTTPS server behind esp_tls. Every request is answered with the
+// response set here, by default an empty 200, read back in short pieces.
+void mockTlsSetResponse(const char *response);
+// Whether offered sessions are resumed; otherwise every handshake is full.
+void mockTlsSetResumption(bool accept);
+// Closes the open connections from the server side, as an idle timeout would.
+void mockTlsCloseConnections(void);
+void mockTlsHandshakes(unsigned *full, unsigned *resumed);
+// Count of requests received, and a copy of the last.
+unsigned mockTlsRequests(char *last, size_t size);
+
+void mockFlashErase(const char *label);
+void mockFlashFailWrites(const char *label, bool fail);
+void mockNvsErase(void);
+
+// Runs one wake-up of a low-power firmware in a child process: fresh RAM,
+// the RTC memory, flash and NVS left by the previous wake-up. Returns true
+// if it ended in esp_deep_sleep_start(), with the timer wake-up it set.
+bool mockWake(void (*entry)(void), uint64_t *sleep_us);
@@ -0,0 +1,12 @@
+// The options of ../../../sdkconfig that the firmware sources test.
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX 1
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#define CONFIG_HTTPD_WS_SUPPORT 1
+#define CONFIG_HTTPD_MAX_REQ_HDR_LEN 512
+#define CONFIG_HTTPD_MAX_URI_LEN 512
+#define CONFIG_LWIP_MAX_SOCKETS 16
+#define CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS 1
+#define CONFIG_MBEDTLS_CERTIFICATE_BUNDLE 1
@@ -0,0 +1,73 @@
+// State shared by the shims. What a reboot keeps, and what tests set up
+// before a wake-up, lives in one mapping that forked wake-ups share with
+// the test process, see mockWake().
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_partition.h"
+
+#define MOCK_PACK_SIZE (256 * 1024)
+#define MOCK_TLOG_SIZE (1024 * 1024)
+#define MOCK_RTC_SIZE 4096
+#define MOCK_NVS_ENTRIES 32
+#define MOCK_NVS_VALUE_MAX 64
+#define MOCK_MQTT_TOPICS 8
+#define MOCK_MQTT_PAYLOAD_MAX 1024
+
+typedef struct
+{
+    char space[16];
+    char key[16];
+    size_t length; // 0 for a free entry
+    uint8_t value[MOCK_NVS_VALUE_MAX];
+} MockNvsEntry;
+
+typedef struct
+{
+    char topic[48];
+    bool refused;
+    unsigned published;
+    size_t length;
+    uint8_t last[MOCK_MQTT_PAYLOAD_MAX];
+} MockMqttTopic;
+
+typedef struct
+{
+    uint8_t pack[MOCK_PACK_SIZE];
+    uint8_t tlog[MOCK_TLOG_SIZE];
+    bool fail_writes[2];
+    MockNvsEntry nvs[MOCK_NVS_ENTRIES];
+
+    struct
+    {
+        bool absent;
+        bool uncalibrated;
+        unsigned busy_polls;
+        bool corrupt_next;
+        uint32_t humidity_raw;
+        uint32_t temperature_raw;
+        unsigned transfers;
+    } aht20;
+
+    bool wifi_unreachable;
+
+    struct
+    {
+        bool manual_acks;
+        MockMqttTopic topics[MOCK_MQTT_TOPICS];
+    } mqtt;
+
+    struct
+    {
+        size_t size;
+        uint8_t image[MOCK_RTC_SIZE];
+        uint64_t timer_us;
+        bool slept;
+    } rtc;
+} MockShared;
+
+MockShared *mockShared(void);
+void mockAht20Defaults(MockShared *state);
@@ -0,0 +1,209 @@
+// MQTT client talking to an in-process broker. Events are dispatched from
+// the client's own task, like the real client's; the broker connects as
+// soon as the client starts on a reachable network and acknowledges QoS 1
+// messages right away unless mockMqttSetManualAcks() holds them back.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mock.h"
+#include "mock_internal.h"
+#include "mqtt_client.h"
+
+#define MQTT_EVENT_QUEUE_LENGTH 32
+#define MQTT_PENDING_ACKS 64
+
+static const char *MQTT_EVENTS = "MQTT_EVENTS";
+
+typedef struct
+{
+    esp_mqtt_event_id_t id;
+    int msg_id;
+} ClientEvent;
+
+struct esp_mqtt_client
+{
+    pthread_mutex_t lock;
+    esp_event_handler_t handler;
+    void *handler_arg;
+    QueueHandle_t events;
+    bool connected;
+    int last_msg_id;
+    int pending[MQTT_PENDING_ACKS];
+    size_t pending_count;
+};
+
+// The firmware has one client; the broker controls act on it.
+static struct esp_mqtt_client *current;
+
+static void postEvent(struct esp_mqtt_client *client, esp_mqtt_event_id_t id, int msg_id)
+{
+    ClientEvent event = {id, msg_id};
+    xQueueSend(client->events, &event, portMAX_DELAY);
+}
+
+static void clientTask(void *param)
+{
+    struct esp_mqtt_client *client = param;
+    esp_mqtt_error_codes_t error = {0};
+    ClientEvent queued;
+    while (xQueueReceive(client->events, &queued, portMAX_DELAY))
+    {
+        esp_mqtt_event_t event = {
+            .event_id = queued.id,
+            .client = client,
+            .msg_id = queued.msg_id,
+            .error_handle = &error,
+        };
+        if (client->handler != NULL)
+            client->handler(client->handler_arg, MQTT_EVENTS, queued.id, &event);
+    }
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    static struct esp_mqtt_client client = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    client.events = xQueueCreate(MQTT_EVENT_QUEUE_LENGTH, sizeof(ClientEvent));
+    current = &client;
+    return &client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    client->handler = event_handler;
+    client->handler_arg = event_handler_arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    xTaskCreate(clientTask, "mqtt_task", 6144, client, 5, NULL);
+    if (!mockShared()->wifi_unreachable)
+        mockMqttConnect();
+    return ESP_OK;
+}
+
+static MockMqttTopic *findTopic(const char *topic, bool create)
+{
+    MockShared *state = mockShared();
+    for (size_t i = 0; i < MOCK_MQTT_TOPICS; i++)
+    {
+        MockMqttTopic *entry = &state->mqtt.topics[i];
+        if (strcmp(entry->topic, topic) == 0)
+            return entry;
+        if (entry->topic[0] == '\0')
+        {
+            if (!create || strlen(topic) >= sizeof(entry->topic))
+                return NULL;
+            strcpy(entry->topic, topic);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Returns the message id, 0 for QoS 0, or -1 while disconnected or when
+// the broker refuses the topic.
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                            int retain)
+{
+    if (len == 0)
+        len = strlen(data);
+
+    pthread_mutex_lock(&client->lock);
+    MockMqttTopic *entry = findTopic(topic, true);
+    int msg_id = -1;
+    if (client->connected && entry != NULL && !entry->refused &&
+        (qos == 0 || client->pending_count < MQTT_PENDING_ACKS))
+    {
+        entry->published++;
+        entry->length = (size_t)len < sizeof(entry->last) ? (size_t)len : sizeof(entry->last);
+        memcpy(entry->last, data, entry->length);
+
+        msg_id = 0;
+        if (qos > 0)
+        {
+            msg_id = ++client->last_msg_id;
+            if (mockShared()->mqtt.manual_acks)
+                client->pending[client->pending_count++] = msg_id;
+            else
+                postEvent(client, MQTT_EVENT_PUBLISHED, msg_id);
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+    return msg_id;
+}
+
+void mockMqttConnect(void)
+{
+    if (current == NULL)
+        return;
+
+    pthread_mutex_lock(&current->lock);
+    bool was_connected = current->connected;
+    current->connected = true;
+    pthread_mutex_unlock(&current->lock);
+    if (!was_connected)
+        postEvent(current, MQTT_EVENT_CONNECTED, 0);
+}
+
+// Messages not acknowledged yet are lost with the session.
+void mockMqttDisconnect(void)
+{
+    if (current == NULL)
+        return;
+
+    pthread_mutex_lock(&current->lock);
+    bool was_connected = current->connected;
+    current->connected = false;
+    current->pending_count = 0;
+    pthread_mutex_unlock(&current->lock);
+    if (was_connected)
+        postEvent(current, MQTT_EVENT_DISCONNECTED, 0);
+}
+
+void mockMqttRefuse(const char *topic, bool refuse)
+{
+    MockMqttTopic *entry = findTopic(topic, true);
+    if (entry != NULL)
+        entry->refused = refuse;
+}
+
+void mockMqttSetManualAcks(bool manual)
+{
+    mockShared()->mqtt.manual_acks = manual;
+}
+
+void mockMqttAckAll(void)
+{
+    if (current == NULL)
+        return;
+
+    pthread_mutex_lock(&current->lock);
+    for (size_t i = 0; i < current->pending_count; i++)
+        postEvent(current, MQTT_EVENT_PUBLISHED, current->pending[i]);
+    current->pending_count = 0;
+    pthread_mutex_unlock(&current->lock);
+}
+
+unsigned mockMqttPublished(const char *topic, void *last, size_t size, size_t *length)
+{
+    const MockMqttTopic *entry = findTopic(topic, false);
+    if (entry == NULL)
+    {
+        if (length != NULL)
+            *length = 0;
+        return 0;
+    }
+
+    size_t copied = entry->length < size ? entry->length : size;
+    if (last != NULL)
+        memcpy(last, entry->last, copied);
+    if (length != NULL)
+        *length = copied;
+    return entry->published;
+}
@@ -0,0 +1,178 @@
+// Wi-Fi station and esp_netif. A connect takes a few milliseconds and
+// posts the same events as the target, through the default event loop.
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "mock.h"
+#include "mock_internal.h"
+
+#define WIFI_CONNECT_DELAY_US 2000
+#define WIFI_REASON_NO_AP_FOUND 201
+
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+
+static const uint8_t ap_bssid[6] = {0x24, 0x0a, 0xc4, 0x11, 0x22, 0x33};
+#define AP_CHANNEL 6
+
+static struct
+{
+    pthread_mutex_t lock;
+    bool initialized;
+    bool started;
+    bool connected;
+    wifi_config_t config;
+} wifi = {PTHREAD_MUTEX_INITIALIZER};
+
+static struct esp_netif_obj
+{
+    bool dhcp_stopped;
+    esp_netif_ip_info_t ip_info;
+} station;
+
+void mockWifiSetReachable(bool reachable)
+{
+    mockShared()->wifi_unreachable = !reachable;
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void)
+{
+    return &station;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t *netif)
+{
+    netif->dhcp_stopped = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t *netif)
+{
+    netif->dhcp_stopped = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t *netif, const esp_netif_ip_info_t *ip_info)
+{
+    netif->ip_info = *ip_info;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t *netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns)
+{
+    return ESP_OK;
+}
+
+uint32_t esp_ip4addr_aton(const char *addr)
+{
+    return inet_addr(addr);
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+    wifi.initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+    return wifi.initialized ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf)
+{
+    pthread_mutex_lock(&wifi.lock);
+    wifi.config = *conf;
+    pthread_mutex_unlock(&wifi.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(wifi_interface_t interface, wifi_config_t *conf)
+{
+    pthread_mutex_lock(&wifi.lock);
+    *conf = wifi.config;
+    pthread_mutex_unlock(&wifi.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+    if (!wifi.initialized)
+        return ESP_ERR_INVALID_STATE;
+
+    wifi.started = true;
+    return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+    pthread_mutex_lock(&wifi.lock);
+    bool was_connected = wifi.connected;
+    wifi.started = wifi.connected = false;
+    pthread_mutex_unlock(&wifi.lock);
+
+    if (was_connected)
+    {
+        wifi_event_sta_disconnected_t event = {.reason = 8}; // ASSOC_LEAVE
+        esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event), portMAX_DELAY);
+    }
+    return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_STOP, NULL, 0, portMAX_DELAY);
+}
+
+// A directed connect to another BSSID than the AP's finds nothing.
+esp_err_t esp_wifi_connect(void)
+{
+    if (!wifi.started)
+        return ESP_ERR_INVALID_STATE;
+
+    usleep(WIFI_CONNECT_DELAY_US);
+
+    pthread_mutex_lock(&wifi.lock);
+    bool found = !mockShared()->wifi_unreachable &&
+                 (!wifi.config.sta.bssid_set || memcmp(wifi.config.sta.bssid, ap_bssid, sizeof(ap_bssid)) == 0);
+    wifi.connected = found;
+    pthread_mutex_unlock(&wifi.lock);
+
+    if (!found)
+    {
+        wifi_event_sta_disconnected_t event = {.reason = WIFI_REASON_NO_AP_FOUND};
+        memcpy(event.bssid, wifi.config.sta.bssid, sizeof(event.bssid));
+        return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event), portMAX_DELAY);
+    }
+
+    wifi_event_sta_connected_t connected = {.channel = AP_CHANNEL};
+    memcpy(connected.bssid, ap_bssid, sizeof(ap_bssid));
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &connected, sizeof(connected), portMAX_DELAY);
+
+    ip_event_got_ip_t got_ip = {.esp_netif = &station, .ip_info = station.ip_info, .ip_changed = true};
+    if (!station.dhcp_stopped)
+    {
+        got_ip.ip_info.ip.addr = inet_addr("192.168.1.50");
+        got_ip.ip_info.netmask.addr = inet_addr("255.255.255.0");
+        got_ip.ip_info.gw.addr = inet_addr("192.168.1.1");
+    }
+    return esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip, sizeof(got_ip), portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info)
+{
+    if (!wifi.connected)
+        return ESP_ERR_INVALID_STATE;
+
+    memset(ap_info, 0, sizeof(*ap_info));
+    memcpy(ap_info->bssid, ap_bssid, sizeof(ap_bssid));
+    memcpy(ap_info->ssid, wifi.config.sta.ssid, sizeof(wifi.config.sta.ssid));
+    ap_info->primary = AP_CHANNEL;
+    ap_info->rssi = -55;
+    return ESP_OK;
+}
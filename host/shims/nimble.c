@@ -0,0 +1,561 @@
+// NimBLE host without a controller. GAP events and GATT accesses from
+// mocked centrals run on the calling thread under the host lock, standing
+// in for the host task; events the host raises itself while handling one,
+// like the disconnect after ble_gap_terminate(), follow once it returned.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "esp_nimble_hci.h"
+#include "mock.h"
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+
+#define MOCK_BLE_CONNECTIONS 8
+#define MOCK_BLE_ATTRIBUTES 64
+#define MOCK_BLE_PENDING 8
+#define BLE_ATT_MTU_DEFAULT 23
+
+struct ble_hs_cfg ble_hs_cfg;
+
+typedef struct
+{
+    uint16_t handle;
+    const struct ble_gatt_chr_def *chr;
+    const struct ble_gatt_dsc_def *dsc;
+} Attribute;
+
+typedef struct
+{
+    unsigned count;
+    size_t length;
+    uint8_t last[256];
+} NotifyLog;
+
+static struct
+{
+    pthread_mutex_t host;
+    pthread_mutex_t lock;
+    bool initialized;
+    bool synced;
+    bool advertising;
+    ble_gap_event_fn *adv_cb;
+    void *adv_arg;
+    char device_name[32];
+    char adv_name[32];
+
+    struct
+    {
+        bool used;
+        uint16_t conn_handle;
+        uint16_t mtu;
+        ble_gap_event_fn *cb;
+        void *arg;
+    } connections[MOCK_BLE_CONNECTIONS];
+
+    Attribute attributes[MOCK_BLE_ATTRIBUTES];
+    size_t attribute_count;
+    uint16_t next_handle;
+
+    struct ble_gap_event pending[MOCK_BLE_PENDING];
+    size_t pending_count;
+    unsigned depth;
+
+    int notify_result;
+    NotifyLog notifications[MOCK_BLE_ATTRIBUTES + 1];
+} ble = {
+    .host = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .next_handle = 1,
+};
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    struct os_mbuf *om = calloc(1, sizeof(*om));
+    if (om == NULL)
+        return NULL;
+
+    om->om_data = malloc(len > 0 ? len : 1);
+    if (om->om_data == NULL)
+    {
+        free(om);
+        return NULL;
+    }
+    memcpy(om->om_data, buf, len);
+    om->om_len = om->om_size = len;
+    return om;
+}
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf *om, void *flat, uint16_t max_len, uint16_t *out_copy_len)
+{
+    uint16_t length = om->om_len < max_len ? om->om_len : max_len;
+    memcpy(flat, om->om_data, length);
+    if (out_copy_len != NULL)
+        *out_copy_len = length;
+    return length < om->om_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    if (om->om_len + len > om->om_size)
+    {
+        uint8_t *grown = realloc(om->om_data, om->om_len + len);
+        if (grown == NULL)
+            return BLE_HS_ENOMEM;
+        om->om_data = grown;
+        om->om_size = om->om_len + len;
+    }
+    memcpy(om->om_data + om->om_len, data, len);
+    om->om_len += len;
+    return 0;
+}
+
+struct os_mbuf *os_mbuf_dup(struct os_mbuf *om)
+{
+    return ble_hs_mbuf_from_flat(om->om_data, om->om_len);
+}
+
+int os_mbuf_free_chain(struct os_mbuf *om)
+{
+    if (om != NULL)
+    {
+        free(om->om_data);
+        free(om);
+    }
+    return 0;
+}
+
+esp_err_t esp_nimble_hci_and_controller_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nimble_port_init(void)
+{
+    ble.initialized = true;
+    return ESP_OK;
+}
+
+// Syncs with the (absent) controller, then serves nothing until the end.
+void nimble_port_run(void)
+{
+    pthread_mutex_lock(&ble.host);
+    ble.synced = true;
+    if (ble_hs_cfg.sync_cb != NULL)
+        ble_hs_cfg.sync_cb();
+    pthread_mutex_unlock(&ble.host);
+
+    while (1)
+        vTaskDelay(portMAX_DELAY - 1);
+}
+
+int nimble_port_stop(void)
+{
+    return 0;
+}
+
+void nimble_port_freertos_init(TaskFunction_t host_task_fn)
+{
+    xTaskCreate(host_task_fn, "nimble_host", 4096, NULL, 21, NULL);
+}
+
+void nimble_port_freertos_deinit(void)
+{
+}
+
+void ble_svc_gap_init(void)
+{
+}
+
+void ble_svc_gatt_init(void)
+{
+}
+
+int ble_svc_gap_device_name_set(const char *name)
+{
+    if (strlen(name) >= sizeof(ble.device_name))
+        return BLE_HS_EINVAL;
+
+    pthread_mutex_lock(&ble.lock);
+    strcpy(ble.device_name, name);
+    pthread_mutex_unlock(&ble.lock);
+    return 0;
+}
+
+const char *ble_svc_gap_device_name(void)
+{
+    return ble.device_name;
+}
+
+int ble_att_set_preferred_mtu(uint16_t mtu)
+{
+    return mtu >= BLE_ATT_MTU_DEFAULT && mtu <= 527 ? 0 : BLE_HS_EINVAL;
+}
+
+static int findConnection(uint16_t conn_handle)
+{
+    for (int i = 0; i < MOCK_BLE_CONNECTIONS; i++)
+    {
+        if (ble.connections[i].used && ble.connections[i].conn_handle == conn_handle)
+            return i;
+    }
+    return -1;
+}
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    pthread_mutex_lock(&ble.lock);
+    int index = findConnection(conn_handle);
+    uint16_t mtu = index >= 0 ? ble.connections[index].mtu : 0;
+    pthread_mutex_unlock(&ble.lock);
+    return mtu;
+}
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs)
+{
+    return 0;
+}
+
+static uint16_t addAttribute(const struct ble_gatt_chr_def *chr, const struct ble_gatt_dsc_def *dsc)
+{
+    uint16_t handle = ble.next_handle++;
+    if (ble.attribute_count < MOCK_BLE_ATTRIBUTES)
+        ble.attributes[ble.attribute_count++] = (Attribute){handle, chr, dsc};
+    return handle;
+}
+
+// Handles are assigned in table order: service, then per characteristic
+// its declaration, value, CCCD when it notifies, and descriptors.
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs)
+{
+    pthread_mutex_lock(&ble.lock);
+    for (const struct ble_gatt_svc_def *svc = svcs; svc->type != BLE_GATT_SVC_TYPE_END; svc++)
+    {
+        ble.next_handle++;
+        for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr != NULL && chr->uuid != NULL; chr++)
+        {
+            ble.next_handle++;
+            uint16_t value = addAttribute(chr, NULL);
+            if (chr->val_handle != NULL)
+                *chr->val_handle = value;
+            if (chr->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE))
+                ble.next_handle++;
+            for (const struct ble_gatt_dsc_def *dsc = chr->descriptors; dsc != NULL && dsc->uuid != NULL; dsc++)
+                addAttribute(chr, dsc);
+        }
+    }
+    bool full = ble.attribute_count == MOCK_BLE_ATTRIBUTES;
+    pthread_mutex_unlock(&ble.lock);
+    return full ? BLE_HS_ENOMEM : 0;
+}
+
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf *om)
+{
+    pthread_mutex_lock(&ble.lock);
+    int rc = findConnection(conn_handle) < 0 ? BLE_HS_ENOTCONN : ble.notify_result;
+    if (rc == 0 && att_handle <= MOCK_BLE_ATTRIBUTES)
+    {
+        NotifyLog *log = &ble.notifications[att_handle];
+        log->count++;
+        log->length = om->om_len < sizeof(log->last) ? om->om_len : sizeof(log->last);
+        memcpy(log->last, om->om_data, log->length);
+    }
+    pthread_mutex_unlock(&ble.lock);
+
+    os_mbuf_free_chain(om);
+    return rc;
+}
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, void *cb, void *cb_arg)
+{
+    return ble_att_mtu(conn_handle) != 0 ? 0 : BLE_HS_ENOTCONN;
+}
+
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time)
+{
+    return ble_att_mtu(conn_handle) != 0 ? 0 : BLE_HS_ENOTCONN;
+}
+
+int ble_gap_set_prefered_le_phy(uint16_t conn_handle, uint8_t tx_phys_mask, uint8_t rx_phys_mask, uint16_t phy_opts)
+{
+    return ble_att_mtu(conn_handle) != 0 ? 0 : BLE_HS_ENOTCONN;
+}
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *adv_fields)
+{
+    pthread_mutex_lock(&ble.lock);
+    int rc = !ble.synced ? BLE_HS_ENOTSYNCED : adv_fields->name_len >= sizeof(ble.adv_name) ? BLE_HS_EMSGSIZE : 0;
+    if (rc == 0)
+    {
+        memcpy(ble.adv_name, adv_fields->name, adv_fields->name_len);
+        ble.adv_name[adv_fields->name_len] = '\0';
+    }
+    pthread_mutex_unlock(&ble.lock);
+    return rc;
+}
+
+int ble_gap_adv_start(uint8_t own_addr_type, const void *direct_addr, int32_t duration_ms,
+                      const struct ble_gap_adv_params *adv_params, ble_gap_event_fn *cb, void *cb_arg)
+{
+    pthread_mutex_lock(&ble.lock);
+    int rc = !ble.synced ? BLE_HS_ENOTSYNCED : ble.advertising ? BLE_HS_EALREADY : 0;
+    if (rc == 0)
+    {
+        ble.advertising = true;
+        ble.adv_cb = cb;
+        ble.adv_arg = cb_arg;
+    }
+    pthread_mutex_unlock(&ble.lock);
+    return rc;
+}
+
+int ble_gap_adv_stop(void)
+{
+    pthread_mutex_lock(&ble.lock);
+    int rc = ble.advertising ? 0 : BLE_HS_EALREADY;
+    ble.advertising = false;
+    pthread_mutex_unlock(&ble.lock);
+    return rc;
+}
+
+int ble_gap_adv_active(void)
+{
+    pthread_mutex_lock(&ble.lock);
+    int active = ble.advertising;
+    pthread_mutex_unlock(&ble.lock);
+    return active;
+}
+
+static void queueEvent(const struct ble_gap_event *event)
+{
+    if (ble.pending_count < MOCK_BLE_PENDING)
+        ble.pending[ble.pending_count++] = *event;
+}
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason)
+{
+    pthread_mutex_lock(&ble.host);
+    pthread_mutex_lock(&ble.lock);
+    int rc = findConnection(conn_handle) >= 0 ? 0 : BLE_HS_ENOTCONN;
+    pthread_mutex_unlock(&ble.lock);
+
+    if (rc == 0)
+    {
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_DISCONNECT};
+        event.disconnect.reason = 0x200 + hci_reason; // BLE_HS_ERR_HCI_BASE
+        event.disconnect.conn.conn_handle = conn_handle;
+        queueEvent(&event);
+    }
+    pthread_mutex_unlock(&ble.host);
+    return rc;
+}
+
+// Delivers one event to the callback of its connection, as the host task.
+static void deliverEvent(struct ble_gap_event *event, uint16_t conn_handle)
+{
+    pthread_mutex_lock(&ble.lock);
+    int index = findConnection(conn_handle);
+    ble_gap_event_fn *cb = index >= 0 ? ble.connections[index].cb : NULL;
+    void *arg = index >= 0 ? ble.connections[index].arg : NULL;
+    if (event->type == BLE_GAP_EVENT_DISCONNECT && index >= 0)
+        ble.connections[index].used = false;
+    if (event->type == BLE_GAP_EVENT_MTU && index >= 0)
+        ble.connections[index].mtu = event->mtu.value;
+    pthread_mutex_unlock(&ble.lock);
+
+    if (cb != NULL)
+        cb(event, arg);
+}
+
+static void drainEvents(void)
+{
+    while (ble.depth == 1 && ble.pending_count > 0)
+    {
+        struct ble_gap_event event = ble.pending[0];
+        memmove(ble.pending, ble.pending + 1, --ble.pending_count * sizeof(event));
+        deliverEvent(&event, event.disconnect.conn.conn_handle);
+    }
+}
+
+void mockBleConnect(uint16_t conn_handle)
+{
+    pthread_mutex_lock(&ble.host);
+    ble.depth++;
+
+    pthread_mutex_lock(&ble.lock);
+    ble_gap_event_fn *cb = ble.advertising ? ble.adv_cb : NULL;
+    void *arg = ble.adv_arg;
+    int index = -1;
+    for (int i = 0; i < MOCK_BLE_CONNECTIONS && cb != NULL && index < 0; i++)
+    {
+        if (!ble.connections[i].used)
+            index = i;
+    }
+    if (index >= 0)
+    {
+        ble.advertising = false;
+        ble.connections[index].used = true;
+        ble.connections[index].conn_handle = conn_handle;
+        ble.connections[index].mtu = BLE_ATT_MTU_DEFAULT;
+        ble.connections[index].cb = cb;
+        ble.connections[index].arg = arg;
+    }
+    pthread_mutex_unlock(&ble.lock);
+
+    // Centrals only connect to an advertising peripheral.
+    if (index >= 0)
+    {
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_CONNECT};
+        event.connect.conn_handle = conn_handle;
+        cb(&event, arg);
+    }
+
+    drainEvents();
+    ble.depth--;
+    pthread_mutex_unlock(&ble.host);
+}
+
+void mockBleDisconnect(uint16_t conn_handle)
+{
+    pthread_mutex_lock(&ble.host);
+    ble.depth++;
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_DISCONNECT};
+    event.disconnect.reason = 0x200 + BLE_ERR_REM_USER_CONN_TERM;
+    event.disconnect.conn.conn_handle = conn_handle;
+    deliverEvent(&event, conn_handle);
+    drainEvents();
+    ble.depth--;
+    pthread_mutex_unlock(&ble.host);
+}
+
+void mockBleSubscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify)
+{
+    pthread_mutex_lock(&ble.host);
+    ble.depth++;
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_SUBSCRIBE};
+    event.subscribe.conn_handle = conn_handle;
+    event.subscribe.attr_handle = attr_handle;
+    event.subscribe.cur_notify = notify;
+    deliverEvent(&event, conn_handle);
+    drainEvents();
+    ble.depth--;
+    pthread_mutex_unlock(&ble.host);
+}
+
+void mockBleSetMtu(uint16_t conn_handle, uint16_t mtu)
+{
+    pthread_mutex_lock(&ble.host);
+    ble.depth++;
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_MTU};
+    event.mtu.conn_handle = conn_handle;
+    event.mtu.value = mtu;
+    deliverEvent(&event, conn_handle);
+    drainEvents();
+    ble.depth--;
+    pthread_mutex_unlock(&ble.host);
+}
+
+static int accessAttribute(uint16_t conn_handle, uint16_t attr_handle, uint8_t op, struct os_mbuf *om)
+{
+    const Attribute *attribute = NULL;
+    pthread_mutex_lock(&ble.lock);
+    for (size_t i = 0; i < ble.attribute_count; i++)
+    {
+        if (ble.attributes[i].handle == attr_handle)
+            attribute = &ble.attributes[i];
+    }
+    bool connected = findConnection(conn_handle) >= 0;
+    pthread_mutex_unlock(&ble.lock);
+    if (attribute == NULL || !connected)
+        return BLE_HS_ENOENT;
+
+    struct ble_gatt_access_ctxt ctxt = {.om = om};
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+    if (attribute->dsc != NULL)
+    {
+        ctxt.op = op == BLE_GATT_ACCESS_OP_READ_CHR ? BLE_GATT_ACCESS_OP_READ_DSC : BLE_GATT_ACCESS_OP_WRITE_DSC;
+        ctxt.dsc = attribute->dsc;
+        access_cb = attribute->dsc->access_cb;
+        arg = attribute->dsc->arg;
+    }
+    else
+    {
+        ctxt.op = op;
+        ctxt.chr = attribute->chr;
+        access_cb = attribute->chr->access_cb;
+        arg = attribute->chr->arg;
+    }
+
+    pthread_mutex_lock(&ble.host);
+    ble.depth++;
+    int rc = access_cb(conn_handle, attr_handle, &ctxt, arg);
+    drainEvents();
+    ble.depth--;
+    pthread_mutex_unlock(&ble.host);
+    return rc;
+}
+
+int mockBleWrite(uint16_t conn_handle, uint16_t attr_handle, const void *data, size_t length)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(data, length);
+    int rc = accessAttribute(conn_handle, attr_handle, BLE_GATT_ACCESS_OP_WRITE_CHR, om);
+    os_mbuf_free_chain(om);
+    return rc;
+}
+
+int mockBleRead(uint16_t conn_handle, uint16_t attr_handle, void *data, size_t size, size_t *length)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(NULL, 0);
+    int rc = accessAttribute(conn_handle, attr_handle, BLE_GATT_ACCESS_OP_READ_CHR, om);
+    *length = om->om_len < size ? om->om_len : size;
+    memcpy(data, om->om_data, *length);
+    os_mbuf_free_chain(om);
+    return rc;
+}
+
+void mockBleSetNotifyResult(int rc)
+{
+    pthread_mutex_lock(&ble.lock);
+    ble.notify_result = rc;
+    pthread_mutex_unlock(&ble.lock);
+}
+
+unsigned mockBleNotifications(uint16_t attr_handle, void *last, size_t size, size_t *length)
+{
+    if (attr_handle > MOCK_BLE_ATTRIBUTES)
+        return 0;
+
+    pthread_mutex_lock(&ble.lock);
+    const NotifyLog *log = &ble.notifications[attr_handle];
+    unsigned count = log->count;
+    size_t copied = log->length < size ? log->length : size;
+    if (last != NULL)
+        memcpy(last, log->last, copied);
+    if (length != NULL)
+        *length = copied;
+    pthread_mutex_unlock(&ble.lock);
+    return count;
+}
+
+bool mockBleSynced(void)
+{
+    pthread_mutex_lock(&ble.lock);
+    bool synced = ble.synced;
+    pthread_mutex_unlock(&ble.lock);
+    return synced;
+}
+
+bool mockBleAdvertising(void)
+{
+    return ble_gap_adv_active();
+}
+
+const char *mockBleDeviceName(void)
+{
+    return ble.adv_name;
+}
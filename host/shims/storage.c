@@ -0,0 +1,309 @@
+// Flash partitions, NVS and SPIFFS. Partition contents and NVS entries
+// are in the shared mapping, so they survive simulated deep sleep.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "esp_partition.h"
+#include "esp_spiffs.h"
+#include "mock.h"
+#include "mock_internal.h"
+#include "nvs_flash.h"
+
+static const esp_partition_t partitions[] = {
+    {.type = ESP_PARTITION_TYPE_DATA, .subtype = 0x40, .address = 0x210000, .size = MOCK_PACK_SIZE,
+     .label = "www_pack"},
+    {.type = ESP_PARTITION_TYPE_DATA, .subtype = 0x41, .address = 0x250000, .size = MOCK_TLOG_SIZE,
+     .label = "tlog"},
+};
+
+#define PARTITION_COUNT (sizeof(partitions) / sizeof(partitions[0]))
+
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t *partitionData(const esp_partition_t *partition)
+{
+    MockShared *state = mockShared();
+    return partition == &partitions[0] ? state->pack : state->tlog;
+}
+
+static bool partitionRange(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    return partition >= partitions && partition < partitions + PARTITION_COUNT && offset <= partition->size &&
+           size <= partition->size - offset;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                 const char *label)
+{
+    for (size_t i = 0; i < PARTITION_COUNT; i++)
+    {
+        const esp_partition_t *partition = &partitions[i];
+        if (partition->type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || partition->subtype == subtype) &&
+            (label == NULL || strcmp(partition->label, label) == 0))
+            return partition;
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (!partitionRange(partition, src_offset, size))
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&storage_lock);
+    memcpy(dst, partitionData(partition) + src_offset, size);
+    pthread_mutex_unlock(&storage_lock);
+    return ESP_OK;
+}
+
+// NOR flash: programming only clears bits.
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (!partitionRange(partition, dst_offset, size))
+        return ESP_ERR_INVALID_ARG;
+    if (mockShared()->fail_writes[partition - partitions])
+        return ESP_FAIL;
+
+    pthread_mutex_lock(&storage_lock);
+    uint8_t *data = partitionData(partition) + dst_offset;
+    for (size_t i = 0; i < size; i++)
+        data[i] &= ((const uint8_t *)src)[i];
+    pthread_mutex_unlock(&storage_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (!partitionRange(partition, offset, size))
+        return ESP_ERR_INVALID_ARG;
+    if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0)
+        return ESP_ERR_INVALID_SIZE;
+    if (mockShared()->fail_writes[partition - partitions])
+        return ESP_FAIL;
+
+    pthread_mutex_lock(&storage_lock);
+    memset(partitionData(partition) + offset, 0xFF, size);
+    pthread_mutex_unlock(&storage_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle)
+{
+    if (!partitionRange(partition, offset, size))
+        return ESP_ERR_INVALID_ARG;
+
+    *out_ptr = partitionData(partition) + offset;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+}
+
+void mockFlashErase(const char *label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                label);
+    if (partition != NULL)
+    {
+        pthread_mutex_lock(&storage_lock);
+        memset(partitionData(partition), 0xFF, partition->size);
+        pthread_mutex_unlock(&storage_lock);
+    }
+}
+
+void mockFlashFailWrites(const char *label, bool fail)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                label);
+    if (partition != NULL)
+        mockShared()->fail_writes[partition - partitions] = fail;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+// Handles are 1 + the index of the namespace's name in this table.
+#define NVS_NAMESPACES 8
+
+static char nvs_spaces[NVS_NAMESPACES][16];
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    mockNvsErase();
+    return ESP_OK;
+}
+
+void mockNvsErase(void)
+{
+    pthread_mutex_lock(&storage_lock);
+    memset(mockShared()->nvs, 0, sizeof(mockShared()->nvs));
+    pthread_mutex_unlock(&storage_lock);
+}
+
+static bool nvsSpaceExists(const char *name)
+{
+    MockShared *state = mockShared();
+    for (size_t i = 0; i < MOCK_NVS_ENTRIES; i++)
+    {
+        if (state->nvs[i].length > 0 && strcmp(state->nvs[i].space, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (strlen(name) >= sizeof(nvs_spaces[0]))
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    pthread_mutex_lock(&storage_lock);
+    if (open_mode == NVS_READONLY && !nvsSpaceExists(name))
+        err = ESP_ERR_NVS_NOT_FOUND;
+
+    for (size_t i = 0; i < NVS_NAMESPACES && err == ESP_ERR_NO_MEM; i++)
+    {
+        if (nvs_spaces[i][0] == '\0')
+            strcpy(nvs_spaces[i], name);
+        if (strcmp(nvs_spaces[i], name) == 0)
+        {
+            *out_handle = i + 1;
+            err = ESP_OK;
+        }
+    }
+    pthread_mutex_unlock(&storage_lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return handle > 0 && handle <= NVS_NAMESPACES ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static MockNvsEntry *nvsFind(nvs_handle_t handle, const char *key, bool create)
+{
+    MockShared *state = mockShared();
+    const char *space = nvs_spaces[handle - 1];
+    MockNvsEntry *free_entry = NULL;
+    for (size_t i = 0; i < MOCK_NVS_ENTRIES; i++)
+    {
+        MockNvsEntry *entry = &state->nvs[i];
+        if (entry->length == 0)
+        {
+            if (free_entry == NULL)
+                free_entry = entry;
+        }
+        else if (strcmp(entry->space, space) == 0 && strcmp(entry->key, key) == 0)
+        {
+            return entry;
+        }
+    }
+
+    if (!create || free_entry == NULL)
+        return NULL;
+
+    strcpy(free_entry->space, space);
+    strncpy(free_entry->key, key, sizeof(free_entry->key) - 1);
+    return free_entry;
+}
+
+static esp_err_t nvsGet(nvs_handle_t handle, const char *key, void *value, size_t *length, bool exact)
+{
+    if (handle == 0 || handle > NVS_NAMESPACES)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&storage_lock);
+    MockNvsEntry *entry = nvsFind(handle, key, false);
+    if (entry != NULL)
+    {
+        err = ESP_OK;
+        if (value != NULL && (exact ? *length != entry->length : *length < entry->length))
+            err = ESP_ERR_INVALID_SIZE;
+        else if (value != NULL)
+            memcpy(value, entry->value, entry->length);
+        *length = entry->length;
+    }
+    pthread_mutex_unlock(&storage_lock);
+    return err;
+}
+
+static esp_err_t nvsSet(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    if (handle == 0 || handle > NVS_NAMESPACES || length == 0 || length > MOCK_NVS_VALUE_MAX ||
+        strlen(key) >= sizeof(((MockNvsEntry *)NULL)->key))
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = ESP_ERR_NVS_NO_FREE_PAGES;
+    pthread_mutex_lock(&storage_lock);
+    MockNvsEntry *entry = nvsFind(handle, key, true);
+    if (entry != NULL)
+    {
+        memcpy(entry->value, value, length);
+        entry->length = length;
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&storage_lock);
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    if (handle == 0 || handle > NVS_NAMESPACES)
+        return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&storage_lock);
+    MockNvsEntry *entry = nvsFind(handle, key, false);
+    if (entry != NULL)
+        memset(entry, 0, sizeof(*entry));
+    pthread_mutex_unlock(&storage_lock);
+    return entry != NULL ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *out_value)
+{
+    size_t length = sizeof(*out_value);
+    return nvsGet(handle, key, out_value, &length, true);
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value)
+{
+    return nvsSet(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t length = sizeof(*out_value);
+    return nvsGet(handle, key, out_value, &length, true);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return nvsSet(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return nvsGet(handle, key, out_value, length, false);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return nvsSet(handle, key, value, length);
+}
@@ -0,0 +1,229 @@
+// esp_tls connections to an in-process HTTPS server. The server answers
+// every complete request with the configured response, which the client
+// reads back at most MOCK_TLS_READ_MAX bytes at a time, as TLS records
+// arrive. A handshake offering a session the server issued is resumed:
+// the connection keeps that session's master secret, as TLS 1.2 does.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_crt_bundle.h"
+#include "esp_tls.h"
+#include "mock.h"
+#include "mock_internal.h"
+
+#define MOCK_TLS_READ_MAX 100
+#define MOCK_TLS_REQUEST_MAX 2048
+#define MOCK_TLS_RESPONSE_MAX 4096
+
+struct MockTlsConnection
+{
+    unsigned generation;
+    esp_tls_client_session_t session;
+    char request[MOCK_TLS_REQUEST_MAX + 1];
+    size_t request_length;
+    char response[MOCK_TLS_RESPONSE_MAX];
+    size_t response_length;
+    size_t response_read;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    bool refuse_resumption;
+    char response[MOCK_TLS_RESPONSE_MAX];
+    unsigned generation;
+    uint32_t sessions_issued;
+    unsigned full;
+    unsigned resumed;
+    unsigned requests;
+    char last[MOCK_TLS_REQUEST_MAX + 1];
+} server = {PTHREAD_MUTEX_INITIALIZER, false, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"};
+
+static const char kMasterPrefix[] = "mock session";
+
+void mockTlsSetResponse(const char *response)
+{
+    pthread_mutex_lock(&server.lock);
+    snprintf(server.response, sizeof(server.response), "%s", response);
+    pthread_mutex_unlock(&server.lock);
+}
+
+void mockTlsSetResumption(bool accept)
+{
+    server.refuse_resumption = !accept;
+}
+
+void mockTlsCloseConnections(void)
+{
+    pthread_mutex_lock(&server.lock);
+    server.generation++;
+    pthread_mutex_unlock(&server.lock);
+}
+
+void mockTlsHandshakes(unsigned *full, unsigned *resumed)
+{
+    pthread_mutex_lock(&server.lock);
+    *full = server.full;
+    *resumed = server.resumed;
+    pthread_mutex_unlock(&server.lock);
+}
+
+unsigned mockTlsRequests(char *last, size_t size)
+{
+    pthread_mutex_lock(&server.lock);
+    unsigned requests = server.requests;
+    if (last != NULL && size > 0)
+        snprintf(last, size, "%s", server.last);
+    pthread_mutex_unlock(&server.lock);
+    return requests;
+}
+
+esp_err_t esp_crt_bundle_attach(void *conf)
+{
+    return ESP_OK;
+}
+
+esp_tls_t *esp_tls_init(void)
+{
+    esp_tls_t *tls = calloc(1, sizeof(*tls));
+    if (tls == NULL)
+        return NULL;
+    tls->error_handle = calloc(1, sizeof(*tls->error_handle));
+    return tls;
+}
+
+static bool issuedByServer(const esp_tls_client_session_t *session)
+{
+    return session != NULL && memcmp(session->saved_session.master, kMasterPrefix, sizeof(kMasterPrefix)) == 0;
+}
+
+int esp_tls_conn_new_sync(const char *hostname, int hostlen, int port, const esp_tls_cfg_t *cfg, esp_tls_t *tls)
+{
+    if (mockShared()->wifi_unreachable)
+    {
+        tls->error_handle->last_error = ESP_ERR_ESP_TLS_CANNOT_CREATE_SOCKET;
+        return -1;
+    }
+
+    struct MockTlsConnection *connection = calloc(1, sizeof(*connection));
+    pthread_mutex_lock(&server.lock);
+    connection->generation = server.generation;
+    if (!cfg->is_plain_tcp && !server.refuse_resumption && issuedByServer(cfg->client_session))
+    {
+        connection->session = *cfg->client_session;
+        server.resumed++;
+    }
+    else
+    {
+        mbedtls_ssl_session *session = &connection->session.saved_session;
+        memcpy(session->master, kMasterPrefix, sizeof(kMasterPrefix));
+        uint32_t serial = ++server.sessions_issued;
+        memcpy(session->master + sizeof(kMasterPrefix), &serial, sizeof(serial));
+        server.full++;
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    tls->connection = connection;
+    return 1;
+}
+
+static bool closedByServer(const struct MockTlsConnection *connection)
+{
+    return connection->generation != __atomic_load_n(&server.generation, __ATOMIC_ACQUIRE);
+}
+
+// Queues the response once the head and the Content-Length body are in.
+static void serveRequest(struct MockTlsConnection *connection)
+{
+    char *end = strstr(connection->request, "\r\n\r\n");
+    if (end == NULL)
+        return;
+
+    size_t head_length = end + 4 - connection->request;
+    char *content_length = strcasestr(connection->request, "\r\nContent-Length:");
+    size_t body_length = content_length != NULL && content_length < end ? strtoul(content_length + 17, NULL, 10) : 0;
+    if (connection->request_length < head_length + body_length)
+        return;
+
+    pthread_mutex_lock(&server.lock);
+    server.requests++;
+    memcpy(server.last, connection->request, head_length + body_length);
+    server.last[head_length + body_length] = '\0';
+    connection->response_length = strlen(server.response);
+    memcpy(connection->response, server.response, connection->response_length);
+    connection->response_read = 0;
+    pthread_mutex_unlock(&server.lock);
+
+    connection->request_length -= head_length + body_length;
+    memmove(connection->request, connection->request + head_length + body_length, connection->request_length + 1);
+}
+
+ssize_t esp_tls_conn_write(esp_tls_t *tls, const void *data, size_t datalen)
+{
+    struct MockTlsConnection *connection = tls->connection;
+    if (connection->request_length + datalen > MOCK_TLS_REQUEST_MAX)
+        return -1;
+
+    // A closed connection still takes the first write, like a TCP socket.
+    memcpy(connection->request + connection->request_length, data, datalen);
+    connection->request_length += datalen;
+    connection->request[connection->request_length] = '\0';
+    if (!closedByServer(connection))
+        serveRequest(connection);
+    return datalen;
+}
+
+ssize_t esp_tls_conn_read(esp_tls_t *tls, void *data, size_t datalen)
+{
+    struct MockTlsConnection *connection = tls->connection;
+    if (closedByServer(connection))
+        return 0;
+
+    size_t available = connection->response_length - connection->response_read;
+    if (available == 0)
+        return -1; // the read would time out
+
+    size_t length = available < datalen ? available : datalen;
+    if (length > MOCK_TLS_READ_MAX)
+        length = MOCK_TLS_READ_MAX;
+    memcpy(data, connection->response + connection->response_read, length);
+    connection->response_read += length;
+    return length;
+}
+
+int esp_tls_conn_destroy(esp_tls_t *tls)
+{
+    if (tls == NULL)
+        return -1;
+    free(tls->connection);
+    free(tls->error_handle);
+    free(tls);
+    return 0;
+}
+
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t h, int *esp_tls_code, int *esp_tls_flags)
+{
+    esp_err_t err = h->last_error;
+    if (esp_tls_code != NULL)
+        *esp_tls_code = h->esp_tls_error_code;
+    if (esp_tls_flags != NULL)
+        *esp_tls_flags = h->esp_tls_flags;
+    *h = (esp_tls_last_error_t){0};
+    return err;
+}
+
+esp_tls_client_session_t *esp_tls_get_client_session(esp_tls_t *tls)
+{
+    esp_tls_client_session_t *session = malloc(sizeof(*session));
+    if (session != NULL)
+        *session = tls->connection->session;
+    return session;
+}
+
+void esp_tls_free_client_session(esp_tls_client_session_t *client_session)
+{
+    free(client_session);
+}
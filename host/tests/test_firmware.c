@@ -0,0 +1,635 @@
+// Boots the firmware on the host shims once and talks to it the way the
+// web UI and a client would: over HTTP, through the sensor and the LEDs.
+//
+// The firmware is a single translation unit, so it is included whole; its
+// static functions and state are reachable from the tests.
+
+#include "../../main/app_main.c"
+
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "mock.h"
+
+static int failures;
+
+#define CHECK(condition)                                                         \
+    do                                                                           \
+    {                                                                            \
+        if (!(condition))                                                        \
+        {                                                                        \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                          \
+        }                                                                        \
+    } while (0)
+
+// Flashes the image built from main/www, as `idf.py flash` does.
+static void flashAssetPack(void)
+{
+    FILE *file = fopen(WWW_PACK_IMAGE, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", WWW_PACK_IMAGE);
+        exit(1);
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "www_pack");
+    char *image = malloc(partition->size);
+    size_t size = fread(image, 1, partition->size, file);
+    fclose(file);
+
+    esp_partition_erase_range(partition, 0, partition->size);
+    esp_partition_write(partition, 0, image, size);
+    free(image);
+}
+
+static bool waitFor(bool (*condition)(void), int timeout_ms)
+{
+    for (int waited = 0; waited < timeout_ms; waited += 10)
+    {
+        if (condition())
+            return true;
+        usleep(10000);
+    }
+    return condition();
+}
+
+static bool hasHistory(void)
+{
+    uint32_t oldest, newest;
+    return historySpan(&oldest, &newest);
+}
+
+static esp_err_t request(httpd_method_t method, const char *uri, const char *headers, const char *body,
+                         MockHttpResponse *response)
+{
+    int fd = mockHttpdConnect();
+    esp_err_t err = mockHttpdRequest(fd, method, uri, headers, body, response);
+    mockHttpdDisconnect(fd);
+    return err;
+}
+
+static void frameOf(uint32_t raw_humidity, uint32_t raw_temperature, uint8_t frame[AHT20_FRAME_LENGTH])
+{
+    frame[0] = 0x1C;
+    frame[1] = raw_humidity >> 12;
+    frame[2] = raw_humidity >> 4;
+    frame[3] = (raw_humidity << 4) | (raw_temperature >> 16);
+    frame[4] = raw_temperature >> 8;
+    frame[5] = raw_temperature;
+    frame[6] = aht20Crc8(frame, AHT20_FRAME_LENGTH - 1);
+}
+
+// Reference vectors from the datasheet's conversion formulas.
+static void testDecode(void)
+{
+    static const struct
+    {
+        uint32_t raw_humidity, raw_temperature;
+        uint16_t humidity;
+        int16_t temperature;
+    } vectors[] = {
+        {0x00000, 0x00000, 0, -5000},
+        {0x80000, 0x80000, 5000, 5000},
+        {0xFFFFF, 0xFFFFF, 9999, 14999},
+        {0x73334, 0x5B852, 4500, 2150},
+    };
+
+    const uint8_t checked[] = {0xBE, 0xEF};
+    CHECK(aht20Crc8(checked, sizeof(checked)) == 0x92);
+
+    // The table against the datasheet's bitwise definition.
+    for (int byte = 0; byte < 256; byte++)
+    {
+        uint8_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ AHT20_CRC_POLYNOMIAL) : (uint8_t)(crc << 1);
+        CHECK(aht20_crc8_table[byte] == crc);
+    }
+
+    uint8_t frame[AHT20_FRAME_LENGTH];
+    int16_t temperature_value;
+    uint16_t humidity_value;
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        frameOf(vectors[i].raw_humidity, vectors[i].raw_temperature, frame);
+        CHECK(aht20Decode(frame, &temperature_value, &humidity_value) == AHT20_DECODE_OK);
+        CHECK(humidity_value == vectors[i].humidity);
+        CHECK(temperature_value == vectors[i].temperature);
+    }
+
+    // Within 0.01 of the float formula the decoder replaced, which truncated.
+    for (uint32_t raw = 0; raw <= 0xFFFFF; raw += 0x3FF)
+    {
+        frameOf(raw, raw, frame);
+        aht20Decode(frame, &temperature_value, &humidity_value);
+        int32_t humidity_float = (float)raw * 100 / 0x100000 * 100;
+        int32_t temperature_float = ((float)raw * 200 / 0x100000 - 50) * 100;
+        CHECK(abs(humidity_value - humidity_float) <= 1);
+        CHECK(abs(temperature_value - temperature_float) <= 1);
+    }
+
+    frameOf(0x80000, 0x80000, frame);
+    frame[6] ^= 0x01;
+    temperature_value = 1;
+    CHECK(aht20Decode(frame, &temperature_value, &humidity_value) == AHT20_DECODE_CRC_ERROR);
+    CHECK(temperature_value == 1);
+
+    frameOf(0x80000, 0x80000, frame);
+    frame[0] |= AHT20_STATUS_BUSY;
+    frame[6] = aht20Crc8(frame, AHT20_FRAME_LENGTH - 1);
+    CHECK(aht20Decode(frame, &temperature_value, &humidity_value) == AHT20_DECODE_BUSY);
+}
+
+// Wake-ups stay on the period grid however long the device was awake.
+static void testDutyCycleSleep(void)
+{
+    const int64_t period = 60000000;
+    DutyCycleState state = {0};
+    dutyCycleRestore(&state);
+
+    CHECK(dutyCycleNextSleep(&state, 1000, period) == period);
+    CHECK(dutyCycleNextSleep(&state, 1000 + period + 2500000, period) == period - 2500000);
+    // Awake past the next slot: it is skipped.
+    CHECK(dutyCycleNextSleep(&state, 1000 + 3 * period + 500, period) == period - 500);
+    // Too close to the slot to go to sleep: the one after.
+    CHECK(dutyCycleNextSleep(&state, 1000 + 5 * period - 50000, period) == period + 50000);
+    // The clock went back: a new grid.
+    CHECK(dutyCycleNextSleep(&state, 5000, period) == period);
+    CHECK(state.wakeups == 5);
+}
+
+// A full buffer drops the oldest sample and forces an upload attempt,
+// however far the backoff has pushed the next one.
+static void testDutyCycleRollOver(void)
+{
+    static DutyCycleState state;
+    memset(&state, 0xA5, sizeof(state));
+    CHECK(!dutyCycleRestore(&state));
+    CHECK(state.count == 0);
+
+    state.failed_uploads = 10;
+    for (uint32_t i = 0; i < DUTY_CYCLE_DEPTH + 3; i++)
+    {
+        CHECK(dutyCycleUploadDue(&state, DUTY_CYCLE_DEPTH) == (state.count == DUTY_CYCLE_DEPTH));
+        dutyCycleAppend(&state, &(DutyCycleSample){.timestamp = i});
+    }
+    CHECK(state.count == DUTY_CYCLE_DEPTH);
+    CHECK(state.dropped == 3);
+    CHECK(dutyCycleSample(&state, 0)->timestamp == 3);
+    CHECK(dutyCycleSample(&state, DUTY_CYCLE_DEPTH - 1)->timestamp == DUTY_CYCLE_DEPTH + 2);
+    CHECK(dutyCycleSample(&state, DUTY_CYCLE_DEPTH) == NULL);
+    CHECK(dutyCycleUploadDue(&state, DUTY_CYCLE_DEPTH));
+
+    // Backoff doubles the interval per failure, up to the limit.
+    dutyCycleClear(&state);
+    dutyCycleUploadFinished(&state, false);
+    CHECK(state.failed_uploads == 11 && state.since_upload == 0);
+    for (uint32_t i = 0; i < (2u << DUTY_CYCLE_MAX_BACKOFF_SHIFT) - 1; i++)
+        dutyCycleAppend(&state, &(DutyCycleSample){.timestamp = i});
+    CHECK(!dutyCycleUploadDue(&state, 2));
+    dutyCycleAppend(&state, &(DutyCycleSample){.timestamp = 99});
+    CHECK(dutyCycleUploadDue(&state, 2));
+    dutyCycleUploadFinished(&state, true);
+    CHECK(state.failed_uploads == 0);
+}
+
+// Wake-ups of the low-power mode, each in a fresh process as after deep
+// sleep. Samples of an upload that failed for lack of network are kept
+// and delivered by the next one.
+static void testLowPowerFailedUpload(void)
+{
+    uint64_t sleep_us = 0;
+    unsigned published = mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL);
+
+    mockWifiSetReachable(false);
+    CHECK(mockWake(RunLowPower, &sleep_us));
+    CHECK(sleep_us > 0 && sleep_us <= LOW_POWER_SAMPLE_PERIOD_S * 1000000ULL);
+    CHECK(mockWake(RunLowPower, &sleep_us)); // upload due, no network
+    CHECK(mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL) == published);
+
+    // After a failure the next attempt waits twice as many samples.
+    mockWifiSetReachable(true);
+    for (int i = 0; i < 3; i++)
+        CHECK(mockWake(RunLowPower, &sleep_us));
+    CHECK(mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL) == published);
+    CHECK(mockWake(RunLowPower, &sleep_us));
+
+    char last[MQTT_PAYLOAD_MAX];
+    size_t length = 0;
+    // The two samples of the failed upload, then the four of this one; a
+    // batch never mixes boots.
+    CHECK(mockMqttPublished(kTopicTemperature.topic, last, sizeof(last) - 1, &length) == published + 2);
+    last[length] = '\0';
+    const char *first = strstr(last, "[[");
+    int samples = 0;
+    for (const char *c = first != NULL ? first + 1 : NULL; c != NULL; c = strchr(c + 1, '['))
+        samples++;
+    CHECK(samples == 4);
+    CHECK(strstr(last, ",21.50]") != NULL);
+}
+
+static void testSensorReading(void)
+{
+    CHECK(temperature == 2150);
+    CHECK(humidity == 4500);
+    CHECK(mockAht20Transfers() > 0);
+}
+
+// Advertising starts from the host sync callback; started right after
+// nimble_port_freertos_init() it raced the sync and failed.
+static bool bleAdvertising(void)
+{
+    return mockBleAdvertising();
+}
+
+static bool ledPin1On(void)
+{
+    return actuatorIsOn(LED_GPIO_PIN1);
+}
+
+static bool ledPin1Off(void)
+{
+    return !actuatorIsOn(LED_GPIO_PIN1);
+}
+
+static void testBluetooth(void)
+{
+    CHECK(mockBleSynced());
+    CHECK(waitFor(bleAdvertising, 1000));
+    CHECK(strcmp(mockBleDeviceName(), "AHT20 Destiny") == 0);
+
+    // Pin 1 follows the connections through the actuator task, which owns
+    // it; it starts lit by the Wi-Fi connection.
+    mockBleConnect(1);
+    mockBleDisconnect(1);
+    CHECK(waitFor(ledPin1Off, 1000));
+    CHECK(mockGpioLevel(GPIO_NUM_1) == 0);
+    mockBleConnect(2);
+    CHECK(waitFor(ledPin1On, 1000));
+    CHECK(mockGpioLevel(GPIO_NUM_1) == 1);
+    mockBleDisconnect(2);
+    CHECK(waitFor(ledPin1Off, 1000));
+}
+
+// Poll intervals shorter than a tick still wait a tick, and the timeout is
+// real time: a sensor that stays busy is given up on after the conversion
+// time plus AHT20_POLL_TIMEOUT_MS, not after a burst of polls. The test
+// claims the sensor like a measurement, so the sampling task stays off the
+// bus meanwhile.
+static void testBusyTimeout(void)
+{
+    while (!aht20Claim())
+        usleep(1000);
+
+    Aht20Sample sample;
+    aht20Measure(&sample);
+    CHECK(sample.status == ESP_ERR_INVALID_STATE);
+
+    mockAht20SetBusyPolls(1000);
+    unsigned transfers = mockAht20Transfers();
+    int64_t started_us = esp_timer_get_time();
+    CHECK(aht20Trigger() == ESP_OK);
+    CHECK(aht20WaitReady() == ESP_ERR_TIMEOUT);
+    int64_t waited_ms = (esp_timer_get_time() - started_us) / 1000;
+    CHECK(waited_ms >= AHT20_CONVERSION_TIME_MS + AHT20_POLL_TIMEOUT_MS);
+    CHECK(waited_ms < 1000);
+    CHECK(mockAht20Transfers() - transfers <= 2 + AHT20_POLL_TIMEOUT_MS / 10 + 2);
+    mockAht20SetBusyPolls(0);
+    aht20Release();
+}
+
+static void testHistory(void)
+{
+    MockHttpResponse response;
+    CHECK(request(HTTP_GET, "/api/history", NULL, NULL, &response) == ESP_OK);
+    CHECK(strcmp(response.type, "application/json") == 0);
+    CHECK(response.complete);
+    CHECK(strstr(response.body, ",2150,4500]") != NULL);
+    mockHttpResponseFree(&response);
+
+    CHECK(request(HTTP_GET, "/api/history?from=0&to=100000&buckets=4", NULL, NULL, &response) == ESP_OK);
+    CHECK(strstr(response.body, "\"buckets\":[[0,") != NULL);
+    mockHttpResponseFree(&response);
+
+    // Clamped to the samples held: two buckets, not 2^31-second ones.
+    uint32_t oldest, newest;
+    historySpan(&oldest, &newest);
+    char expected[48];
+    snprintf(expected, sizeof(expected), "{\"from\":%u,\"to\":%u,", (unsigned)oldest, (unsigned)newest + 1);
+    int64_t started_us = esp_timer_get_time();
+    CHECK(request(HTTP_GET, "/api/history?from=0&to=4294967295&buckets=2", NULL, NULL, &response) == ESP_OK);
+    CHECK(esp_timer_get_time() - started_us < 1000000);
+    CHECK(strncmp(response.body, expected, strlen(expected)) == 0);
+    CHECK(strstr(response.body, "\"buckets\":[[") != NULL);
+    mockHttpResponseFree(&response);
+}
+
+static void parkedTask(void *param)
+{
+    xSemaphoreTake((SemaphoreHandle_t)param, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+// The stack figures cover every task, however many there are.
+static void testMetrics(void)
+{
+    SemaphoreHandle_t release = xSemaphoreCreateCounting(32, 0);
+    for (int i = 0; i < 32; i++)
+        xTaskCreate(parkedTask, "parked", 2048, release, 1, NULL);
+
+    MockHttpResponse response;
+    CHECK(request(HTTP_GET, "/metrics", NULL, NULL, &response) == ESP_OK);
+    CHECK(strncmp(response.type, "text/plain", 10) == 0);
+    CHECK(strstr(response.body, "# TYPE actuator_commands_total counter\n") != NULL);
+    CHECK(strstr(response.body, "\nheap_free_bytes ") != NULL);
+    CHECK(strstr(response.body, "task_stack_free_bytes{task=\"parked\"}") != NULL);
+    CHECK(strstr(response.body, "task_stack_free_bytes{task=\"aht20\"}") != NULL);
+    mockHttpResponseFree(&response);
+
+    for (int i = 0; i < 32; i++)
+        xSemaphoreGive(release);
+}
+
+static void testActuators(void)
+{
+    MockHttpResponse response;
+    CHECK(request(HTTP_POST, "/api/actuators", NULL, "[{\"pin\":2,\"on\":true}]", &response) == ESP_OK);
+    CHECK(strcmp(response.status, "200 OK") == 0);
+    CHECK(strstr(response.body, "{\"pin\":2,\"on\":true}") != NULL);
+    CHECK(mockGpioIsOutput(GPIO_NUM_2));
+    CHECK(mockGpioLevel(GPIO_NUM_2) == 1);
+    mockHttpResponseFree(&response);
+
+    CHECK(request(HTTP_POST, "/api/actuators", NULL, "[{\"pin\":2,\"toggle\":true}]", &response) == ESP_OK);
+    CHECK(mockGpioLevel(GPIO_NUM_2) == 0);
+    mockHttpResponseFree(&response);
+
+    CHECK(request(HTTP_POST, "/api/actuators", NULL, "[{\"pin\":7,\"on\":true}]", &response) == ESP_FAIL);
+    CHECK(strcmp(response.status, "400 Bad Request") == 0);
+    mockHttpResponseFree(&response);
+}
+
+// A handshake beyond LIVE_STREAM_MAX_CLIENTS is refused, not left open
+// without updates.
+static void testLiveStream(void)
+{
+    const char *upgrade = "Upgrade: websocket\r\n";
+    int clients[LIVE_STREAM_MAX_CLIENTS];
+    for (int i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+    {
+        clients[i] = mockHttpdConnect();
+        CHECK(mockHttpdRequest(clients[i], HTTP_GET, "/ws", upgrade, NULL, NULL) == ESP_OK);
+    }
+
+    int extra = mockHttpdConnect();
+    CHECK(mockHttpdRequest(extra, HTTP_GET, "/ws", upgrade, NULL, NULL) == ESP_FAIL);
+    CHECK(!mockHttpdIsOpen(extra));
+
+    MockHttpResponse response;
+    CHECK(request(HTTP_POST, "/api/actuators", NULL, "[{\"pin\":2,\"on\":true}]", &response) == ESP_OK);
+    mockHttpResponseFree(&response);
+    for (int i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+        CHECK(mockHttpdWaitOutput(clients[i], "{\"type\":\"led\",\"on\":true}", 2000));
+
+    // The actuator task does not wait while the stream is busy.
+    xSemaphoreTake(live.lock, portMAX_DELAY);
+    int64_t started_us = esp_timer_get_time();
+    liveStreamLed(false);
+    CHECK(esp_timer_get_time() - started_us < 10000);
+    xSemaphoreGive(live.lock);
+    CHECK(mockHttpdWaitOutput(clients[0], "{\"type\":\"led\",\"on\":false}", 2000));
+
+    for (int i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+        mockHttpdDisconnect(clients[i]);
+}
+
+// Pages are rendered on the pool and written to the socket directly.
+static void testPages(void)
+{
+    char output[4096];
+    int fd = mockHttpdConnect();
+    CHECK(mockHttpdRequest(fd, HTTP_GET, "/", NULL, NULL, NULL) == ESP_OK);
+    CHECK(mockHttpdWaitOutput(fd, "0\r\n\r\n", 2000));
+    mockHttpdTakeOutput(fd, output, sizeof(output));
+    CHECK(strncmp(output, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    CHECK(strstr(output, "\r\n5\r\n21.50\r\n") != NULL);
+
+    CHECK(mockHttpdRequest(fd, HTTP_GET, "/about.html", "Accept-Encoding: gzip, deflate\r\n", NULL, NULL) == ESP_OK);
+    CHECK(mockHttpdWaitOutput(fd, "\r\n\r\n", 2000));
+    mockHttpdTakeOutput(fd, output, sizeof(output));
+    CHECK(strstr(output, "Content-Encoding: gzip\r\n") != NULL);
+    CHECK(strstr(output, "Vary: Accept-Encoding\r\n") != NULL);
+    mockHttpdDisconnect(fd);
+
+    // The pack only has the gzip copy.
+    fd = mockHttpdConnect();
+    CHECK(mockHttpdRequest(fd, HTTP_GET, "/about.html", "Accept-Encoding: gzip;q=0, identity\r\n", NULL, NULL) == ESP_OK);
+    CHECK(mockHttpdWaitOutput(fd, "Requires Accept-Encoding: gzip", 2000));
+    mockHttpdTakeOutput(fd, output, sizeof(output));
+    CHECK(strncmp(output, "HTTP/1.1 406 Not Acceptable\r\n", 29) == 0);
+    CHECK(strstr(output, "Content-Encoding") == NULL);
+    mockHttpdDisconnect(fd);
+
+    MockHttpResponse response;
+    CHECK(request(HTTP_GET, "/missing", NULL, NULL, &response) == ESP_FAIL);
+    CHECK(strcmp(response.status, "404 Not Found") == 0);
+    mockHttpResponseFree(&response);
+}
+
+// Closing a session never waits for a worker writing to it. The worker
+// notices, and closes the socket itself; until then the descriptor is not
+// reused.
+static void testPoolClose(void)
+{
+    int fd = mockHttpdConnect();
+    // A worker may still be finishing a response for an earlier session.
+    while (__atomic_load_n(&www_pool.states[fd], __ATOMIC_ACQUIRE) & 1)
+        usleep(1000);
+
+    WwwJob job = {.fd = fd, .serial = wwwPoolSerial(fd)};
+    CHECK(wwwPoolAcquire(&job));
+    mockHttpdDisconnect(fd);
+    CHECK(!mockHttpdIsOpen(fd));
+    CHECK(fcntl(fd, F_GETFD) != -1);
+
+    int other = mockHttpdConnect();
+    CHECK(other != fd);
+    CHECK(!wwwPoolRelease(&job));
+    CHECK(fcntl(fd, F_GETFD) == -1);
+    CHECK(!wwwPoolAcquire(&job));
+    mockHttpdDisconnect(other);
+
+    // The descriptor's next session is served.
+    fd = mockHttpdConnect();
+    CHECK(mockHttpdRequest(fd, HTTP_GET, "/", NULL, NULL, NULL) == ESP_OK);
+    CHECK(mockHttpdWaitOutput(fd, "0\r\n\r\n", 2000));
+    mockHttpdDisconnect(fd);
+}
+
+static bool telemetryDelivered(void)
+{
+    return telemetry.acked == flashLogHead();
+}
+
+// A batch whose humidity message was refused is finished with humidity
+// alone; the temperature message is not sent twice.
+static void testPartialPublish(void)
+{
+    CHECK(waitFor(telemetryDelivered, 2000));
+    unsigned temperatures = mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL);
+    unsigned humidities = mockMqttPublished(kTopicHumidity.topic, NULL, 0, NULL);
+
+    mockMqttRefuse(kTopicHumidity.topic, true);
+    for (int i = 0; i < 2; i++)
+        flashLogAppend(&(Aht20Sample){.status = ESP_OK, .timestamp = 100 + i, .temperature = 2150, .humidity = 4500});
+    drainTelemetry(true);
+    CHECK(mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL) == temperatures + 1);
+    CHECK(mockMqttPublished(kTopicHumidity.topic, NULL, 0, NULL) == humidities);
+    CHECK(telemetry.partial.topics_sent == 1);
+
+    mockMqttRefuse(kTopicHumidity.topic, false);
+    xTaskNotifyGive(telemetry.task);
+    CHECK(waitFor(telemetryDelivered, 3000));
+    CHECK(mockMqttPublished(kTopicHumidity.topic, NULL, 0, NULL) == humidities + 1);
+    CHECK(mockMqttPublished(kTopicTemperature.topic, NULL, 0, NULL) == temperatures + 1);
+}
+
+// The head of a real response can be larger than the receive buffer; it
+// is parsed as it arrives and the request is sent once.
+static void testUplink(void)
+{
+    char response[2048];
+    int length = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nSet-Cookie: session=");
+    memset(response + length, 'x', 700);
+    length += 700;
+    for (int i = 0; i < 8; i++)
+        length += snprintf(response + length, sizeof(response) - length, "\r\nX-Trace-%d: %060d", i, i);
+    snprintf(response + length, sizeof(response) - length, "\r\nContent-Length: 2\r\n\r\nok");
+    mockTlsSetResponse(response);
+
+    Aht20Sample sample = {.status = ESP_OK, .temperature = 2150, .humidity = 4500};
+    unsigned requests = mockTlsRequests(NULL, 0);
+    uint32_t failures = uplink.stats.failures;
+    httpPutState(&sample);
+    char put[1024];
+    CHECK(mockTlsRequests(put, sizeof(put)) == requests + 1);
+    CHECK(strncmp(put, "PUT /device/" DEVICE_ID "/state HTTP/1.1\r\n", 48) == 0);
+    CHECK(strstr(put, "\"temperature\": {\"value\": 21.500000}") != NULL);
+    CHECK(uplink.stats.failures == failures);
+    CHECK(uplink.tls != NULL);
+
+    // The server dropped the idle connection: sent again on a new one.
+    mockTlsSetResponse("HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n");
+    mockTlsCloseConnections();
+    httpPutState(&sample);
+    CHECK(mockTlsRequests(NULL, 0) == requests + 2);
+    CHECK(uplink.stats.failures == failures);
+
+    // A response cut short is not retried.
+    mockTlsSetResponse("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nok");
+    httpPutState(&sample);
+    CHECK(mockTlsRequests(NULL, 0) == requests + 3);
+    CHECK(uplink.stats.failures == failures + 1);
+    CHECK(uplink.tls == NULL);
+    mockTlsSetResponse("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+
+    MockHttpResponse metrics;
+    CHECK(request(HTTP_GET, "/metrics", NULL, NULL, &metrics) == ESP_OK);
+    CHECK(strstr(metrics.body, "http_uplink_put_total{status=\"2xx\"} ") != NULL);
+    CHECK(strstr(metrics.body, "# TYPE http_uplink_put_seconds histogram\n") != NULL);
+    mockHttpResponseFree(&metrics);
+}
+
+// Resumption is counted when the server resumed the session, not when
+// one was offered.
+static void testSessionResumption(void)
+{
+    Aht20Sample sample = {.status = ESP_OK, .temperature = 2150, .humidity = 4500};
+    unsigned full, resumed;
+    mockTlsHandshakes(&full, &resumed);
+    uint32_t offered = uplink.stats.resumption_offered;
+    uint32_t resumptions = uplink.stats.resumed;
+
+    mockTlsCloseConnections();
+    httpPutState(&sample);
+    unsigned now_full, now_resumed;
+    mockTlsHandshakes(&now_full, &now_resumed);
+    CHECK(now_resumed == resumed + 1 && now_full == full);
+    CHECK(uplink.stats.resumption_offered == offered + 1);
+    CHECK(uplink.stats.resumed == resumptions + 1);
+
+    mockTlsSetResumption(false);
+    mockTlsCloseConnections();
+    httpPutState(&sample);
+    mockTlsHandshakes(&now_full, &now_resumed);
+    CHECK(now_resumed == resumed + 1 && now_full == full + 1);
+    CHECK(uplink.stats.resumption_offered == offered + 2);
+    CHECK(uplink.stats.resumed == resumptions + 1);
+    mockTlsSetResumption(true);
+}
+
+// After a reboot the RAM ring is empty. The newest records from before it
+// are read back from flash, and a torn one is counted as lost.
+static void testFlashLogReboot(void)
+{
+    for (int i = 0; i < 10; i++)
+        flashLogAppend(&(Aht20Sample){.status = ESP_OK, .timestamp = 200 + i, .temperature = 2000 + i, .humidity = 4000});
+    flashLogFlush();
+    uint32_t head = flashLogHead();
+
+    xSemaphoreTake(flash_log.lock, portMAX_DELAY);
+    memset(flash_log.ram, 0, sizeof(flash_log.ram));
+    flashLogRecover();
+    xSemaphoreGive(flash_log.lock);
+    CHECK(flashLogHead() == head);
+
+    const FlashLogRecord torn = {0};
+    esp_partition_write(flash_log.partition, flashLogOffset(head - 3), &torn, sizeof(torn));
+
+    TelemetrySample batch[10];
+    uint32_t next = head - 10;
+    uint16_t boot = 0;
+    uint32_t unreadable = 0;
+    CHECK(readTelemetryBatch(&next, head, batch, 10, &boot, &unreadable) == 9);
+    CHECK(unreadable == 1);
+    CHECK(next == head);
+    CHECK(boot == flash_log.boot);
+    CHECK(batch[0].timestamp == 200 && batch[0].temperature == 2000);
+    CHECK(batch[8].timestamp == 209 && batch[8].temperature == 2009);
+}
+
+int main(void)
+{
+    testDutyCycleSleep();
+    testDutyCycleRollOver();
+    // Before app_main(), so the wake-ups start from untouched RAM.
+    testLowPowerFailedUpload();
+
+    flashAssetPack();
+    app_main();
+    if (!waitFor(hasHistory, 5000))
+    {
+        fprintf(stderr, "No sample after boot\n");
+        return 1;
+    }
+
+    testDecode();
+    testSensorReading();
+    testBluetooth();
+    testBusyTimeout();
+    testHistory();
+    testMetrics();
+    testActuators();
+    testLiveStream();
+    testPages();
+    testPoolClose();
+    testPartialPublish();
+    testUplink();
+    testSessionResumption();
+    testFlashLogReboot();
+
+    if (failures > 0)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures > 0;
+}
@@ -1,4 +1,8 @@
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
 
 #include <esp_log.h>
 #include <esp_console.h>
@@ -6,19 +10,114 @@
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_spiffs.h>
+#include <esp_partition.h>
 #include <esp_http_server.h>
+#include <esp_timer.h>
+#include <esp_sleep.h>
+#include <cJSON.h>
+
+#include <lwip/sockets.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
 
 #include <driver/gpio.h>
 
+#include "include/template.h"
+#include "include/asset_pack.h"
+#include "include/sensor.h"
+#include "include/actuator.h"
+#include "include/live_stream.h"
+#include "include/www_pool.h"
+#include "include/flash_log.h"
+#include "include/mqtt.h"
+#include "include/http.h"
+#include "include/duty_cycle.h"
+#include "include/wifi_fast.h"
+
 #define WIFI_CONNECTED_FLAG BIT0
 #define LED_GPIO_PIN1 GPIO_NUM_1
 #define LED_GPIO_PIN2 GPIO_NUM_2
+#define ACTUATOR_WAIT_US 2000 // how long a request waits to report the applied state
+#define ACTUATOR_REQUEST_MAX 512
+#define ASSET_CACHE_ENTRIES 2
+#define ASSET_PACK_SUBTYPE 0x40
+#define ASSET_CACHE_CONTROL "public, max-age=86400"
+#define HISTORY_MAX_BUCKETS 512
+#define RESPONSE_ROW_MAX 128
+#define BOOT_READY_TIMEOUT_MS 30000
+#define WWW_MAX_URI_HANDLERS 13
+
+// HTTP server. Pages are rendered by the worker pool in www_pool.h when
+// WWW_ASYNC_PAGES is set, otherwise on the server task.
+#define WWW_ASYNC_PAGES 1
+#define WWW_MAX_OPEN_SOCKETS 7
+#define WWW_LRU_PURGE true
+#define WWW_KEEPALIVE_IDLE_S 30 // TCP keep-alive, 0 to disable
+#define WWW_KEEPALIVE_INTERVAL_S 5
+#define WWW_KEEPALIVE_COUNT 3
+
+// Socket budget, CONFIG_LWIP_MAX_SOCKETS (16, the ESP-IDF 4.4 maximum):
+// the server's listening and control sockets, WWW_MAX_OPEN_SOCKETS
+// sessions, one closed session per pool worker that has yet to close(),
+// the MQTT connection and the HTTPS uplink. 2 + 7 + 2 + 1 + 1 = 13 leaves
+// 3 for reconnects while an old socket is still closing. DNS goes through
+// lwIP's raw API and takes none.
+#define SOCKETS_NEEDED (2 + WWW_MAX_OPEN_SOCKETS + WWW_POOL_WORKERS + 2)
+_Static_assert(SOCKETS_NEEDED <= CONFIG_LWIP_MAX_SOCKETS, "raise CONFIG_LWIP_MAX_SOCKETS or lower WWW_MAX_OPEN_SOCKETS");
+
+// Boot dependencies, see boot_steps[].
+#define BOOT_NVS BIT0
+#define BOOT_FILESYSTEM BIT1
+#define BOOT_SENSOR BIT2
+#define BOOT_BLUETOOTH BIT3
+#define BOOT_NETIF BIT4
+#define BOOT_NETWORK BIT5 // set by OnIpStackEvent
+#define BOOT_WWW BIT6
+#define BOOT_TELEMETRY BIT7
+#define BOOT_FLASH_LOG BIT8
 
-bool led_state = false;
+// Battery operation: sleep between samples, bring Wi-Fi up only to upload.
+// The upload interval and timeouts can be shortened for host tests.
+#define LOW_POWER_MODE 0
+#define LOW_POWER_SAMPLE_PERIOD_S 60
+#ifndef LOW_POWER_UPLOAD_EVERY
+#define LOW_POWER_UPLOAD_EVERY 30
+#endif
+#ifndef LOW_POWER_CONNECT_TIMEOUT_MS
+#define LOW_POWER_CONNECT_TIMEOUT_MS 15000
+#endif
+#ifndef LOW_POWER_DELIVERY_TIMEOUT_MS
+#define LOW_POWER_DELIVERY_TIMEOUT_MS 20000
+#endif
+
+RTC_DATA_ATTR static DutyCycleState duty_cycle;
+
+typedef struct
+{
+    httpd_req_t *request;
+    esp_err_t err;
+    size_t rows;
+    size_t length;
+    char buffer[768];
+} ResponseWriter;
+
+typedef struct
+{
+    unsigned refs;
+    size_t size;
+    Template page;
+    char data[];
+} AssetBlob;
+
+typedef struct
+{
+    const char *path;
+    AssetBlob *blob;
+} CachedAsset;
 
 static struct
 {
@@ -27,21 +126,33 @@ static struct
         EventGroupHandle_t wifi;
     } event_groups;
 
-    char response_buffer[4096];
+    SampleSink *readings; // latest sample only, peeked by the page renderer
+
+    struct
+    {
+        const AssetPackHeader *image;
+        spi_flash_mmap_handle_t mapping;
+        Template *pages;
+    } pack;
+
+    SemaphoreHandle_t assets_lock;
+    CachedAsset assets[ASSET_CACHE_ENTRIES];
 } ctx = {
-    .response_buffer = {0}};
+    .assets = {
+        {.path = "/index.html"},
+        {.path = "/about.html"}}};
 
-static void setLedState(bool state, gpio_num_t pin)
-{
-    gpio_set_direction(pin, GPIO_MODE_OUTPUT);
-    gpio_set_level(pin, state ? 1 : 0);
-    if (pin == LED_GPIO_PIN2)
-        led_state = state;
-}
+static Metric page_latency = METRIC_HISTOGRAM_INIT("www_page_seconds", "Time to serve a page.");
 
-static void WaitMs(unsigned delay)
+// Driven by the actuator task, see actuator.h. Pin 1 shows the Wi-Fi and
+// BLE connection state, pin 2 is the LED switched from the web UI.
+static const gpio_num_t actuator_pins[] = {LED_GPIO_PIN1, LED_GPIO_PIN2};
+
+// Runs on the actuator task.
+static void OnActuatorChange(gpio_num_t pin, bool on)
 {
-    vTaskDelay(delay / portTICK_PERIOD_MS);
+    if (pin == LED_GPIO_PIN2)
+        liveStreamLed(on);
 }
 
 static void OnWiFiStackEvent(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -52,9 +163,13 @@ static void OnWiFiStackEvent(void *arg, esp_event_base_t event_base, int32_t eve
     switch (event_id)
     {
     case WIFI_EVENT_STA_START:
+        bootMark("wifi start");
+        actuatorSet(LED_GPIO_PIN1, false);
+        wifiFastConnect();
+        break;
     case WIFI_EVENT_STA_DISCONNECTED:
-        setLedState(false, LED_GPIO_PIN1);
-        esp_wifi_connect();
+        actuatorSet(LED_GPIO_PIN1, false);
+        wifiFastOnDisconnected((wifi_event_sta_disconnected_t *)event_data);
         break;
     default:
         break;
@@ -69,20 +184,25 @@ static void OnIpStackEvent(void *arg, esp_event_base_t event_base, int32_t event
     if (event_id != IP_EVENT_STA_GOT_IP)
         return;
 
-    setLedState(true, LED_GPIO_PIN1);
-    ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-    ESP_LOGI("WIFI", "AP address:" IPSTR, IP2STR(&event->ip_info.ip));
-    xEventGroupSetBits(ctx.event_groups.wifi, WIFI_CONNECTED_FLAG);
+    actuatorSet(LED_GPIO_PIN1, true);
+    wifiFastOnGotIp((ip_event_got_ip_t *)event_data);
+    bootMark("got ip");
+    bootSignal(BOOT_NETWORK);
+
+    // Reconnects after WaitForConnection() returned have nobody to wake.
+    if (ctx.event_groups.wifi != NULL)
+        xEventGroupSetBits(ctx.event_groups.wifi, WIFI_CONNECTED_FLAG);
 }
 
 void ConnectWiFi(char *ssid, char *password)
 {
     esp_netif_init();
 
-    esp_netif_create_default_wifi_sta();
+    esp_netif_t *netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     esp_wifi_init(&cfg);
+    wifiFastInit(netif);
 
     esp_event_handler_instance_t wifi_handler_instance;
     esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
@@ -102,15 +222,16 @@ void ConnectWiFi(char *ssid, char *password)
 
     strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
     strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
+    wifiFastApply(&wifi_config);
     esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
 
     esp_wifi_start();
 }
 
-static bool WaitForConnection(void)
+static bool WaitForConnection(TickType_t timeout)
 {
     EventBits_t flags = xEventGroupWaitBits(ctx.event_groups.wifi, WIFI_CONNECTED_FLAG,
-                                            pdFALSE, pdFALSE, portMAX_DELAY);
+                                            pdFALSE, pdFALSE, timeout);
     bool connected = false;
     if (flags & WIFI_CONNECTED_FLAG)
         connected = true;
@@ -118,42 +239,616 @@ static bool WaitForConnection(void)
     ESP_LOGI("WIFI", "%s", connected ? "Connected" : "Connection failed");
 
     vEventGroupDelete(ctx.event_groups.wifi);
+    ctx.event_groups.wifi = NULL;
     return connected;
 }
 
-static void LoadFile(const char *filename, char *buffer, size_t buffer_size)
+static AssetBlob *LoadFile(const char *path)
 {
-    memset(buffer, 0, buffer_size);
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/www%s", path);
 
     FILE *file = fopen(filename, "r");
     if (file == NULL)
     {
         ESP_LOGE("FS", "File %s not found", filename);
-        return;
+        return NULL;
     }
 
-    if (fread(buffer, 1, buffer_size, file) == 0)
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    AssetBlob *blob = length > 0 ? malloc(sizeof(AssetBlob) + length) : NULL;
+    if (blob == NULL || fread(blob->data, 1, length, file) != (size_t)length)
+    {
         ESP_LOGE("FS", "Can't read file %s", filename);
+        free(blob);
+        blob = NULL;
+    }
+    else
+    {
+        // The cache itself holds one reference until the asset is invalidated.
+        blob->refs = 1;
+        blob->size = length;
+        if (!compileTemplate(blob->data, blob->size, &blob->page))
+            ESP_LOGE("FS", "Too many placeholders in %s", filename);
+    }
 
     fclose(file);
+    return blob;
+}
+
+static void ReleaseAsset(AssetBlob *blob)
+{
+    xSemaphoreTake(ctx.assets_lock, portMAX_DELAY);
+    bool last = --blob->refs == 0;
+    xSemaphoreGive(ctx.assets_lock);
+
+    if (last)
+        free(blob);
+}
+
+static AssetBlob *AcquireAsset(const char *path)
+{
+    AssetBlob *blob = NULL;
+
+    xSemaphoreTake(ctx.assets_lock, portMAX_DELAY);
+    for (size_t i = 0; i < ASSET_CACHE_ENTRIES; i++)
+    {
+        CachedAsset *asset = &ctx.assets[i];
+        if (strcmp(asset->path, path) != 0)
+            continue;
+
+        if (asset->blob == NULL)
+            asset->blob = LoadFile(asset->path);
+
+        blob = asset->blob;
+        if (blob != NULL)
+            blob->refs++;
+        break;
+    }
+    xSemaphoreGive(ctx.assets_lock);
+
+    if (blob == NULL)
+        ESP_LOGE("FS", "Asset %s is not available", path);
+
+    return blob;
+}
+
+static void PreloadAssets(void)
+{
+    for (size_t i = 0; i < ASSET_CACHE_ENTRIES; i++)
+    {
+        AssetBlob *blob = AcquireAsset(ctx.assets[i].path);
+        if (blob != NULL)
+            ReleaseAsset(blob);
+    }
+}
+
+static void InvalidateAssetCache(void)
+{
+    for (size_t i = 0; i < ASSET_CACHE_ENTRIES; i++)
+    {
+        xSemaphoreTake(ctx.assets_lock, portMAX_DELAY);
+        AssetBlob *blob = ctx.assets[i].blob;
+        ctx.assets[i].blob = NULL;
+        xSemaphoreGive(ctx.assets_lock);
+
+        // Requests still streaming the old content keep it alive until they finish.
+        if (blob != NULL)
+            ReleaseAsset(blob);
+    }
+
+    ESP_LOGI("FS", "Asset cache invalidated");
+}
+
+static const char *RenderSlot(TemplateSlot slot, char *buffer, size_t size)
+{
+    Aht20Sample sample;
+    switch (slot)
+    {
+    case TEMPLATE_SLOT_LED:
+        return actuatorIsOn(LED_GPIO_PIN2) ? "ON" : "OFF";
+    case TEMPLATE_SLOT_TEMPERATURE:
+        if (!sampleSinkPeek(ctx.readings, &sample))
+            return "--";
+        snprintf(buffer, size, "%s%d.%02d", sample.temperature < 0 ? "-" : "",
+                 abs(sample.temperature) / 100, abs(sample.temperature) % 100);
+        return buffer;
+    case TEMPLATE_SLOT_HUMIDITY:
+        if (!sampleSinkPeek(ctx.readings, &sample))
+            return "--";
+        snprintf(buffer, size, "%u.%02u", sample.humidity / 100, sample.humidity % 100);
+        return buffer;
+    case TEMPLATE_SLOT_UPTIME:
+        snprintf(buffer, size, "%lld", (long long)(esp_timer_get_time() / 1000000));
+        return buffer;
+    default:
+        return "";
+    }
+}
+
+// A page response goes out through the httpd request, or straight to the
+// socket when a pool worker serves it.
+typedef struct
+{
+    httpd_req_t *request;
+    WwwResponse *raw;
+    const char *uri;
+    char if_none_match[16];
+    char accept_encoding[64];
+} PageOutput;
+
+static void SetPageStatus(PageOutput *out, const char *status)
+{
+    if (out->raw != NULL)
+        wwwResponseSetStatus(out->raw, status);
+    else
+        httpd_resp_set_status(out->request, status);
+}
+
+static void SetPageType(PageOutput *out, const char *type)
+{
+    if (out->raw != NULL)
+        wwwResponseSetType(out->raw, type);
+    else
+        httpd_resp_set_type(out->request, type);
+}
+
+static void SetPageHeader(PageOutput *out, const char *name, const char *value)
+{
+    if (out->raw != NULL)
+        wwwResponseSetHeader(out->raw, name, value);
+    else
+        httpd_resp_set_hdr(out->request, name, value);
+}
+
+// A NULL chunk ends the response. Empty chunks are skipped, since on the
+// wire they would end it too.
+static esp_err_t SendPageChunk(PageOutput *out, const char *data, size_t length)
+{
+    if (data != NULL && length == 0)
+        return ESP_OK;
+
+    if (out->raw != NULL)
+        return wwwResponseSendChunk(out->raw, data, length);
+    return httpd_resp_send_chunk(out->request, data, length);
+}
+
+static esp_err_t SendPageBody(PageOutput *out, const char *data, size_t length)
+{
+    if (out->raw != NULL)
+        return wwwResponseSend(out->raw, data, length);
+    return httpd_resp_send(out->request, data, length);
+}
+
+static esp_err_t SendPageNotFound(PageOutput *out)
+{
+    if (out->raw == NULL)
+        return httpd_resp_send_err(out->request, HTTPD_404_NOT_FOUND, NULL);
+
+    SetPageStatus(out, "404 Not Found");
+    SetPageType(out, "text/plain");
+    return SendPageBody(out, "Not found", 9);
+}
+
+static esp_err_t SendTemplate(PageOutput *out, const char *data, const Template *page)
+{
+    SetPageType(out, "text/html");
+    SetPageHeader(out, "Cache-Control", "no-cache");
+
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < page->count && err == ESP_OK; i++)
+    {
+        const TemplateSegment *segment = &page->segments[i];
+        err = SendPageChunk(out, data + segment->offset, segment->length);
+
+        char value[16];
+        if (err == ESP_OK && segment->slot != TEMPLATE_SLOT_NONE)
+        {
+            const char *text = RenderSlot(segment->slot, value, sizeof(value));
+            err = SendPageChunk(out, text, strlen(text));
+        }
+    }
+    if (err == ESP_OK)
+        err = SendPageChunk(out, NULL, 0);
+
+    return err;
+}
+
+static esp_err_t SendPackedAsset(PageOutput *out, const char *path)
+{
+    const AssetPackEntry *entry = findPackedAsset(ctx.pack.image, path);
+    if (entry == NULL)
+        return SendPageNotFound(out);
+
+    const char *data = getPackedAssetData(ctx.pack.image, entry);
+    if (entry->flags & ASSET_FLAG_TEMPLATE)
+        return SendTemplate(out, data, &ctx.pack.pages[entry - getAssetPackEntry(ctx.pack.image, 0)]);
+
+    // Gzip is the only copy there is.
+    bool gzip = entry->flags & ASSET_FLAG_GZIP;
+    if (gzip)
+        SetPageHeader(out, "Vary", "Accept-Encoding");
+    if (gzip && !assetAcceptsGzip(out->accept_encoding))
+    {
+        SetPageStatus(out, "406 Not Acceptable");
+        SetPageType(out, "text/plain");
+        return SendPageBody(out, "Requires Accept-Encoding: gzip", 30);
+    }
+
+    char etag[12];
+    snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)entry->etag);
+    SetPageHeader(out, "ETag", etag);
+    SetPageHeader(out, "Cache-Control", ASSET_CACHE_CONTROL);
+
+    if (strcmp(out->if_none_match, etag) == 0)
+    {
+        SetPageStatus(out, "304 Not Modified");
+        return SendPageBody(out, NULL, 0);
+    }
+
+    SetPageType(out, getAssetContentType(path));
+    if (gzip)
+        SetPageHeader(out, "Content-Encoding", "gzip");
+
+    // Sent straight from mapped flash, no copy into RAM.
+    return SendPageBody(out, data, entry->size);
+}
+
+static esp_err_t SendCachedAsset(PageOutput *out, const char *path)
+{
+    AssetBlob *page = AcquireAsset(path);
+    if (page == NULL)
+        return SendPageNotFound(out);
+
+    esp_err_t err = SendTemplate(out, page->data, &page->page);
+
+    ReleaseAsset(page);
+    return err;
+}
+
+static esp_err_t ServePage(PageOutput *out)
+{
+    const char *path = "/index.html";
+    uint32_t ticket = 0;
+    if (strcmp(out->uri, "/about.html") == 0)
+        path = "/about.html";
+    else if (strcmp(out->uri, "/ledon") == 0)
+        ticket = actuatorSet(LED_GPIO_PIN2, true);
+    else if (strcmp(out->uri, "/ledoff") == 0)
+        ticket = actuatorSet(LED_GPIO_PIN2, false);
+
+    // So the page shows the new state.
+    if (ticket != 0)
+        actuatorWait(ticket, ACTUATOR_WAIT_US);
+
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = ctx.pack.image != NULL ? SendPackedAsset(out, path) : SendCachedAsset(out, path);
+    metricObserveUs(&page_latency, esp_timer_get_time() - started_us);
+    return err;
+}
+
+// Runs on a pool worker.
+static esp_err_t ServePooledPage(WwwResponse *response)
+{
+    PageOutput out = {.raw = response, .uri = response->job->uri};
+    strcpy(out.if_none_match, response->job->if_none_match);
+    strcpy(out.accept_encoding, response->job->accept_encoding);
+    return ServePage(&out);
 }
 
 static esp_err_t GetPage(httpd_req_t *request)
 {
-    LoadFile("/www/index.html", ctx.response_buffer, sizeof(ctx.response_buffer));
-    if (strcmp(request->uri, "/about.html") == 0)
-        LoadFile("/www/about.html", ctx.response_buffer, sizeof(ctx.response_buffer));
-    else if (strcmp(request->uri, "/ledon") == 0)
-        setLedState(true, LED_GPIO_PIN2);
-    else if (strcmp(request->uri, "/ledoff") == 0)
-        setLedState(false, LED_GPIO_PIN2);
-    sprintf(ctx.response_buffer + strlen(ctx.response_buffer), led_state ? "ON" : "OFF");
-    return httpd_resp_send(request, ctx.response_buffer, HTTPD_RESP_USE_STRLEN);
+    if (WWW_ASYNC_PAGES && www_pool.jobs != NULL)
+        return wwwPoolSubmit(request);
+
+    PageOutput out = {.request = request, .uri = request->uri};
+    httpd_req_get_hdr_value_str(request, "If-None-Match", out.if_none_match, sizeof(out.if_none_match));
+    httpd_req_get_hdr_value_str(request, "Accept-Encoding", out.accept_encoding, sizeof(out.accept_encoding));
+    return ServePage(&out);
+}
+
+static void FlushResponse(ResponseWriter *writer)
+{
+    if (writer->err == ESP_OK && writer->length > 0)
+        writer->err = httpd_resp_send_chunk(writer->request, writer->buffer, writer->length);
+    writer->length = 0;
+}
+
+// Rows are batched into one chunk; each row must be shorter than RESPONSE_ROW_MAX.
+static void AppendResponse(ResponseWriter *writer, const char *format, ...)
+{
+    if (sizeof(writer->buffer) - writer->length < RESPONSE_ROW_MAX)
+        FlushResponse(writer);
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(writer->buffer + writer->length, sizeof(writer->buffer) - writer->length, format, args);
+    va_end(args);
+
+    if (length > 0)
+        writer->length += MIN((size_t)length, sizeof(writer->buffer) - writer->length - 1);
+}
+
+static esp_err_t FinishResponse(ResponseWriter *writer)
+{
+    FlushResponse(writer);
+    if (writer->err == ESP_OK)
+        writer->err = httpd_resp_send_chunk(writer->request, NULL, 0);
+    return writer->err;
+}
+
+static uint32_t GetQueryValue(httpd_req_t *request, const char *key, uint32_t default_value)
+{
+    char query[64];
+    char value[12];
+    if (httpd_req_get_url_query_str(request, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK)
+        return default_value;
+
+    return strtoul(value, NULL, 10);
+}
+
+static bool WriteHistorySample(const HistorySample *sample, void *arg)
+{
+    ResponseWriter *writer = arg;
+    AppendResponse(writer, "%s[%u,%d,%u]", writer->rows++ > 0 ? "," : "",
+                   (unsigned)sample->timestamp, sample->temperature, sample->humidity);
+    return writer->err == ESP_OK;
+}
+
+// GET /api/history?from=<s>&to=<s>[&buckets=<n>]
+// Timestamps are seconds since boot, values are in 0.01 degC / 0.01 %RH.
+static esp_err_t GetHistory(httpd_req_t *request)
+{
+    uint32_t oldest = 0;
+    uint32_t newest = 0;
+    historySpan(&oldest, &newest);
+
+    // The range is clamped to what the buffer holds, so at most `buckets`
+    // buckets are aggregated, and computed in 64 bits: newest + 1 and the
+    // bucket starts must not wrap around.
+    uint64_t end = (uint64_t)newest + 1;
+    uint64_t from = MIN(MAX(GetQueryValue(request, "from", oldest), oldest), end);
+    uint64_t to = MIN(MAX(GetQueryValue(request, "to", UINT32_MAX), from), end);
+    uint32_t buckets = MIN(GetQueryValue(request, "buckets", 0), HISTORY_MAX_BUCKETS);
+
+    ResponseWriter *writer = calloc(1, sizeof(ResponseWriter));
+    if (writer == NULL)
+        return httpd_resp_send_err(request, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    writer->request = request;
+
+    httpd_resp_set_type(request, "application/json");
+    AppendResponse(writer, "{\"from\":%u,\"to\":%u,", (unsigned)from, (unsigned)to);
+
+    if (buckets == 0)
+    {
+        AppendResponse(writer, "\"columns\":[\"t\",\"temperature\",\"humidity\"],\"samples\":[");
+        historyQueryRange(from, to, WriteHistorySample, writer);
+    }
+    else
+    {
+        AppendResponse(writer, "\"columns\":[\"t\",\"count\",\"temperature_min\",\"temperature_max\","
+                               "\"temperature_avg\",\"humidity_min\",\"humidity_max\",\"humidity_avg\"],"
+                               "\"buckets\":[");
+
+        uint64_t width = MAX((to - from + buckets - 1) / buckets, 1);
+        for (uint64_t start = from; start < to && writer->err == ESP_OK; start += width)
+        {
+            HistoryBucket bucket;
+            historyAggregate(start, MIN(start + width, to), &bucket);
+            if (bucket.count == 0)
+                continue;
+
+            AppendResponse(writer, "%s[%u,%u,%d,%d,%d,%u,%u,%u]",
+                           writer->rows++ > 0 ? "," : "",
+                           (unsigned)start, (unsigned)bucket.count,
+                           bucket.temperature_min, bucket.temperature_max, (int)(bucket.temperature_sum / (int32_t)bucket.count),
+                           bucket.humidity_min, bucket.humidity_max, (unsigned)(bucket.humidity_sum / bucket.count));
+        }
+    }
+
+    AppendResponse(writer, "]}");
+    esp_err_t err = FinishResponse(writer);
+    free(writer);
+    return err;
+}
+
+static esp_err_t GetBootTimeline(httpd_req_t *request)
+{
+    BootPhase phases[BOOT_TIMELINE_MAX];
+    size_t count = bootTimeline(phases, BOOT_TIMELINE_MAX);
+
+    ResponseWriter *writer = calloc(1, sizeof(ResponseWriter));
+    if (writer == NULL)
+        return httpd_resp_send_err(request, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    writer->request = request;
+
+    httpd_resp_set_type(request, "application/json");
+    AppendResponse(writer, "{\"columns\":[\"phase\",\"start_us\",\"duration_us\"],\"phases\":[");
+    for (size_t i = 0; i < count; i++)
+        AppendResponse(writer, "%s[\"%s\",%lld,%lld]", i > 0 ? "," : "", phases[i].name,
+                       (long long)phases[i].start_us, (long long)(phases[i].end_us - phases[i].start_us));
+
+    AppendResponse(writer, "]}");
+    esp_err_t err = FinishResponse(writer);
+    free(writer);
+    return err;
+}
+
+static void WriteMetricsLine(void *arg, const char *line)
+{
+    AppendResponse(arg, "%s", line);
+}
+
+static esp_err_t GetMetrics(httpd_req_t *request)
+{
+    ResponseWriter *writer = calloc(1, sizeof(ResponseWriter));
+    if (writer == NULL)
+        return httpd_resp_send_err(request, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    writer->request = request;
+
+    httpd_resp_set_type(request, "text/plain; version=0.0.4");
+    metricsExport(WriteMetricsLine, writer);
+    esp_err_t err = FinishResponse(writer);
+    free(writer);
+    return err;
+}
+
+static void WriteActuatorState(ResponseWriter *writer)
+{
+    ActuatorSnapshot state = actuatorSnapshot();
+    AppendResponse(writer, "{\"pins\":[");
+    for (size_t i = 0; i < actuator.count; i++)
+        AppendResponse(writer, "%s{\"pin\":%d,\"on\":%s}", i > 0 ? "," : "", actuator.pins[i],
+                       (state.levels >> i) & 1 ? "true" : "false");
+
+    AppendResponse(writer, "],\"applied\":%u,\"changed_us\":%lld}", (unsigned)state.applied,
+                   (long long)state.changed_us);
+}
+
+static esp_err_t GetActuators(httpd_req_t *request)
+{
+    ResponseWriter *writer = calloc(1, sizeof(ResponseWriter));
+    if (writer == NULL)
+        return httpd_resp_send_err(request, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    writer->request = request;
+
+    httpd_resp_set_type(request, "application/json");
+    WriteActuatorState(writer);
+    esp_err_t err = FinishResponse(writer);
+    free(writer);
+    return err;
+}
+
+// Folds [{"pin":2,"on":true},{"pin":1,"toggle":true},...] into one command,
+// applied in array order. False if anything in it is not understood.
+static bool ParseActuatorCommand(const cJSON *root, ActuatorCommand *command)
+{
+    if (!cJSON_IsArray(root) || root->child == NULL)
+        return false;
+
+    const cJSON *item;
+    cJSON_ArrayForEach(item, root)
+    {
+        const cJSON *pin = cJSON_GetObjectItemCaseSensitive(item, "pin");
+        const cJSON *on = cJSON_GetObjectItemCaseSensitive(item, "on");
+        const cJSON *toggle = cJSON_GetObjectItemCaseSensitive(item, "toggle");
+        uint32_t mask = cJSON_IsNumber(pin) ? actuatorMask(pin->valueint) : 0;
+        if (mask == 0)
+            return false;
+
+        if (cJSON_IsBool(on))
+        {
+            command->set |= mask;
+            command->levels = cJSON_IsTrue(on) ? command->levels | mask : command->levels & ~mask;
+            command->toggle &= ~mask;
+        }
+        else if (cJSON_IsTrue(toggle))
+        {
+            command->toggle ^= mask;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// POST /api/actuators with a JSON array of pin commands. All of them are
+// applied together; the response is the state once they took effect, or
+// 202 if that takes longer than ACTUATOR_WAIT_US.
+static esp_err_t PostActuators(httpd_req_t *request)
+{
+    if (request->content_len == 0 || request->content_len >= ACTUATOR_REQUEST_MAX)
+        return httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "Expected a JSON array of pin commands");
+
+    char body[ACTUATOR_REQUEST_MAX];
+    size_t length = 0;
+    while (length < request->content_len)
+    {
+        int received = httpd_req_recv(request, body + length, request->content_len - length);
+        if (received <= 0)
+            return ESP_FAIL;
+        length += received;
+    }
+    body[length] = '\0';
+
+    ActuatorCommand command = {0};
+    cJSON *root = cJSON_Parse(body);
+    bool valid = ParseActuatorCommand(root, &command);
+    cJSON_Delete(root);
+    if (!valid)
+        return httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "Expected [{\"pin\":<gpio>,\"on\":<bool>|\"toggle\":true},...]");
+
+    uint32_t ticket = actuatorSubmit(command);
+    if (ticket == 0)
+    {
+        httpd_resp_set_status(request, "503 Service Unavailable");
+        httpd_resp_set_hdr(request, "Retry-After", "1");
+        return httpd_resp_send(request, NULL, 0);
+    }
+
+    ResponseWriter *writer = calloc(1, sizeof(ResponseWriter));
+    if (writer == NULL)
+        return httpd_resp_send_err(request, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+    writer->request = request;
+
+    if (!actuatorWait(ticket, ACTUATOR_WAIT_US))
+        httpd_resp_set_status(request, "202 Accepted");
+    httpd_resp_set_type(request, "application/json");
+    WriteActuatorState(writer);
+    esp_err_t err = FinishResponse(writer);
+    free(writer);
+    return err;
+}
+
+static esp_err_t PostInvalidateCache(httpd_req_t *request)
+{
+    if (ctx.pack.image != NULL)
+        return httpd_resp_send_err(request, HTTPD_405_METHOD_NOT_ALLOWED, "Assets are served from www_pack");
+
+    InvalidateAssetCache();
+    return httpd_resp_send(request, NULL, 0);
+}
+
+static esp_err_t OnSessionOpen(httpd_handle_t server, int fd)
+{
+    // Lets the server notice clients that vanished without closing.
+    if (WWW_KEEPALIVE_IDLE_S > 0)
+    {
+        int enable = 1;
+        int idle = WWW_KEEPALIVE_IDLE_S;
+        int interval = WWW_KEEPALIVE_INTERVAL_S;
+        int count = WWW_KEEPALIVE_COUNT;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+    return ESP_OK;
+}
+
+// With a close_fn set, closing the socket is up to us.
+static void OnSessionClose(httpd_handle_t server, int fd)
+{
+    liveStreamOnClose(fd);
+    // A pool worker still writing to the socket closes it when done.
+    if (wwwPoolOnClose(fd))
+        close(fd);
 }
 
 static bool CreateWWWServer(httpd_handle_t *server)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_uri_handlers = WWW_MAX_URI_HANDLERS;
+    config.max_open_sockets = WWW_MAX_OPEN_SOCKETS;
+    config.lru_purge_enable = WWW_LRU_PURGE;
+    config.open_fn = OnSessionOpen;
+    config.close_fn = OnSessionClose;
 
     httpd_uri_t uri_get = {
         .uri = "/",
@@ -179,60 +874,309 @@ static bool CreateWWWServer(httpd_handle_t *server)
         .handler = GetPage,
         .user_ctx = NULL};
 
-    if (httpd_start(server, &config) == ESP_OK)
+    httpd_uri_t uri_invalidate = {
+        .uri = "/cache/invalidate",
+        .method = HTTP_POST,
+        .handler = PostInvalidateCache,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_history = {
+        .uri = "/api/history",
+        .method = HTTP_GET,
+        .handler = GetHistory,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_boot = {
+        .uri = "/api/boot",
+        .method = HTTP_GET,
+        .handler = GetBootTimeline,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_metrics = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = GetMetrics,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_actuators_get = {
+        .uri = "/api/actuators",
+        .method = HTTP_GET,
+        .handler = GetActuators,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_actuators_post = {
+        .uri = "/api/actuators",
+        .method = HTTP_POST,
+        .handler = PostActuators,
+        .user_ctx = NULL};
+
+    httpd_uri_t uri_live = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = liveStreamHandler,
+        .user_ctx = NULL,
+        .is_websocket = true};
+
+    if (httpd_start(server, &config) != ESP_OK)
+        return false;
+
+    httpd_register_uri_handler(*server, &uri_get);
+    httpd_register_uri_handler(*server, &uri_get_about);
+    httpd_register_uri_handler(*server, &uri_on);
+    httpd_register_uri_handler(*server, &uri_off);
+    httpd_register_uri_handler(*server, &uri_invalidate);
+    httpd_register_uri_handler(*server, &uri_history);
+    httpd_register_uri_handler(*server, &uri_boot);
+    httpd_register_uri_handler(*server, &uri_metrics);
+    httpd_register_uri_handler(*server, &uri_actuators_get);
+    httpd_register_uri_handler(*server, &uri_actuators_post);
+    httpd_register_uri_handler(*server, &uri_live);
+    liveStreamStart(*server);
+    if (WWW_ASYNC_PAGES && !wwwPoolStart(*server, ServePooledPage))
+        ESP_LOGE("WWW", "Worker pool not started, serving pages inline");
+    return true;
+}
+
+static bool MapAssetPack(void)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ASSET_PACK_SUBTYPE, "www_pack");
+    if (partition == NULL)
+        return false;
+
+    const void *image;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA,
+                           &image, &ctx.pack.mapping) != ESP_OK)
+        return false;
+
+    const AssetPackHeader *header = openAssetPack(image, partition->size);
+    Template *pages = header != NULL ? calloc(header->count, sizeof(Template)) : NULL;
+    if (pages == NULL)
     {
-        httpd_register_uri_handler(*server, &uri_get);
-        httpd_register_uri_handler(*server, &uri_get_about);
-        httpd_register_uri_handler(*server, &uri_on);
-        httpd_register_uri_handler(*server, &uri_off);
+        ESP_LOGE("FS", "Asset pack in %s is not valid", partition->label);
+        spi_flash_munmap(ctx.pack.mapping);
+        return false;
     }
 
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const AssetPackEntry *entry = getAssetPackEntry(header, i);
+        if ((entry->flags & ASSET_FLAG_TEMPLATE) &&
+            !compileTemplate(getPackedAssetData(header, entry), entry->size, &pages[i]))
+            ESP_LOGE("FS", "Too many placeholders in %s", entry->path);
+    }
+
+    ctx.pack.pages = pages;
+    ctx.pack.image = header;
+    ESP_LOGI("FS", "Serving %u assets from %s", (unsigned)header->count, partition->label);
     return true;
 }
 
-static void InitializeFilesystem(void)
+static bool InitializeFilesystem(void)
 {
+    // The mapped asset pack takes SPIFFS out of the request path entirely;
+    // the SPIFFS cache is only used for images flashed without www_pack.
+    int64_t started_us = esp_timer_get_time();
+    bool mapped = MapAssetPack();
+    bootRecord("asset pack", started_us);
+    if (mapped)
+        return true;
+
     esp_vfs_spiffs_conf_t fs_config = {
         .base_path = "/www",
         .partition_label = "www_data",
         .max_files = 3,
         .format_if_mount_failed = false};
 
-    esp_vfs_spiffs_register(&fs_config);
+    ctx.assets_lock = xSemaphoreCreateMutex();
+    started_us = esp_timer_get_time();
+    esp_err_t err = esp_vfs_spiffs_register(&fs_config);
+    bootRecord("spiffs mount", started_us);
+    if (err != ESP_OK)
+        return false;
+
+    PreloadAssets();
+    return true;
 }
 
-static void InitializeNVS(void)
+static bool InitializeSensor(void)
+{
+    // A one-slot sink that always holds the newest reading; pages peek it.
+    ctx.readings = sampleBusSubscribe("web", 1, SAMPLE_DROP_OLDEST);
+    return aht20Init() == ESP_OK;
+}
+
+// Telemetry replays from the log; it must not wait for a slow or missing
+// sensor.
+static bool StartFlashLog(void)
+{
+    flashLogInit();
+    return true;
+}
+
+// Runs on the NimBLE host task; actuatorSet() never blocks.
+static void OnBleConnectionChange(bool connected)
+{
+    actuatorSet(LED_GPIO_PIN1, connected);
+}
+
+static bool InitializeBluetooth(void)
+{
+    bleSetConnectionHook(OnBleConnectionChange);
+    initializeBluetooth();
+    return true;
+}
+
+static bool InitializeNVS(void)
 {
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
+        int64_t started_us = esp_timer_get_time();
         nvs_flash_erase();
-        nvs_flash_init();
+        ret = nvs_flash_init();
+        bootRecord("nvs erase", started_us);
     }
+    return ret == ESP_OK;
 }
 
-void app_main(void)
+static bool StartWiFi(void)
+{
+    int64_t started_us = esp_timer_get_time();
+    esp_event_loop_create_default();
+    bootRecord("event loop", started_us);
+    ConnectWiFi("iot", "iotpasswd");
+    return true;
+}
+
+static bool StartWWWServer(void)
+{
+    httpd_handle_t server;
+    return CreateWWWServer(&server);
+}
+
+static bool StartTelemetry(void)
+{
+    mqttAppStart();
+    httpUplinkStart();
+    return true;
+}
+
+// Local subsystems come up in parallel; the server listens as soon as the
+// network interface exists, before the station has an address.
+static const BootStep boot_steps[] = {
+    {"nvs", InitializeNVS, 0, BOOT_NVS},
+    {"filesystem", InitializeFilesystem, 0, BOOT_FILESYSTEM},
+    {"flash log", StartFlashLog, BOOT_NVS, BOOT_FLASH_LOG},
+    {"sensor", InitializeSensor, BOOT_NVS, BOOT_SENSOR},
+    {"bluetooth", InitializeBluetooth, BOOT_NVS, BOOT_BLUETOOTH},
+    {"wifi", StartWiFi, BOOT_NVS, BOOT_NETIF},
+    {"www", StartWWWServer, BOOT_NETIF | BOOT_FILESYSTEM, BOOT_WWW},
+    {"telemetry", StartTelemetry, BOOT_NETWORK | BOOT_FLASH_LOG, BOOT_TELEMETRY},
+};
+
+// The RTC clock keeps running through deep sleep, unlike esp_timer.
+static int64_t RtcTimeUs(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+// Moves the buffered samples into the flash log and delivers the log over
+// MQTT. Whatever is not acknowledged stays in the log for the next upload.
+static bool UploadDutyCycleBatch(void)
 {
     InitializeNVS();
-    InitializeFilesystem();
+    flashLogOpen();
+
+    for (size_t i = 0; i < duty_cycle.count; i++)
+    {
+        const DutyCycleSample *entry = dutyCycleSample(&duty_cycle, i);
+        Aht20Sample sample = {
+            .status = ESP_OK,
+            .timestamp = entry->timestamp,
+            .temperature = entry->temperature,
+            .humidity = entry->humidity,
+        };
+        flashLogWrite(&sample);
+    }
+    flashLogFlush();
+
+    // Without the log partition the samples are only safe in RTC memory.
+    bool persisted = flash_log.partition != NULL;
+    if (persisted)
+        dutyCycleClear(&duty_cycle);
 
     esp_event_loop_create_default();
     ctx.event_groups.wifi = xEventGroupCreate();
-
     ConnectWiFi("iot", "iotpasswd");
 
-    bool connected = WaitForConnection();
-    if (connected == false)
-        goto error;
+    bool delivered = WaitForConnection(pdMS_TO_TICKS(LOW_POWER_CONNECT_TIMEOUT_MS));
+    if (delivered)
+    {
+        mqttAppStart();
+        delivered = mqttWaitForDelivery(pdMS_TO_TICKS(LOW_POWER_DELIVERY_TIMEOUT_MS));
+    }
 
-    httpd_handle_t server;
-    bool running = CreateWWWServer(&server);
-    if (running == false)
-        goto error;
+    esp_wifi_stop();
+    if (delivered && !persisted)
+        dutyCycleClear(&duty_cycle);
 
-error:
-    while (1)
+    ESP_LOGI("Power", "Upload %s", delivered ? "done" : "failed");
+    return delivered;
+}
+
+// One wake-up: take a sample into RTC memory, upload when due, then go
+// back to deep sleep until the next slot. Does not return.
+static void RunLowPower(void)
+{
+    if (!dutyCycleRestore(&duty_cycle))
+        ESP_LOGI("Power", "Cold start");
+
+    Aht20Sample sample;
+    if (aht20MeasureOnce(&sample) == ESP_OK)
     {
-        WaitMs(1000);
-    };
+        DutyCycleSample entry = {
+            .timestamp = RtcTimeUs() / 1000000,
+            .temperature = sample.temperature,
+            .humidity = sample.humidity,
+        };
+        dutyCycleAppend(&duty_cycle, &entry);
+    }
+
+    if (dutyCycleUploadDue(&duty_cycle, LOW_POWER_UPLOAD_EVERY))
+        dutyCycleUploadFinished(&duty_cycle, UploadDutyCycleBatch());
+
+    int64_t sleep_us = dutyCycleNextSleep(&duty_cycle, RtcTimeUs(), LOW_POWER_SAMPLE_PERIOD_S * 1000000LL);
+    ESP_LOGI("Power", "%u samples buffered, sleeping for %lld ms", duty_cycle.count, (long long)(sleep_us / 1000));
+
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_deep_sleep_start();
+}
+
+void app_main(void)
+{
+    if (LOW_POWER_MODE)
+        RunLowPower();
+
+    bootMark("app_main");
+
+    // Before the boot steps, so the Wi-Fi events find the status LED ready.
+    int64_t started_us = esp_timer_get_time();
+    if (!actuatorStart(actuator_pins, sizeof(actuator_pins) / sizeof(actuator_pins[0]), OnActuatorChange))
+        ESP_LOGE("Boot", "Actuator not started, LEDs stay off");
+    bootRecord("actuator", started_us);
+
+    bootStart(boot_steps, sizeof(boot_steps) / sizeof(boot_steps[0]));
+
+    if (bootWait(BOOT_WWW | BOOT_SENSOR, pdMS_TO_TICKS(BOOT_READY_TIMEOUT_MS)))
+        ESP_LOGI("Boot", "Serving and sampling at %u ms", bootElapsedMs());
+    else
+        ESP_LOGE("Boot", "Not ready after %d ms", BOOT_READY_TIMEOUT_MS);
+
+    // Network-dependent steps usually finish later; print what there is
+    // once everything is up or the timeout passed.
+    bootWait(BOOT_BLUETOOTH | BOOT_TELEMETRY, pdMS_TO_TICKS(BOOT_READY_TIMEOUT_MS));
+    bootLogTimeline();
 }
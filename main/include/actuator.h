@@ -0,0 +1,257 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <driver/gpio.h>
+
+// Output pins driven by one high-priority task. The pins are configured
+// once in actuatorStart(); afterwards a command is only a few register
+// writes. Any task may submit commands: the queue between submitters and
+// the actuator task is a bounded lock-free ring (one sequence number per
+// slot), so submitting never blocks and never waits on a mutex held by a
+// lower-priority task. A command carries masks over the configured pins,
+// so several pins change together and in submission order.
+//
+// The applied state is published as a snapshot under a sequence counter.
+// Only the actuator task writes it; readers retry while it changes and
+// never block it. Readers must not outrank the actuator task on its core,
+// or they could spin on a half-written snapshot.
+
+#define ACTUATOR_MAX_PINS 8
+#define ACTUATOR_QUEUE_DEPTH 16 // power of two
+#define ACTUATOR_TASK_PRIORITY (configMAX_PRIORITIES - 3) // below the Wi-Fi task
+#define ACTUATOR_TASK_STACK 3072
+
+typedef struct
+{
+    uint32_t set;    // pins to set to their bit in levels
+    uint32_t levels;
+    uint32_t toggle; // pins to invert, after set
+    int64_t queued_us;
+} ActuatorCommand;
+
+typedef struct
+{
+    uint32_t levels; // bit i is pin i of the actuatorStart() table
+    uint32_t applied; // commands applied since start, the last ticket
+    int64_t changed_us;
+} ActuatorSnapshot;
+
+// Runs on the actuator task after a pin changed. Keep it short.
+typedef void (*ActuatorChangeHook)(gpio_num_t pin, bool on);
+
+typedef struct
+{
+    uint32_t sequence;
+    ActuatorCommand command;
+} ActuatorSlot;
+
+static struct
+{
+    TaskHandle_t task;
+    ActuatorChangeHook on_change;
+    gpio_num_t pins[ACTUATOR_MAX_PINS];
+    size_t count;
+
+    ActuatorSlot slots[ACTUATOR_QUEUE_DEPTH];
+    uint32_t head; // next slot to fill, shared by all submitters
+    uint32_t tail; // next slot to apply, actuator task only
+
+    uint32_t version; // odd while the snapshot is written
+    ActuatorSnapshot state;
+} actuator;
+
+static Metric actuator_commands = METRIC_COUNTER_INIT("actuator_commands_total", "Actuator commands applied.");
+static Metric actuator_rejected = METRIC_COUNTER_INIT("actuator_rejected_total", "Actuator commands refused, queue full.");
+static Metric actuator_latency = METRIC_HISTOGRAM_INIT("actuator_latency_seconds", "Time from submitting a command to the pins changing.");
+
+// Bit of a GPIO in command masks, 0 if it is not configured.
+static uint32_t actuatorMask(gpio_num_t pin)
+{
+    for (size_t i = 0; i < actuator.count; i++)
+    {
+        if (actuator.pins[i] == pin)
+            return 1u << i;
+    }
+    return 0;
+}
+
+// Returns the command's ticket, see actuatorWait(), or 0 if the queue is full.
+static uint32_t actuatorPush(const ActuatorCommand *command)
+{
+    uint32_t position = __atomic_load_n(&actuator.head, __ATOMIC_RELAXED);
+    ActuatorSlot *slot;
+    while (1)
+    {
+        slot = &actuator.slots[position % ACTUATOR_QUEUE_DEPTH];
+        int32_t lag = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag < 0)
+            return 0; // the actuator task has not emptied this slot yet
+
+        if (lag > 0)
+            position = __atomic_load_n(&actuator.head, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&actuator.head, &position, position + 1, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+
+    slot->command = *command;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return position + 1;
+}
+
+static bool actuatorPop(ActuatorCommand *command)
+{
+    ActuatorSlot *slot = &actuator.slots[actuator.tail % ACTUATOR_QUEUE_DEPTH];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != actuator.tail + 1)
+        return false;
+
+    *command = slot->command;
+    __atomic_store_n(&slot->sequence, actuator.tail + ACTUATOR_QUEUE_DEPTH, __ATOMIC_RELEASE);
+    actuator.tail++;
+    return true;
+}
+
+// Queues a command and returns its ticket, or 0 if the queue is full or
+// the actuator is not running.
+static uint32_t actuatorSubmit(ActuatorCommand command)
+{
+    if (actuator.task == NULL)
+        return 0;
+
+    command.queued_us = esp_timer_get_time();
+    uint32_t ticket = actuatorPush(&command);
+    if (ticket == 0)
+    {
+        metricInc(&actuator_rejected);
+        return 0;
+    }
+
+    xTaskNotifyGive(actuator.task);
+    return ticket;
+}
+
+static uint32_t actuatorSet(gpio_num_t pin, bool on)
+{
+    uint32_t mask = actuatorMask(pin);
+    return mask != 0 ? actuatorSubmit((ActuatorCommand){.set = mask, .levels = on ? mask : 0}) : 0;
+}
+
+static ActuatorSnapshot actuatorSnapshot(void)
+{
+    ActuatorSnapshot snapshot;
+    uint32_t version;
+    do
+    {
+        while ((version = __atomic_load_n(&actuator.version, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        snapshot = actuator.state;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&actuator.version, __ATOMIC_RELAXED) != version);
+    return snapshot;
+}
+
+static bool actuatorIsOn(gpio_num_t pin)
+{
+    return (actuatorSnapshot().levels & actuatorMask(pin)) != 0;
+}
+
+// Waits until the command with the given ticket was applied. Commands take
+// microseconds, so this spins; false after timeout_us.
+static bool actuatorWait(uint32_t ticket, int64_t timeout_us)
+{
+    int64_t deadline_us = esp_timer_get_time() + timeout_us;
+    while ((int32_t)(actuatorSnapshot().applied - ticket) < 0)
+    {
+        if (esp_timer_get_time() >= deadline_us)
+            return false;
+        taskYIELD();
+    }
+    return true;
+}
+
+static void actuatorApply(const ActuatorCommand *command)
+{
+    uint32_t levels = actuator.state.levels;
+    levels = (levels & ~command->set) | (command->levels & command->set);
+    levels ^= command->toggle;
+    uint32_t changed = levels ^ actuator.state.levels;
+
+    for (size_t i = 0; i < actuator.count; i++)
+    {
+        if (changed & (1u << i))
+            gpio_set_level(actuator.pins[i], (levels >> i) & 1);
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    __atomic_store_n(&actuator.version, actuator.version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    actuator.state.levels = levels;
+    actuator.state.applied++;
+    if (changed != 0)
+        actuator.state.changed_us = now_us;
+    __atomic_store_n(&actuator.version, actuator.version + 1, __ATOMIC_RELEASE);
+
+    metricInc(&actuator_commands);
+    metricObserveUs(&actuator_latency, now_us - command->queued_us);
+
+    for (size_t i = 0; i < actuator.count && actuator.on_change != NULL; i++)
+    {
+        if (changed & (1u << i))
+            actuator.on_change(actuator.pins[i], (levels >> i) & 1);
+    }
+}
+
+static void actuatorTask(void *param)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        ActuatorCommand command;
+        while (actuatorPop(&command))
+            actuatorApply(&command);
+    }
+}
+
+// Configures the pins as outputs, all low, and starts the actuator task on
+// the last core, away from the Wi-Fi and lwIP tasks.
+static bool actuatorStart(const gpio_num_t *pins, size_t count, ActuatorChangeHook on_change)
+{
+    if (actuator.task != NULL || count == 0 || count > ACTUATOR_MAX_PINS)
+        return false;
+
+    gpio_config_t config = {
+        .mode = GPIO_MODE_OUTPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    for (size_t i = 0; i < count; i++)
+    {
+        config.pin_bit_mask |= 1ULL << pins[i];
+        actuator.pins[i] = pins[i];
+    }
+
+    if (gpio_config(&config) != ESP_OK)
+    {
+        ESP_LOGE("Actuator", "Could not configure the output pins");
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        gpio_set_level(pins[i], 0);
+
+    actuator.count = count;
+    actuator.on_change = on_change;
+    for (uint32_t i = 0; i < ACTUATOR_QUEUE_DEPTH; i++)
+        actuator.slots[i].sequence = i;
+
+    return xTaskCreatePinnedToCore(actuatorTask, "actuator", ACTUATOR_TASK_STACK, NULL,
+                                   ACTUATOR_TASK_PRIORITY, &actuator.task, portNUM_PROCESSORS - 1) == pdPASS;
+}
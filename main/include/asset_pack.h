@@ -0,0 +1,160 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+// Flat web asset image produced by tools/pack-www.py and flashed into the
+// www_pack partition. All integers are little endian.
+//
+//   AssetPackHeader | AssetPackEntry[count] | asset data...
+//
+// Static assets are stored gzip-compressed. Pages containing template
+// placeholders are stored as plain text so they can be compiled in place.
+
+#define ASSET_PACK_MAGIC 0x50575757 // "WWWP"
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_PATH_LENGTH 40
+
+#define ASSET_FLAG_GZIP 0x01
+#define ASSET_FLAG_TEMPLATE 0x02
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t size;
+} AssetPackHeader;
+
+typedef struct
+{
+    char path[ASSET_PACK_PATH_LENGTH];
+    uint32_t offset;
+    uint32_t size;
+    uint32_t etag;
+    uint32_t flags;
+    uint32_t reserved[2];
+} AssetPackEntry;
+
+_Static_assert(sizeof(AssetPackHeader) == 16, "AssetPackHeader layout must match tools/pack-www.py");
+_Static_assert(sizeof(AssetPackEntry) == 64, "AssetPackEntry layout must match tools/pack-www.py");
+
+// Returns the header if the image is complete and consistent, NULL otherwise.
+static const AssetPackHeader *openAssetPack(const void *image, size_t size)
+{
+    const AssetPackHeader *header = image;
+    if (size < sizeof(*header) || header->magic != ASSET_PACK_MAGIC || header->version != ASSET_PACK_VERSION)
+        return NULL;
+
+    if (header->size > size || header->count > (header->size - sizeof(*header)) / sizeof(AssetPackEntry))
+        return NULL;
+
+    const AssetPackEntry *entries = (const AssetPackEntry *)(header + 1);
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        if (entries[i].offset > header->size || entries[i].size > header->size - entries[i].offset)
+            return NULL;
+        if (memchr(entries[i].path, '\0', ASSET_PACK_PATH_LENGTH) == NULL)
+            return NULL;
+    }
+
+    return header;
+}
+
+static const AssetPackEntry *getAssetPackEntry(const AssetPackHeader *header, uint32_t index)
+{
+    return &((const AssetPackEntry *)(header + 1))[index];
+}
+
+static const AssetPackEntry *findPackedAsset(const AssetPackHeader *header, const char *path)
+{
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const AssetPackEntry *entry = getAssetPackEntry(header, i);
+        if (strcmp(entry->path, path) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static const char *getPackedAssetData(const AssetPackHeader *header, const AssetPackEntry *entry)
+{
+    return (const char *)header + entry->offset;
+}
+
+static const char *getAssetContentType(const char *path)
+{
+    static const struct
+    {
+        const char *extension;
+        const char *type;
+    } kTypes[] = {
+        {".html", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".png", "image/png"},
+        {".svg", "image/svg+xml"},
+        {".ico", "image/x-icon"},
+    };
+
+    const char *extension = strrchr(path, '.');
+    for (size_t i = 0; extension != NULL && i < sizeof(kTypes) / sizeof(kTypes[0]); i++)
+    {
+        if (strcmp(extension, kTypes[i].extension) == 0)
+            return kTypes[i].type;
+    }
+
+    return "application/octet-stream";
+}
+
+// True if the q-value after "q=" is zero, i.e. the coding is refused.
+static bool isZeroQuality(const char *value)
+{
+    if (*value++ != '0')
+        return false;
+    if (*value == '.')
+    {
+        value++;
+        while (*value == '0')
+            value++;
+    }
+    return !(*value >= '1' && *value <= '9');
+}
+
+// True if an Accept-Encoding value lists gzip or "*" without q=0. Only an
+// explicit listing counts, since the pack has no uncompressed copy to fall
+// back on for clients that cannot decode it.
+static bool assetAcceptsGzip(const char *accept_encoding)
+{
+    const char *at = accept_encoding;
+    while (*at != '\0')
+    {
+        while (*at == ' ' || *at == '\t' || *at == ',')
+            at++;
+
+        const char *name = at;
+        while (*at != '\0' && *at != ',' && *at != ';' && *at != ' ' && *at != '\t')
+            at++;
+        size_t name_length = at - name;
+
+        bool refused = false;
+        while (*at != '\0' && *at != ',')
+        {
+            if (*at++ != ';')
+                continue;
+            while (*at == ' ' || *at == '\t')
+                at++;
+            if ((*at == 'q' || *at == 'Q') && at[1] == '=')
+                refused = isZeroQuality(at + 2);
+        }
+
+        bool gzip = (name_length == 4 && strncasecmp(name, "gzip", 4) == 0) || (name_length == 1 && *name == '*');
+        if (gzip && !refused)
+            return true;
+    }
+
+    return false;
+}
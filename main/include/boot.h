@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+// Boot orchestration. Every step runs in its own short-lived task as soon
+// as the event bits it requires are set, and sets the bits it provides when
+// it succeeds. Steps without dependencies start at once and run in
+// parallel; bits set from elsewhere (e.g. "got an IP address" from the
+// event handler) release the steps waiting for them.
+//
+// An event group holds 24 bits, which bounds the number of distinct
+// dependencies, not the number of steps.
+//
+// Steps, and any phase or event recorded with bootRecord()/bootMark(), also
+// go into a timeline in RAM. Times are on the esp_timer clock, so they count
+// from application start-up, not from bootStart().
+
+#define BOOT_TASK_STACK 4096
+#define BOOT_TASK_PRIORITY 5
+#define BOOT_TIMELINE_MAX 32
+
+typedef bool (*BootStepFunction)(void);
+
+typedef struct
+{
+    const char *name;
+    BootStepFunction run;
+    EventBits_t requires; // all of these, 0 to start immediately
+    EventBits_t provides; // set once run() returned true
+} BootStep;
+
+typedef struct
+{
+    const char *name;
+    int64_t start_us;
+    int64_t end_us; // equal to start_us for events
+} BootPhase;
+
+static struct
+{
+    EventGroupHandle_t events;
+    int64_t started_us;
+
+    portMUX_TYPE lock;
+    size_t count;
+    BootPhase timeline[BOOT_TIMELINE_MAX];
+} boot = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+// Records a phase that started at start_us and ends now. Only the first
+// occurrence of a name is kept, so hooks on events that repeat after boot
+// (reconnects, samples) cost a lookup and nothing else.
+static void bootRecord(const char *name, int64_t start_us)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&boot.lock);
+    bool seen = false;
+    for (size_t i = 0; i < boot.count && !seen; i++)
+        seen = strcmp(boot.timeline[i].name, name) == 0;
+
+    if (!seen && boot.count < BOOT_TIMELINE_MAX)
+        boot.timeline[boot.count++] = (BootPhase){.name = name, .start_us = start_us, .end_us = now_us};
+    portEXIT_CRITICAL(&boot.lock);
+}
+
+static void bootMark(const char *name)
+{
+    bootRecord(name, esp_timer_get_time());
+}
+
+// Copies the timeline, in the order phases finished.
+static size_t bootTimeline(BootPhase *phases, size_t max)
+{
+    portENTER_CRITICAL(&boot.lock);
+    size_t count = MIN(boot.count, max);
+    memcpy(phases, boot.timeline, count * sizeof(*phases));
+    portEXIT_CRITICAL(&boot.lock);
+    return count;
+}
+
+static void bootLogTimeline(void)
+{
+    BootPhase phases[BOOT_TIMELINE_MAX];
+    size_t count = bootTimeline(phases, BOOT_TIMELINE_MAX);
+    for (size_t i = 0; i < count; i++)
+        ESP_LOGI("Boot", "%8lld us  +%8lld us  %s", (long long)phases[i].start_us,
+                 (long long)(phases[i].end_us - phases[i].start_us), phases[i].name);
+}
+
+// Safe to call before bootStart() or when the orchestrator is not used.
+static void bootSignal(EventBits_t bits)
+{
+    if (boot.events != NULL)
+        xEventGroupSetBits(boot.events, bits);
+}
+
+static bool bootWait(EventBits_t bits, TickType_t timeout)
+{
+    EventBits_t set = xEventGroupWaitBits(boot.events, bits, pdFALSE, pdTRUE, timeout);
+    return (set & bits) == bits;
+}
+
+static unsigned bootElapsedMs(void)
+{
+    return (unsigned)((esp_timer_get_time() - boot.started_us) / 1000);
+}
+
+static void bootStepTask(void *arg)
+{
+    const BootStep *step = arg;
+    if (step->requires != 0)
+        bootWait(step->requires, portMAX_DELAY);
+
+    int64_t started_us = esp_timer_get_time();
+    bool ok = step->run();
+    unsigned took_ms = (unsigned)((esp_timer_get_time() - started_us) / 1000);
+    bootRecord(step->name, started_us);
+
+    if (ok)
+    {
+        ESP_LOGI("Boot", "%s ready at %u ms (took %u ms)", step->name, bootElapsedMs(), took_ms);
+        bootSignal(step->provides);
+    }
+    else
+    {
+        // Steps that depend on this one never start.
+        ESP_LOGE("Boot", "%s failed after %u ms", step->name, took_ms);
+    }
+
+    vTaskDelete(NULL);
+}
+
+// steps must stay valid until every step has run.
+static void bootStart(const BootStep *steps, size_t count)
+{
+    boot.events = xEventGroupCreate();
+    boot.started_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (xTaskCreate(bootStepTask, steps[i].name, BOOT_TASK_STACK, (void *)&steps[i],
+                        BOOT_TASK_PRIORITY, NULL) != pdPASS)
+            ESP_LOGE("Boot", "Cannot start %s", steps[i].name);
+    }
+}
@@ -0,0 +1,139 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Minimal CBOR (RFC 8949) writer for telemetry payloads. It writes into a
+// caller-provided buffer and never allocates; on overflow it stops writing
+// and cborFinish() reports failure.
+
+#define CBOR_MAJOR_UNSIGNED 0
+#define CBOR_MAJOR_NEGATIVE 1
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_MAJOR_SIMPLE 7
+#define CBOR_FLOAT32 26
+
+typedef enum
+{
+    PAYLOAD_FORMAT_JSON,
+    PAYLOAD_FORMAT_CBOR,
+} PayloadFormat;
+
+typedef struct
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+} CborWriter;
+
+static void cborInit(CborWriter *writer, uint8_t *buffer, size_t size)
+{
+    *writer = (CborWriter){.buffer = buffer, .size = size};
+}
+
+static void cborWriteBytes(CborWriter *writer, const void *data, size_t length)
+{
+    if (writer->overflow || writer->size - writer->length < length)
+    {
+        writer->overflow = true;
+        return;
+    }
+
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+// Initial byte plus the shortest big-endian argument encoding.
+static void cborWriteHead(CborWriter *writer, uint8_t major, uint32_t value)
+{
+    uint8_t head[5];
+    size_t length;
+
+    if (value < 24)
+    {
+        head[0] = (major << 5) | value;
+        length = 1;
+    }
+    else if (value <= UINT8_MAX)
+    {
+        head[0] = (major << 5) | 24;
+        head[1] = value;
+        length = 2;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        head[0] = (major << 5) | 25;
+        head[1] = value >> 8;
+        head[2] = value;
+        length = 3;
+    }
+    else
+    {
+        head[0] = (major << 5) | 26;
+        head[1] = value >> 24;
+        head[2] = value >> 16;
+        head[3] = value >> 8;
+        head[4] = value;
+        length = 5;
+    }
+
+    cborWriteBytes(writer, head, length);
+}
+
+static void cborWriteUint(CborWriter *writer, uint32_t value)
+{
+    cborWriteHead(writer, CBOR_MAJOR_UNSIGNED, value);
+}
+
+static void cborWriteInt(CborWriter *writer, int32_t value)
+{
+    if (value >= 0)
+        cborWriteHead(writer, CBOR_MAJOR_UNSIGNED, value);
+    else
+        cborWriteHead(writer, CBOR_MAJOR_NEGATIVE, (uint32_t)(-1 - value));
+}
+
+static void cborWriteFloat(CborWriter *writer, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint8_t data[5] = {(CBOR_MAJOR_SIMPLE << 5) | CBOR_FLOAT32, bits >> 24, bits >> 16, bits >> 8, bits};
+    cborWriteBytes(writer, data, sizeof(data));
+}
+
+static void cborWriteText(CborWriter *writer, const char *text)
+{
+    size_t length = strlen(text);
+    cborWriteHead(writer, CBOR_MAJOR_TEXT, length);
+    cborWriteBytes(writer, text, length);
+}
+
+static void cborWriteArray(CborWriter *writer, uint32_t count)
+{
+    cborWriteHead(writer, CBOR_MAJOR_ARRAY, count);
+}
+
+static void cborWriteMap(CborWriter *writer, uint32_t count)
+{
+    cborWriteHead(writer, CBOR_MAJOR_MAP, count);
+}
+
+// Sample record: [timestamp, temperature, humidity] with the values in
+// 0.01 degC / 0.01 %RH, typically 9-11 bytes. A batch is an array of records.
+static void cborWriteSample(CborWriter *writer, uint32_t timestamp, int16_t temperature, uint16_t humidity)
+{
+    cborWriteArray(writer, 3);
+    cborWriteUint(writer, timestamp);
+    cborWriteInt(writer, temperature);
+    cborWriteUint(writer, humidity);
+}
+
+// Returns the encoded length, or -1 if the buffer was too small.
+static int cborFinish(const CborWriter *writer)
+{
+    return writer->overflow ? -1 : (int)writer->length;
+}
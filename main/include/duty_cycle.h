@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Scheduling and batching for the deep-sleep mode. The state lives in RTC
+// slow memory and survives deep sleep; this file has no driver
+// dependencies so the logic can be built and exercised on the host.
+//
+// Every wake-up appends one sample. An upload is due every upload_every
+// samples; after failed uploads the interval doubles (up to
+// 1 << DUTY_CYCLE_MAX_BACKOFF_SHIFT) so a missing network does not drain
+// the battery, but a full buffer always forces an attempt.
+
+#define DUTY_CYCLE_MAGIC 0x44435943 // "DCYC"
+#ifndef DUTY_CYCLE_DEPTH
+#define DUTY_CYCLE_DEPTH 128
+#endif
+#define DUTY_CYCLE_MAX_BACKOFF_SHIFT 3
+#define DUTY_CYCLE_MIN_SLEEP_US 100000
+
+typedef struct
+{
+    uint32_t timestamp;  // seconds on the RTC clock
+    int16_t temperature; // 0.01 degC
+    uint16_t humidity;   // 0.01 %RH
+} DutyCycleSample;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t wakeups;
+    uint32_t since_upload;   // samples taken since the last upload attempt
+    uint32_t failed_uploads; // consecutive
+    uint32_t dropped;
+    int64_t next_wake_us; // on the RTC clock, 0 until the first sleep
+    uint16_t first;
+    uint16_t count;
+    DutyCycleSample samples[DUTY_CYCLE_DEPTH];
+} DutyCycleState;
+
+// RTC memory holds garbage after power-on; anything without the magic is
+// treated as a cold start.
+static bool dutyCycleRestore(DutyCycleState *state)
+{
+    if (state->magic == DUTY_CYCLE_MAGIC && state->first < DUTY_CYCLE_DEPTH && state->count <= DUTY_CYCLE_DEPTH)
+        return true;
+
+    *state = (DutyCycleState){.magic = DUTY_CYCLE_MAGIC};
+    return false;
+}
+
+// When the buffer is full the oldest sample makes room.
+static void dutyCycleAppend(DutyCycleState *state, const DutyCycleSample *sample)
+{
+    if (state->count == DUTY_CYCLE_DEPTH)
+    {
+        state->first = (state->first + 1) % DUTY_CYCLE_DEPTH;
+        state->count--;
+        state->dropped++;
+    }
+
+    state->samples[(state->first + state->count) % DUTY_CYCLE_DEPTH] = *sample;
+    state->count++;
+    state->since_upload++;
+}
+
+static const DutyCycleSample *dutyCycleSample(const DutyCycleState *state, size_t index)
+{
+    return index < state->count ? &state->samples[(state->first + index) % DUTY_CYCLE_DEPTH] : NULL;
+}
+
+static void dutyCycleClear(DutyCycleState *state)
+{
+    state->first = 0;
+    state->count = 0;
+}
+
+static bool dutyCycleUploadDue(const DutyCycleState *state, uint32_t upload_every)
+{
+    uint32_t shift = state->failed_uploads < DUTY_CYCLE_MAX_BACKOFF_SHIFT ? state->failed_uploads : DUTY_CYCLE_MAX_BACKOFF_SHIFT;
+    return state->count == DUTY_CYCLE_DEPTH || state->since_upload >= (upload_every << shift);
+}
+
+static void dutyCycleUploadFinished(DutyCycleState *state, bool succeeded)
+{
+    state->since_upload = 0;
+    state->failed_uploads = succeeded ? 0 : state->failed_uploads + 1;
+}
+
+// Wake-ups stay on a fixed grid of period_us regardless of how long the
+// device was awake; slots that already passed are skipped. Returns how long
+// to sleep from now_us.
+static int64_t dutyCycleNextSleep(DutyCycleState *state, int64_t now_us, int64_t period_us)
+{
+    state->wakeups++;
+
+    // Start the grid on the first sleep, or again if the clock went back.
+    if (state->next_wake_us == 0 || state->next_wake_us > now_us + period_us)
+        state->next_wake_us = now_us;
+
+    state->next_wake_us += period_us;
+    if (state->next_wake_us < now_us + DUTY_CYCLE_MIN_SLEEP_US)
+    {
+        int64_t missed = (now_us + DUTY_CYCLE_MIN_SLEEP_US - state->next_wake_us) / period_us + 1;
+        state->next_wake_us += missed * period_us;
+    }
+
+    return state->next_wake_us - now_us;
+}
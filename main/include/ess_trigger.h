@@ -0,0 +1,154 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Environmental Sensing Service trigger settings (ES Trigger Setting
+// descriptor, GATT Specification Supplement 3.92). A trigger decides, for
+// every new sample, whether the characteristic should be notified.
+
+#define ESS_TRIGGER_SETTING_UUID 0x290D
+#define ESS_MEASUREMENT_UUID 0x290C
+#define ESS_TRIGGER_MAX_LENGTH 4
+#define ESS_ERR_CONDITION_NOT_SUPPORTED 0x81
+
+typedef enum
+{
+    ESS_TRIGGER_INACTIVE = 0x00,
+    ESS_TRIGGER_FIXED_INTERVAL = 0x01,
+    ESS_TRIGGER_MIN_INTERVAL = 0x02,
+    ESS_TRIGGER_ON_CHANGE = 0x03,
+    ESS_TRIGGER_LESS_THAN = 0x04,
+    ESS_TRIGGER_LESS_OR_EQUAL = 0x05,
+    ESS_TRIGGER_GREATER_THAN = 0x06,
+    ESS_TRIGGER_GREATER_OR_EQUAL = 0x07,
+    ESS_TRIGGER_EQUAL = 0x08,
+    ESS_TRIGGER_NOT_EQUAL = 0x09,
+} EssTriggerCondition;
+
+// For interval conditions the operand is in seconds (uint24), otherwise it
+// is a value in the characteristic's own format.
+typedef struct
+{
+    uint8_t condition;
+    int32_t operand;
+} EssTriggerSetting;
+
+typedef struct
+{
+    EssTriggerSetting setting;
+    bool sampled;
+    int32_t last_sample;
+    bool notified;
+    int32_t last_value;
+    uint32_t last_notified_ms;
+} EssTrigger;
+
+static bool essTriggerIsInterval(uint8_t condition)
+{
+    return condition == ESS_TRIGGER_FIXED_INTERVAL || condition == ESS_TRIGGER_MIN_INTERVAL;
+}
+
+// value_size is 2 for the int16/uint16 temperature and humidity values.
+static bool essTriggerParse(const uint8_t *data, size_t length, size_t value_size, bool is_signed,
+                            EssTriggerSetting *setting)
+{
+    if (length < 1 || data[0] > ESS_TRIGGER_NOT_EQUAL)
+        return false;
+
+    setting->condition = data[0];
+    setting->operand = 0;
+
+    if (setting->condition == ESS_TRIGGER_INACTIVE || setting->condition == ESS_TRIGGER_ON_CHANGE)
+        return length == 1;
+
+    if (essTriggerIsInterval(setting->condition))
+    {
+        if (length != 4)
+            return false;
+        setting->operand = data[1] | (data[2] << 8) | ((int32_t)data[3] << 16);
+        return true;
+    }
+
+    if (length != 1 + value_size)
+        return false;
+
+    uint16_t raw = data[1] | (data[2] << 8);
+    setting->operand = is_signed ? (int16_t)raw : raw;
+    return true;
+}
+
+static size_t essTriggerSerialize(const EssTriggerSetting *setting, size_t value_size, uint8_t *data)
+{
+    data[0] = setting->condition;
+    if (setting->condition == ESS_TRIGGER_INACTIVE || setting->condition == ESS_TRIGGER_ON_CHANGE)
+        return 1;
+
+    size_t operand_size = essTriggerIsInterval(setting->condition) ? 3 : value_size;
+    for (size_t i = 0; i < operand_size; i++)
+        data[1 + i] = (uint8_t)(setting->operand >> (8 * i));
+
+    return 1 + operand_size;
+}
+
+static bool essTriggerConditionHolds(const EssTriggerSetting *setting, int32_t value)
+{
+    switch (setting->condition)
+    {
+    case ESS_TRIGGER_LESS_THAN:
+        return value < setting->operand;
+    case ESS_TRIGGER_LESS_OR_EQUAL:
+        return value <= setting->operand;
+    case ESS_TRIGGER_GREATER_THAN:
+        return value > setting->operand;
+    case ESS_TRIGGER_GREATER_OR_EQUAL:
+        return value >= setting->operand;
+    case ESS_TRIGGER_EQUAL:
+        return value == setting->operand;
+    case ESS_TRIGGER_NOT_EQUAL:
+        return value != setting->operand;
+    default:
+        return false;
+    }
+}
+
+// Evaluated once per sample. Value conditions fire when the value changed
+// and the condition holds, so crossing a threshold always notifies once.
+static bool essTriggerShouldNotify(EssTrigger *trigger, int32_t value, uint32_t now_ms)
+{
+    const EssTriggerSetting *setting = &trigger->setting;
+    bool changed = !trigger->notified || value != trigger->last_value;
+    bool moved = !trigger->sampled || value != trigger->last_sample;
+    uint32_t elapsed_ms = now_ms - trigger->last_notified_ms;
+
+    bool notify;
+    switch (setting->condition)
+    {
+    case ESS_TRIGGER_INACTIVE:
+        notify = false;
+        break;
+    case ESS_TRIGGER_FIXED_INTERVAL:
+        notify = !trigger->notified || elapsed_ms >= (uint32_t)setting->operand * 1000;
+        break;
+    case ESS_TRIGGER_MIN_INTERVAL:
+        notify = changed && (!trigger->notified || elapsed_ms >= (uint32_t)setting->operand * 1000);
+        break;
+    case ESS_TRIGGER_ON_CHANGE:
+        notify = changed;
+        break;
+    default:
+        notify = moved && essTriggerConditionHolds(setting, value);
+        break;
+    }
+
+    trigger->sampled = true;
+    trigger->last_sample = value;
+
+    if (notify)
+    {
+        trigger->notified = true;
+        trigger->last_value = value;
+        trigger->last_notified_ms = now_ms;
+    }
+
+    return notify;
+}
@@ -0,0 +1,368 @@
+#include <string.h>
+
+#include <esp_partition.h>
+#include <nvs.h>
+#include <freertos/semphr.h>
+
+// Store-and-forward log of sensor readings in the "tlog" partition. The
+// partition is a ring of 4 KiB sectors; each one starts with a header that
+// carries its sequence number, and record n always lives in slot
+// n % FLASH_LOG_RECORDS_PER_SECTOR of sector sequence
+// n / FLASH_LOG_RECORDS_PER_SECTOR. Sectors are written front to back and
+// only erased when the ring wraps onto them, so every sector sees one erase
+// per pass. New records are staged in RAM and written in batches.
+//
+// After a reset the write position is recovered by reading the sector
+// headers and scanning the newest sector for its last programmed slot.
+// A record torn by power loss fails its CRC and is skipped by readers.
+
+#define FLASH_LOG_PARTITION "tlog"
+#define FLASH_LOG_SUBTYPE 0x41
+#define FLASH_LOG_SECTOR_SIZE 4096
+#define FLASH_LOG_MAGIC 0x474F4C54 // "TLOG"
+#define FLASH_LOG_HEADER_SIZE 16
+#define FLASH_LOG_RECORD_SIZE 12
+#define FLASH_LOG_RECORDS_PER_SECTOR ((FLASH_LOG_SECTOR_SIZE - FLASH_LOG_HEADER_SIZE) / FLASH_LOG_RECORD_SIZE)
+#define FLASH_LOG_BATCH_RECORDS 30 // 5 minutes at the 10 s sampling period
+#define FLASH_LOG_RAM_RECORDS 64
+#define FLASH_LOG_CURSOR_SAVE_EVERY 30
+#define FLASH_LOG_NVS_NAMESPACE "tlog"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t reserved[2];
+} FlashLogSectorHeader;
+
+typedef struct
+{
+    uint32_t timestamp;  // seconds since boot, RTC seconds in the deep-sleep mode
+    int16_t temperature; // 0.01 degC
+    uint16_t humidity;   // 0.01 %RH
+    uint16_t boot;       // boot counter, tells timestamps of different boots apart
+    uint8_t reserved;
+    uint8_t crc; // over the preceding bytes
+} FlashLogRecord;
+
+_Static_assert(sizeof(FlashLogSectorHeader) == FLASH_LOG_HEADER_SIZE, "unexpected sector header size");
+_Static_assert(sizeof(FlashLogRecord) == FLASH_LOG_RECORD_SIZE, "unexpected record size");
+
+// A consumer's position in the log, persisted in NVS so that what was not
+// yet delivered survives a reboot.
+typedef struct
+{
+    const char *name; // NVS key, at most 15 characters
+    uint32_t saved;
+} FlashLogCursor;
+
+static struct
+{
+    const esp_partition_t *partition;
+    SemaphoreHandle_t lock;
+    SampleSink *samples;
+    uint16_t boot;
+    uint32_t sector_count;
+
+    uint32_t tail;      // oldest record still stored
+    uint32_t ram_start; // records from here on were appended since boot
+    uint32_t flushed;   // records below this are in flash
+    uint32_t head;      // id of the next record
+    FlashLogRecord ram[FLASH_LOG_RAM_RECORDS]; // newest records, indexed by id
+
+    struct
+    {
+        uint32_t flushes;
+        uint32_t erases;
+        uint32_t write_errors;
+    } stats;
+} flash_log;
+
+static uint8_t flashLogCrc(const FlashLogRecord *record)
+{
+    return aht20Crc8((const uint8_t *)record, offsetof(FlashLogRecord, crc));
+}
+
+static size_t flashLogOffset(uint32_t id)
+{
+    uint32_t sector = (id / FLASH_LOG_RECORDS_PER_SECTOR) % flash_log.sector_count;
+    return sector * FLASH_LOG_SECTOR_SIZE + FLASH_LOG_HEADER_SIZE + (id % FLASH_LOG_RECORDS_PER_SECTOR) * FLASH_LOG_RECORD_SIZE;
+}
+
+static bool flashLogIsErased(const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (bytes[i] != 0xFF)
+            return false;
+    }
+
+    return true;
+}
+
+// Erases the sector that will hold the given sequence and stamps its
+// header. Whatever that sector held before is the oldest data in the log.
+static bool flashLogStartSector(uint32_t sequence)
+{
+    uint32_t sector = sequence % flash_log.sector_count;
+    FlashLogSectorHeader header = {.magic = FLASH_LOG_MAGIC, .sequence = sequence};
+
+    if (sequence >= flash_log.sector_count)
+    {
+        uint32_t oldest = (sequence - flash_log.sector_count + 1) * FLASH_LOG_RECORDS_PER_SECTOR;
+        flash_log.tail = MAX(flash_log.tail, oldest);
+    }
+
+    esp_err_t err = esp_partition_erase_range(flash_log.partition, sector * FLASH_LOG_SECTOR_SIZE, FLASH_LOG_SECTOR_SIZE);
+    if (err == ESP_OK)
+        err = esp_partition_write(flash_log.partition, sector * FLASH_LOG_SECTOR_SIZE, &header, sizeof(header));
+
+    flash_log.stats.erases++;
+    if (err != ESP_OK)
+    {
+        ESP_LOGE("Flash log", "Preparing sector %u failed: %s", sector, esp_err_to_name(err));
+        flash_log.stats.write_errors++;
+        return false;
+    }
+
+    return true;
+}
+
+// Writes all staged records, one partition write per sector touched.
+static void flashLogFlush(void)
+{
+    if (flash_log.partition == NULL)
+        return;
+
+    xSemaphoreTake(flash_log.lock, portMAX_DELAY);
+    while (flash_log.flushed < flash_log.head)
+    {
+        uint32_t id = flash_log.flushed;
+        uint32_t slot = id % FLASH_LOG_RECORDS_PER_SECTOR;
+        if (slot == 0 && !flashLogStartSector(id / FLASH_LOG_RECORDS_PER_SECTOR))
+            break;
+
+        size_t count = MIN(flash_log.head - id, FLASH_LOG_RECORDS_PER_SECTOR - slot);
+        count = MIN(count, FLASH_LOG_RAM_RECORDS - id % FLASH_LOG_RAM_RECORDS);
+
+        esp_err_t err = esp_partition_write(flash_log.partition, flashLogOffset(id),
+                                            &flash_log.ram[id % FLASH_LOG_RAM_RECORDS], count * FLASH_LOG_RECORD_SIZE);
+        if (err != ESP_OK)
+        {
+            // Never program the same bytes twice; these slots read back as invalid.
+            ESP_LOGE("Flash log", "Writing %u records failed: %s", (unsigned)count, esp_err_to_name(err));
+            flash_log.stats.write_errors++;
+        }
+
+        flash_log.flushed += count;
+    }
+    flash_log.stats.flushes++;
+    xSemaphoreGive(flash_log.lock);
+}
+
+static void flashLogAppend(const Aht20Sample *sample)
+{
+    FlashLogRecord record = {
+        .timestamp = sample->timestamp,
+        .temperature = sample->temperature,
+        .humidity = sample->humidity,
+        .boot = flash_log.boot,
+    };
+    record.crc = flashLogCrc(&record);
+
+    xSemaphoreTake(flash_log.lock, portMAX_DELAY);
+    // If flash writes keep failing the staging ring wraps onto unwritten
+    // records; give them up rather than stall the log.
+    if (flash_log.head - flash_log.flushed == FLASH_LOG_RAM_RECORDS)
+        flash_log.flushed++;
+
+    flash_log.ram[flash_log.head % FLASH_LOG_RAM_RECORDS] = record;
+    flash_log.head++;
+
+    if (flash_log.partition == NULL)
+    {
+        flash_log.flushed = flash_log.head;
+        flash_log.tail = flash_log.head > FLASH_LOG_RAM_RECORDS ? flash_log.head - FLASH_LOG_RAM_RECORDS : 0;
+    }
+    xSemaphoreGive(flash_log.lock);
+}
+
+static uint32_t flashLogHead(void)
+{
+    return __atomic_load_n(&flash_log.head, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t flashLogTail(void)
+{
+    return __atomic_load_n(&flash_log.tail, __ATOMIC_ACQUIRE);
+}
+
+// Returns false if the record is gone, not written yet or was torn. The
+// RAM ring only holds records appended since boot; older ones, including
+// the newest before a reboot, are read from flash.
+static bool flashLogRead(uint32_t id, FlashLogRecord *record)
+{
+    bool found = false;
+
+    xSemaphoreTake(flash_log.lock, portMAX_DELAY);
+    if (id >= flash_log.tail && id < flash_log.head)
+    {
+        if (id >= flash_log.ram_start && flash_log.head - id <= FLASH_LOG_RAM_RECORDS)
+        {
+            *record = flash_log.ram[id % FLASH_LOG_RAM_RECORDS];
+            found = true;
+        }
+        else
+        {
+            found = esp_partition_read(flash_log.partition, flashLogOffset(id), record, sizeof(*record)) == ESP_OK;
+        }
+    }
+    xSemaphoreGive(flash_log.lock);
+
+    return found && record->crc == flashLogCrc(record);
+}
+
+static void flashLogRecover(void)
+{
+    bool found = false;
+    uint32_t newest = 0;
+    uint32_t oldest = 0;
+
+    for (uint32_t sector = 0; sector < flash_log.sector_count; sector++)
+    {
+        FlashLogSectorHeader header;
+        if (esp_partition_read(flash_log.partition, sector * FLASH_LOG_SECTOR_SIZE, &header, sizeof(header)) != ESP_OK ||
+            header.magic != FLASH_LOG_MAGIC || header.sequence % flash_log.sector_count != sector)
+            continue;
+
+        newest = found ? MAX(newest, header.sequence) : header.sequence;
+        oldest = found ? MIN(oldest, header.sequence) : header.sequence;
+        found = true;
+    }
+
+    if (!found)
+    {
+        ESP_LOGI("Flash log", "Empty log, %u sectors", flash_log.sector_count);
+        return;
+    }
+
+    // The newest sector is filled up to its last programmed slot.
+    uint32_t slot = FLASH_LOG_RECORDS_PER_SECTOR;
+    while (slot > 0)
+    {
+        FlashLogRecord record;
+        esp_partition_read(flash_log.partition, flashLogOffset(newest * FLASH_LOG_RECORDS_PER_SECTOR + slot - 1),
+                           &record, sizeof(record));
+        if (!flashLogIsErased(&record, sizeof(record)))
+            break;
+        slot--;
+    }
+
+    if (newest >= flash_log.sector_count)
+        oldest = MAX(oldest, newest - flash_log.sector_count + 1);
+
+    flash_log.tail = oldest * FLASH_LOG_RECORDS_PER_SECTOR;
+    flash_log.head = flash_log.flushed = flash_log.ram_start = newest * FLASH_LOG_RECORDS_PER_SECTOR + slot;
+    ESP_LOGI("Flash log", "Recovered records %u..%u", flash_log.tail, flash_log.head);
+}
+
+static uint16_t flashLogNextBoot(void)
+{
+    nvs_handle_t nvs;
+    uint16_t boot = 0;
+    if (nvs_open(FLASH_LOG_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return boot;
+
+    nvs_get_u16(nvs, "boot", &boot);
+    boot++;
+    nvs_set_u16(nvs, "boot", boot);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+    return boot;
+}
+
+// Starts at the saved position, or at the oldest stored record for a new
+// consumer. Records that were overwritten meanwhile are skipped.
+static uint32_t flashLogCursorOpen(FlashLogCursor *cursor, const char *name)
+{
+    cursor->name = name;
+    cursor->saved = flashLogTail();
+
+    nvs_handle_t nvs;
+    if (nvs_open(FLASH_LOG_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK)
+    {
+        nvs_get_u32(nvs, name, &cursor->saved);
+        nvs_close(nvs);
+    }
+
+    cursor->saved = MIN(MAX(cursor->saved, flashLogTail()), flashLogHead());
+    return cursor->saved;
+}
+
+// Persists the position every FLASH_LOG_CURSOR_SAVE_EVERY records, or
+// right away when forced, to keep NVS writes down.
+static void flashLogCursorSave(FlashLogCursor *cursor, uint32_t position, bool force)
+{
+    if (position == cursor->saved || (!force && position - cursor->saved < FLASH_LOG_CURSOR_SAVE_EVERY))
+        return;
+
+    nvs_handle_t nvs;
+    if (nvs_open(FLASH_LOG_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+
+    if (nvs_set_u32(nvs, cursor->name, position) == ESP_OK && nvs_commit(nvs) == ESP_OK)
+        cursor->saved = position;
+    nvs_close(nvs);
+}
+
+// Appends and writes a batch to flash once enough records are staged.
+static void flashLogWrite(const Aht20Sample *sample)
+{
+    flashLogAppend(sample);
+    if (flash_log.head - flash_log.flushed >= FLASH_LOG_BATCH_RECORDS)
+        flashLogFlush();
+}
+
+static void flashLogTask(void *param)
+{
+    Aht20Sample sample;
+    while (1)
+    {
+        if (sampleSinkReceive(flash_log.samples, &sample, portMAX_DELAY))
+            flashLogWrite(&sample);
+    }
+}
+
+// Mounts the log without subscribing to the bus; records are then written
+// with flashLogWrite(). Without the partition the log still works, but
+// only keeps the last FLASH_LOG_RAM_RECORDS readings in RAM.
+static void flashLogOpen(void)
+{
+    if (flash_log.lock != NULL)
+        return;
+
+    flash_log.lock = xSemaphoreCreateMutex();
+    flash_log.boot = flashLogNextBoot();
+    flash_log.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, FLASH_LOG_SUBTYPE, FLASH_LOG_PARTITION);
+    if (flash_log.partition != NULL)
+    {
+        flash_log.sector_count = flash_log.partition->size / FLASH_LOG_SECTOR_SIZE;
+        flashLogRecover();
+    }
+    else
+    {
+        ESP_LOGW("Flash log", "No %s partition, readings are kept in RAM only", FLASH_LOG_PARTITION);
+    }
+}
+
+static void flashLogInit(void)
+{
+    if (flash_log.samples != NULL)
+        return;
+
+    flashLogOpen();
+    // Drop-newest: what is already staged is older and must reach flash first.
+    flash_log.samples = sampleBusSubscribe("log", 8, SAMPLE_DROP_NEWEST);
+    xTaskCreate(flashLogTask, "flashLog", 3072, NULL, 5, NULL);
+}
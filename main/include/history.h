@@ -0,0 +1,175 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-capacity history of timestamped samples kept as separate arrays so
+// range scans only touch the timestamps. There is a single writer (the
+// sampling path); readers never lock. A reader copies a slot and then
+// re-checks the head: if the writer may have reused the slot meanwhile, the
+// copy is discarded.
+
+#ifndef HISTORY_DEPTH
+#define HISTORY_DEPTH 2048
+#endif
+
+_Static_assert((HISTORY_DEPTH & (HISTORY_DEPTH - 1)) == 0, "HISTORY_DEPTH must be a power of two");
+
+#define HISTORY_MASK (HISTORY_DEPTH - 1)
+
+typedef struct
+{
+    uint32_t timestamp;  // seconds since boot
+    int16_t temperature; // 0.01 degC
+    uint16_t humidity;   // 0.01 %RH
+} HistorySample;
+
+typedef struct
+{
+    uint32_t count;
+    int16_t temperature_min;
+    int16_t temperature_max;
+    int32_t temperature_sum;
+    uint16_t humidity_min;
+    uint16_t humidity_max;
+    uint32_t humidity_sum;
+} HistoryBucket;
+
+static struct
+{
+    uint32_t timestamps[HISTORY_DEPTH];
+    int16_t temperatures[HISTORY_DEPTH];
+    uint16_t humidities[HISTORY_DEPTH];
+    uint32_t head; // total number of samples ever written
+} history;
+
+static void historyAppend(uint32_t timestamp, int16_t temperature, uint16_t humidity)
+{
+    uint32_t head = __atomic_load_n(&history.head, __ATOMIC_RELAXED);
+    uint32_t slot = head & HISTORY_MASK;
+
+    history.timestamps[slot] = timestamp;
+    history.temperatures[slot] = temperature;
+    history.humidities[slot] = humidity;
+
+    __atomic_store_n(&history.head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t historyHead(void)
+{
+    return __atomic_load_n(&history.head, __ATOMIC_ACQUIRE);
+}
+
+// Oldest sequence number that is safe to read for the given head. The slot
+// after the head may be in the middle of being overwritten.
+static uint32_t historyTail(uint32_t head)
+{
+    return head > HISTORY_DEPTH - 1 ? head - (HISTORY_DEPTH - 1) : 0;
+}
+
+static bool historyStillValid(uint32_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return sequence >= historyTail(__atomic_load_n(&history.head, __ATOMIC_RELAXED));
+}
+
+static bool historyRead(uint32_t sequence, HistorySample *sample)
+{
+    uint32_t head = historyHead();
+    if (sequence >= head || sequence < historyTail(head))
+        return false;
+
+    uint32_t slot = sequence & HISTORY_MASK;
+    sample->timestamp = history.timestamps[slot];
+    sample->temperature = history.temperatures[slot];
+    sample->humidity = history.humidities[slot];
+
+    return historyStillValid(sequence);
+}
+
+// First sequence number in [tail, head) whose timestamp is >= from.
+// Timestamps are monotonic, so a binary search over the ring is enough.
+static uint32_t historyFind(uint32_t from, uint32_t head)
+{
+    uint32_t low = historyTail(head);
+    uint32_t high = head;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (history.timestamps[middle & HISTORY_MASK] < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // The writer may have moved past the search range meanwhile.
+    uint32_t tail = historyTail(historyHead());
+    return low < tail ? tail : low;
+}
+
+typedef bool (*HistoryVisitor)(const HistorySample *sample, void *arg);
+
+// Calls visitor for every sample with from <= timestamp < to, oldest first,
+// until it returns false. Returns the number of samples visited.
+static uint32_t historyQueryRange(uint32_t from, uint32_t to, HistoryVisitor visitor, void *arg)
+{
+    uint32_t head = historyHead();
+    uint32_t visited = 0;
+
+    for (uint32_t sequence = historyFind(from, head); sequence < head; sequence++)
+    {
+        HistorySample sample;
+        if (!historyRead(sequence, &sample))
+            continue;
+        if (sample.timestamp >= to)
+            break;
+
+        visited++;
+        if (!visitor(&sample, arg))
+            break;
+    }
+
+    return visited;
+}
+
+static bool historyAccumulate(const HistorySample *sample, void *arg)
+{
+    HistoryBucket *bucket = arg;
+    if (bucket->count == 0)
+    {
+        bucket->temperature_min = bucket->temperature_max = sample->temperature;
+        bucket->humidity_min = bucket->humidity_max = sample->humidity;
+    }
+
+    bucket->temperature_min = sample->temperature < bucket->temperature_min ? sample->temperature : bucket->temperature_min;
+    bucket->temperature_max = sample->temperature > bucket->temperature_max ? sample->temperature : bucket->temperature_max;
+    bucket->humidity_min = sample->humidity < bucket->humidity_min ? sample->humidity : bucket->humidity_min;
+    bucket->humidity_max = sample->humidity > bucket->humidity_max ? sample->humidity : bucket->humidity_max;
+    bucket->temperature_sum += sample->temperature;
+    bucket->humidity_sum += sample->humidity;
+    bucket->count++;
+    return true;
+}
+
+// Min/max/sum over [from, to). Averages are sum / count.
+static void historyAggregate(uint32_t from, uint32_t to, HistoryBucket *bucket)
+{
+    *bucket = (HistoryBucket){0};
+    historyQueryRange(from, to, historyAccumulate, bucket);
+}
+
+// Timestamp range currently held in the buffer; false if it is empty.
+static bool historySpan(uint32_t *oldest, uint32_t *newest)
+{
+    uint32_t head = historyHead();
+    HistorySample first, last;
+    if (head == 0 || !historyRead(head - 1, &last))
+        return false;
+
+    uint32_t sequence = historyTail(head);
+    while (!historyRead(sequence, &first))
+        sequence = historyTail(historyHead());
+
+    *oldest = first.timestamp;
+    *newest = last.timestamp;
+    return true;
+}
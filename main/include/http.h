@@ -14,13 +14,35 @@
 #if !CONFIG_IDF_TARGET_LINUX
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_system.h"
 #endif
 
-#include "esp_http_client.h"
+#include "esp_timer.h"
 
 #define MAX_HTTP_RECV_BUFFER 512
-#define MAX_HTTP_OUTPUT_BUFFER 2048
+// The AllThingsTalk state endpoint is documented for JSON, keep it the default.
+#define HTTP_PAYLOAD_FORMAT PAYLOAD_FORMAT_JSON
+
+// The uplink goes over TLS unless built with HTTP_UPLINK_TLS 0. To try it
+// against a local stand-in server, override HTTP_UPLINK_HOST/PORT and set
+// HTTP_UPLINK_CA_PEM to that server's self-signed certificate.
+#ifndef HTTP_UPLINK_TLS
+#define HTTP_UPLINK_TLS 1
+#endif
+#ifndef HTTP_UPLINK_HOST
+#define HTTP_UPLINK_HOST "api.allthingstalk.io"
+#endif
+#ifndef HTTP_UPLINK_PORT
+#define HTTP_UPLINK_PORT (HTTP_UPLINK_TLS ? 443 : 80)
+#endif
+#define HTTP_UPLINK_TIMEOUT_MS 10000
+#define HTTP_UPLINK_STATS_EVERY 6
+#define HTTP_UPLINK_PERIOD_MS 10000
+
+#if HTTP_UPLINK_TLS && !defined(HTTP_UPLINK_CA_PEM) && !CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#error "HTTPS uplink needs CONFIG_MBEDTLS_CERTIFICATE_BUNDLE or HTTP_UPLINK_CA_PEM"
+#endif
 
 #define DEVICE_ID "kcQvFok0S4rahYTnfezRTIx3"
 #define DEVICE_TOKEN "maker:4jrExtJr32uoVBrPrnJN7K23URhTkHStLJ8LFUMO"
@@ -30,105 +52,404 @@ extern int16_t temperature;
 
 static const char *TAG_HTTP = "HTTP_CLIENT";
 
-esp_err_t httpEventHandler(esp_http_client_event_t *evt)
+// A single connection is kept open between uploads (HTTP/1.1 keep-alive).
+// When it has to be re-established, the TLS session from the previous one
+// is offered to the server so the handshake can skip the certificate
+// exchange and key agreement. Whether the server took it up is only known
+// after the handshake, and the stats count what actually happened.
+static struct
+{
+    SampleSink *samples;
+    esp_tls_t *tls;
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    esp_tls_client_session_t *session;
+#endif
+    struct
+    {
+        uint32_t connects;
+        uint32_t resumption_offered;
+        uint32_t resumed;
+        int64_t handshake_us_full;
+        int64_t handshake_us_resumed;
+        int64_t last_handshake_us;
+        uint32_t requests;
+        uint32_t failures;
+    } stats;
+} uplink;
+
+static void httpDisconnect(void)
+{
+    if (uplink.tls == NULL)
+        return;
+
+    esp_tls_conn_destroy(uplink.tls);
+    uplink.tls = NULL;
+}
+
+static bool httpConnect(void)
+{
+    if (uplink.tls != NULL)
+        return true;
+
+    tls_keep_alive_cfg_t keep_alive = {
+        .keep_alive_enable = true,
+        .keep_alive_idle = 30,
+        .keep_alive_interval = 5,
+        .keep_alive_count = 3,
+    };
+    esp_tls_cfg_t config = {
+        .timeout_ms = HTTP_UPLINK_TIMEOUT_MS,
+        .keep_alive_cfg = &keep_alive,
+        .is_plain_tcp = !HTTP_UPLINK_TLS,
+#if defined(HTTP_UPLINK_CA_PEM)
+        .cacert_buf = (const unsigned char *)HTTP_UPLINK_CA_PEM,
+        .cacert_bytes = sizeof(HTTP_UPLINK_CA_PEM),
+#elif CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        .crt_bundle_attach = esp_crt_bundle_attach,
+#endif
+    };
+
+    bool offered = false;
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    config.client_session = uplink.session;
+    offered = uplink.session != NULL;
+#endif
+
+    uplink.tls = esp_tls_init();
+    if (uplink.tls == NULL)
+    {
+        ESP_LOGE(TAG_HTTP, "Failed to allocate TLS context");
+        return false;
+    }
+
+    int64_t started = esp_timer_get_time();
+    int rc = esp_tls_conn_new_sync(HTTP_UPLINK_HOST, strlen(HTTP_UPLINK_HOST), HTTP_UPLINK_PORT, &config, uplink.tls);
+    int64_t elapsed_us = esp_timer_get_time() - started;
+
+    if (rc != 1)
+    {
+        int mbedtls_err = 0;
+        esp_err_t err = esp_tls_get_and_clear_last_error(uplink.tls->error_handle, &mbedtls_err, NULL);
+        ESP_LOGE(TAG_HTTP, "Connecting to %s:%d failed after %lld ms (0x%x, mbedtls -0x%x)", HTTP_UPLINK_HOST,
+                 HTTP_UPLINK_PORT, (long long)(elapsed_us / 1000), err, -mbedtls_err);
+        httpDisconnect();
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        // The server may have rejected the session itself, start over.
+        if (uplink.session != NULL)
+            esp_tls_free_client_session(uplink.session);
+        uplink.session = NULL;
+#endif
+        return false;
+    }
+
+    bool resumed = false;
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    if (HTTP_UPLINK_TLS)
+    {
+        // An abbreviated TLS 1.2 handshake keeps the master secret of the
+        // session it resumed; a full one derives a new secret.
+        esp_tls_client_session_t *session = esp_tls_get_client_session(uplink.tls);
+        resumed = offered && session != NULL &&
+                  memcmp(session->saved_session.master, uplink.session->saved_session.master,
+                         sizeof(session->saved_session.master)) == 0;
+
+        if (uplink.session != NULL)
+            esp_tls_free_client_session(uplink.session);
+        uplink.session = session;
+    }
+#endif
+
+    uplink.stats.connects++;
+    uplink.stats.last_handshake_us = elapsed_us;
+    if (offered)
+        uplink.stats.resumption_offered++;
+    if (resumed)
+    {
+        uplink.stats.resumed++;
+        uplink.stats.handshake_us_resumed += elapsed_us;
+    }
+    else
+    {
+        uplink.stats.handshake_us_full += elapsed_us;
+    }
+
+    ESP_LOGI(TAG_HTTP, "Connected to %s:%d in %lld ms (%s)", HTTP_UPLINK_HOST, HTTP_UPLINK_PORT,
+             (long long)(elapsed_us / 1000),
+             !HTTP_UPLINK_TLS ? "plain TCP"
+             : resumed        ? "session resumed"
+             : offered        ? "full handshake, session refused"
+                              : "full handshake");
+    return true;
+}
+
+static bool httpWriteAll(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = esp_tls_conn_write(uplink.tls, data, length);
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+// Applies one lower-cased header line to what the response loop tracks.
+static void httpParseHeader(char *line, long *content_length, bool *close)
 {
-    static char *output_buffer; // Buffer to store response of http request from event handler
-    static int output_len;      // Stores number of bytes read
-    switch (evt->event_id)
+    for (char *c = line; *c != '\0'; c++)
+        *c = tolower((unsigned char)*c);
+
+    if (strncmp(line, "content-length:", 15) == 0)
+        *content_length = strtol(line + 15, NULL, 10);
+    else if (strncmp(line, "connection:", 11) == 0 && strstr(line + 11, "close") != NULL)
+        *close = true;
+}
+
+// Reads the response head and discards the body. Returns the status code,
+// or -1 if the connection failed. *reusable is cleared when the server
+// closes the connection or does not say how long the body is; *stale is
+// set when it failed before a byte of the response arrived, i.e. the
+// request may not have been seen.
+//
+// The head is parsed a line at a time as it arrives, so its size is not
+// limited by the buffer. Only the status line has to fit; longer header
+// lines (large cookies, say) are skipped, none of the ones used here are.
+static int httpReadResponse(bool *reusable, bool *stale)
+{
+    char buffer[MAX_HTTP_RECV_BUFFER];
+    size_t length = 0;
+    bool skipping = false;
+    int status = -1;
+    long content_length = -1;
+    bool close = false;
+
+    *stale = true;
+    buffer[0] = '\0';
+    while (1)
     {
-    case HTTP_EVENT_ERROR:
-        ESP_LOGD(TAG_HTTP, "HTTP_EVENT_ERROR");
-        break;
-    case HTTP_EVENT_ON_CONNECTED:
-        ESP_LOGD(TAG_HTTP, "HTTP_EVENT_ON_CONNECTED");
-        break;
-    case HTTP_EVENT_HEADER_SENT:
-        ESP_LOGD(TAG_HTTP, "HTTP_EVENT_HEADER_SENT");
-        break;
-    case HTTP_EVENT_ON_HEADER:
-        ESP_LOGD(TAG_HTTP, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        break;
-    case HTTP_EVENT_ON_FINISH:
-        ESP_LOGD(TAG_HTTP, "HTTP_EVENT_ON_FINISH");
-        if (output_buffer != NULL)
+        char *line_end = strstr(buffer, "\r\n");
+        if (line_end == NULL)
         {
-            // Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-            // ESP_LOG_BUFFER_HEX(TAG_HTTP, output_buffer, output_len);
-            free(output_buffer);
-            output_buffer = NULL;
+            if (length == sizeof(buffer) - 1)
+            {
+                if (status < 0)
+                    return -1;
+                // Keeps the last byte, it may be the CR of the line end.
+                skipping = true;
+                buffer[0] = buffer[length - 1];
+                buffer[1] = '\0';
+                length = 1;
+            }
+
+            ssize_t received = esp_tls_conn_read(uplink.tls, buffer + length, sizeof(buffer) - 1 - length);
+            if (received <= 0)
+                return -1;
+            *stale = false;
+            length += received;
+            buffer[length] = '\0';
+            continue;
         }
-        output_len = 0;
-        break;
-    case HTTP_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG_HTTP, "HTTP_EVENT_DISCONNECTED");
-        int mbedtls_err = 0;
-        esp_err_t err = esp_tls_get_and_clear_last_error((esp_tls_error_handle_t)evt->data, &mbedtls_err, NULL);
-        if (err != 0)
+
+        *line_end = '\0';
+        bool head_done = false;
+        if (skipping)
+        {
+            skipping = false;
+        }
+        else if (status < 0)
         {
-            ESP_LOGI(TAG_HTTP, "Last esp error code: 0x%x", err);
-            ESP_LOGI(TAG_HTTP, "Last mbedtls failure: 0x%x", mbedtls_err);
+            if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1)
+                return -1;
         }
-        if (output_buffer != NULL)
+        else if (buffer[0] == '\0')
         {
-            free(output_buffer);
-            output_buffer = NULL;
+            head_done = true;
         }
-        output_len = 0;
-        break;
-    default:
-        break;
+        else
+        {
+            httpParseHeader(buffer, &content_length, &close);
+        }
+
+        size_t consumed = line_end + 2 - buffer;
+        length -= consumed;
+        memmove(buffer, line_end + 2, length + 1);
+        if (head_done)
+            break;
     }
-    return ESP_OK;
+
+    *reusable = content_length >= 0 && !close;
+    if (!*reusable)
+        return status;
+
+    long remaining = content_length - (long)length;
+    while (remaining > 0)
+    {
+        ssize_t received = esp_tls_conn_read(uplink.tls, buffer, MIN(remaining, (long)sizeof(buffer)));
+        if (received <= 0)
+            return -1;
+        remaining -= received;
+    }
+
+    return status;
 }
 
-static void httpPutValue(const char *asset, float value)
+// Body for the device-level state endpoint: {"<asset>": {"value": v}, ...}.
+static int httpFormatState(char *body, size_t size, const Aht20Sample *sample)
 {
-    char local_response_buffer[MAX_HTTP_OUTPUT_BUFFER] = {0};
-
-    char path_string[64];
-    sprintf(path_string, "/device/" DEVICE_ID "/asset/%s/state", asset);
+    float temperature_value = sample->temperature / 100.f;
+    float humidity_value = sample->humidity / 100.f;
 
-    esp_http_client_config_t config = {
-        .host = "api.allthingstalk.io",
-        .path = path_string,
-        .event_handler = httpEventHandler,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-
-    esp_http_client_set_method(client, HTTP_METHOD_PUT);
-    esp_http_client_set_header(client, "Authorization", "Bearer " DEVICE_TOKEN);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
-
-    char value_string[16];
-    sprintf(value_string, "%f", value);
-    char post_data[64];
-    sprintf(post_data, "{\"value\": %s}", value_string);
-    esp_err_t err = esp_http_client_open(client, strlen(post_data));
-    if (err != ESP_OK)
+    if (HTTP_PAYLOAD_FORMAT == PAYLOAD_FORMAT_CBOR)
     {
-        ESP_LOGE(TAG_HTTP, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        CborWriter writer;
+        cborInit(&writer, (uint8_t *)body, size);
+        cborWriteMap(&writer, 2);
+        cborWriteText(&writer, "temperature");
+        cborWriteMap(&writer, 1);
+        cborWriteText(&writer, "value");
+        cborWriteFloat(&writer, temperature_value);
+        cborWriteText(&writer, "humidity");
+        cborWriteMap(&writer, 1);
+        cborWriteText(&writer, "value");
+        cborWriteFloat(&writer, humidity_value);
+        return cborFinish(&writer);
     }
+
+    int length = snprintf(body, size, "{\"temperature\": {\"value\": %f}, \"humidity\": {\"value\": %f}}",
+                          temperature_value, humidity_value);
+    return length < (int)size ? length : -1;
+}
+
+static int httpSendState(const char *body, int length, bool *reusable, bool *stale)
+{
+    char head[256];
+    int head_length = snprintf(head, sizeof(head),
+                               "PUT /device/" DEVICE_ID "/state HTTP/1.1\r\n"
+                               "Host: " HTTP_UPLINK_HOST "\r\n"
+                               "Authorization: Bearer " DEVICE_TOKEN "\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Length: %d\r\n"
+                               "\r\n",
+                               HTTP_PAYLOAD_FORMAT == PAYLOAD_FORMAT_CBOR ? "application/cbor" : "application/json",
+                               length);
+
+    *stale = true;
+    if (!httpWriteAll(head, head_length) || !httpWriteAll(body, length))
+        return -1;
+
+    return httpReadResponse(reusable, stale);
+}
+
+static Metric http_put_latency = METRIC_HISTOGRAM_INIT("http_uplink_put_seconds", "State upload time, including connecting.");
+static Metric http_put_2xx = METRIC_LABELED_INIT("http_uplink_put_total", "State uploads by response status.", "status=\"2xx\"", METRIC_COUNTER);
+static Metric http_put_4xx = METRIC_LABELED_INIT("http_uplink_put_total", "State uploads by response status.", "status=\"4xx\"", METRIC_COUNTER);
+static Metric http_put_5xx = METRIC_LABELED_INIT("http_uplink_put_total", "State uploads by response status.", "status=\"5xx\"", METRIC_COUNTER);
+static Metric http_put_other = METRIC_LABELED_INIT("http_uplink_put_total", "State uploads by response status.", "status=\"other\"", METRIC_COUNTER);
+static Metric http_put_error = METRIC_LABELED_INIT("http_uplink_put_total", "State uploads by response status.", "status=\"error\"", METRIC_COUNTER);
+
+static void countPutStatus(int status)
+{
+    if (status < 0)
+        metricInc(&http_put_error);
+    else if (status >= 200 && status < 300)
+        metricInc(&http_put_2xx);
+    else if (status >= 400 && status < 500)
+        metricInc(&http_put_4xx);
+    else if (status >= 500 && status < 600)
+        metricInc(&http_put_5xx);
     else
+        metricInc(&http_put_other);
+}
+
+static void httpPutState(const Aht20Sample *sample)
+{
+    char body[96];
+    int length = httpFormatState(body, sizeof(body), sample);
+    if (length < 0)
     {
-        int wlen = esp_http_client_write(client, post_data, strlen(post_data));
+        ESP_LOGE(TAG_HTTP, "State payload does not fit");
+        return;
     }
 
-    err = esp_http_client_perform(client);
-    if (err == ESP_OK)
+    int64_t started = esp_timer_get_time();
+    uplink.stats.requests++;
+
+    // A kept-alive connection may have been closed by the server while idle,
+    // so a reused connection that fails before any response arrives is
+    // retried once on a fresh one. Once the server answered, the request is
+    // not sent again.
+    int status = -1;
+    for (int attempt = 0; attempt < 2 && status < 0; attempt++)
     {
-        ESP_LOGI(TAG_HTTP, "HTTP PUT Status = %d", esp_http_client_get_status_code(client));
+        bool reused = uplink.tls != NULL;
+        if (!httpConnect())
+            break;
+
+        bool reusable = false;
+        bool stale = false;
+        status = httpSendState(body, length, &reusable, &stale);
+        if (status < 0 || !reusable)
+            httpDisconnect();
+        if (!reused || !stale)
+            break;
     }
-    else
+
+    int64_t elapsed_us = esp_timer_get_time() - started;
+    metricObserveUs(&http_put_latency, elapsed_us);
+    countPutStatus(status);
+    if (status < 0)
     {
-        ESP_LOGE(TAG_HTTP, "HTTP PUT request failed: %s", esp_err_to_name(err));
+        uplink.stats.failures++;
+        ESP_LOGE(TAG_HTTP, "HTTP PUT request failed after %lld ms", (long long)(elapsed_us / 1000));
+        return;
     }
 
-    esp_http_client_cleanup(client);
+    ESP_LOGI(TAG_HTTP, "HTTP PUT Status = %d, %lld ms", status, (long long)(elapsed_us / 1000));
 }
 
-void httpPutSensorValues()
+static void logUplinkStats(void)
 {
-    getValuesFromSensor();
-    httpPutValue("temperature", temperature / 100.f);
-    httpPutValue("humidity", humidity / 100.f);
-}
\ No newline at end of file
+    uint32_t full = uplink.stats.connects - uplink.stats.resumed;
+    uint32_t resumed = uplink.stats.resumed;
+
+    ESP_LOGI(TAG_HTTP, "requests=%u failures=%u connects=%u handshake avg: full=%lld ms (%u) resumed=%lld ms (%u of %u offered)",
+             uplink.stats.requests, uplink.stats.failures, uplink.stats.connects,
+             full ? (long long)(uplink.stats.handshake_us_full / full / 1000) : 0LL, full,
+             resumed ? (long long)(uplink.stats.handshake_us_resumed / resumed / 1000) : 0LL, resumed,
+             uplink.stats.resumption_offered);
+}
+
+// Uploads run in their own task: a TLS handshake needs far more stack than
+// the sensor task has, and a slow server must not hold up sampling. The
+// sink keeps only the newest reading, so after a slow upload the next one
+// sends current data rather than a backlog.
+static void httpUplinkTask(void *arg)
+{
+    TickType_t last_upload = xTaskGetTickCount();
+    Aht20Sample sample;
+    while (true)
+    {
+        if (!sampleSinkReceive(uplink.samples, &sample, portMAX_DELAY))
+            continue;
+
+        httpPutState(&sample);
+        if (uplink.stats.requests % HTTP_UPLINK_STATS_EVERY == 0)
+            logUplinkStats();
+
+        vTaskDelayUntil(&last_upload, pdMS_TO_TICKS(HTTP_UPLINK_PERIOD_MS));
+    }
+}
+
+// Called once the network is up; later calls do nothing.
+static void httpUplinkStart(void)
+{
+    if (uplink.samples != NULL)
+        return;
+
+    uplink.samples = sampleBusSubscribe("http", 1, SAMPLE_DROP_OLDEST);
+    if (uplink.samples != NULL)
+        xTaskCreate(httpUplinkTask, "httpUplink", 8192, NULL, 4, NULL);
+}
@@ -0,0 +1,238 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_http_server.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+// Live updates for the web UI over WebSocket (CONFIG_HTTPD_WS_SUPPORT).
+// Every new sample and every LED change is formatted once as a short JSON
+// text message and copied into a bounded queue per client. One task sends
+// the queues out, so a slow client only delays the others, and when its
+// queue is full it loses its own oldest messages. LED changes only leave a
+// flag for that task, so the actuator task never waits for the lock.
+
+#define LIVE_STREAM_MAX_CLIENTS 4
+#define LIVE_STREAM_QUEUE_DEPTH 8
+#define LIVE_STREAM_MESSAGE_MAX 96
+#define LIVE_STREAM_POLL_MS 100
+#define LIVE_STREAM_TASK_PRIORITY 4
+
+typedef struct
+{
+    bool used;
+    int fd;
+    uint32_t session; // new for each handshake, tells reuses of fd apart
+    uint8_t first;
+    uint8_t count;
+    uint32_t dropped;
+    uint8_t lengths[LIVE_STREAM_QUEUE_DEPTH];
+    char messages[LIVE_STREAM_QUEUE_DEPTH][LIVE_STREAM_MESSAGE_MAX];
+} LiveClient;
+
+static struct
+{
+    httpd_handle_t server;
+    SampleSink *samples;
+    SemaphoreHandle_t lock;
+    uint32_t sessions;
+    uint8_t led_pending; // 0, or 1 + the newest LED state not yet queued
+    LiveClient clients[LIVE_STREAM_MAX_CLIENTS];
+} live;
+
+// Returns false when every slot is taken.
+static bool liveStreamAdd(int fd)
+{
+    xSemaphoreTake(live.lock, portMAX_DELAY);
+    LiveClient *slot = NULL;
+    for (size_t i = 0; i < LIVE_STREAM_MAX_CLIENTS && slot == NULL; i++)
+    {
+        if (!live.clients[i].used)
+            slot = &live.clients[i];
+    }
+
+    if (slot != NULL)
+        *slot = (LiveClient){.used = true, .fd = fd, .session = ++live.sessions};
+    xSemaphoreGive(live.lock);
+
+    if (slot == NULL)
+        ESP_LOGW("Live", "No slot for client %d", fd);
+    return slot != NULL;
+}
+
+static void liveStreamRemove(int fd)
+{
+    if (live.lock == NULL)
+        return;
+
+    xSemaphoreTake(live.lock, portMAX_DELAY);
+    for (size_t i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+    {
+        if (live.clients[i].used && live.clients[i].fd == fd)
+            live.clients[i].used = false;
+    }
+    xSemaphoreGive(live.lock);
+}
+
+// Fan-out: the message is copied into every client's queue.
+static void liveStreamBroadcast(const char *message, size_t length)
+{
+    if (live.lock == NULL || length > LIVE_STREAM_MESSAGE_MAX)
+        return;
+
+    xSemaphoreTake(live.lock, portMAX_DELAY);
+    for (size_t i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+    {
+        LiveClient *client = &live.clients[i];
+        if (!client->used)
+            continue;
+
+        if (client->count == LIVE_STREAM_QUEUE_DEPTH)
+        {
+            client->first = (client->first + 1) % LIVE_STREAM_QUEUE_DEPTH;
+            client->count--;
+            client->dropped++;
+        }
+
+        size_t slot = (client->first + client->count++) % LIVE_STREAM_QUEUE_DEPTH;
+        memcpy(client->messages[slot], message, length);
+        client->lengths[slot] = length;
+    }
+    xSemaphoreGive(live.lock);
+}
+
+static void liveStreamSample(const Aht20Sample *sample)
+{
+    char message[LIVE_STREAM_MESSAGE_MAX];
+    int length = snprintf(message, sizeof(message),
+                          "{\"type\":\"sample\",\"t\":%u,\"temperature\":\"%s%d.%02d\",\"humidity\":\"%u.%02u\"}",
+                          (unsigned)sample->timestamp, sample->temperature < 0 ? "-" : "",
+                          abs(sample->temperature) / 100, abs(sample->temperature) % 100,
+                          sample->humidity / 100, sample->humidity % 100);
+    if (length > 0 && length < (int)sizeof(message))
+        liveStreamBroadcast(message, length);
+}
+
+// Safe from any task, never blocks. The stream task sends the state within
+// LIVE_STREAM_POLL_MS; changes faster than that send only the newest one.
+static void liveStreamLed(bool on)
+{
+    __atomic_store_n(&live.led_pending, 1 + on, __ATOMIC_RELEASE);
+}
+
+static void liveStreamSendLed(void)
+{
+    uint8_t pending = __atomic_exchange_n(&live.led_pending, 0, __ATOMIC_ACQUIRE);
+    if (pending == 0)
+        return;
+
+    char message[LIVE_STREAM_MESSAGE_MAX];
+    int length = snprintf(message, sizeof(message), "{\"type\":\"led\",\"on\":%s}", pending == 2 ? "true" : "false");
+    liveStreamBroadcast(message, length);
+}
+
+// Sends everything queued. The message is taken off the queue under the
+// lock and sent without it, so broadcasting never waits on a socket.
+static void liveStreamFlush(void)
+{
+    for (size_t i = 0; i < LIVE_STREAM_MAX_CLIENTS; i++)
+    {
+        while (1)
+        {
+            char message[LIVE_STREAM_MESSAGE_MAX];
+            size_t length = 0;
+            int fd = -1;
+            uint32_t session = 0;
+
+            xSemaphoreTake(live.lock, portMAX_DELAY);
+            LiveClient *client = &live.clients[i];
+            if (client->used && client->count > 0)
+            {
+                fd = client->fd;
+                session = client->session;
+                length = client->lengths[client->first];
+                memcpy(message, client->messages[client->first], length);
+                client->first = (client->first + 1) % LIVE_STREAM_QUEUE_DEPTH;
+                client->count--;
+            }
+            xSemaphoreGive(live.lock);
+
+            if (fd < 0)
+                break;
+
+            httpd_ws_frame_t frame = {
+                .final = true,
+                .type = HTTPD_WS_TYPE_TEXT,
+                .payload = (uint8_t *)message,
+                .len = length,
+            };
+            if (httpd_ws_get_fd_info(live.server, fd) != HTTPD_WS_CLIENT_WEBSOCKET ||
+                httpd_ws_send_frame_async(live.server, fd, &frame) != ESP_OK)
+            {
+                // The session may have closed during the send and its
+                // descriptor gone to a new connection, which must stay.
+                xSemaphoreTake(live.lock, portMAX_DELAY);
+                if (client->used && client->fd == fd && client->session == session)
+                {
+                    ESP_LOGI("Live", "Client %d gone", fd);
+                    client->used = false;
+                    httpd_sess_trigger_close(live.server, fd);
+                }
+                xSemaphoreGive(live.lock);
+                break;
+            }
+        }
+    }
+}
+
+static void liveStreamTask(void *param)
+{
+    while (1)
+    {
+        Aht20Sample sample;
+        if (sampleSinkReceive(live.samples, &sample, pdMS_TO_TICKS(LIVE_STREAM_POLL_MS)))
+            liveStreamSample(&sample);
+
+        liveStreamSendLed();
+        liveStreamFlush();
+    }
+}
+
+// WebSocket handler. The GET is the handshake and subscribes the client,
+// or closes the session when all slots are taken. Updates only flow to the
+// client, so incoming data frames are discarded.
+static esp_err_t liveStreamHandler(httpd_req_t *request)
+{
+    if (request->method == HTTP_GET)
+        return liveStreamAdd(httpd_req_to_sockfd(request)) ? ESP_OK : ESP_FAIL;
+
+    uint8_t buffer[LIVE_STREAM_MESSAGE_MAX];
+    httpd_ws_frame_t frame = {.payload = buffer};
+    esp_err_t err = httpd_ws_recv_frame(request, &frame, 0);
+    if (err != ESP_OK || frame.len > sizeof(buffer))
+        return err != ESP_OK ? err : ESP_ERR_INVALID_SIZE;
+
+    return httpd_ws_recv_frame(request, &frame, sizeof(buffer));
+}
+
+// Call from httpd_config_t.close_fn.
+static void liveStreamOnClose(int fd)
+{
+    liveStreamRemove(fd);
+}
+
+static void liveStreamStart(httpd_handle_t server)
+{
+    if (live.lock != NULL)
+        return;
+
+    live.server = server;
+    live.lock = xSemaphoreCreateMutex();
+    live.samples = sampleBusSubscribe("live", 1, SAMPLE_DROP_OLDEST);
+    xTaskCreate(liveStreamTask, "liveStream", 3072, NULL, LIVE_STREAM_TASK_PRIORITY, NULL);
+}
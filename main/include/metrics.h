@@ -0,0 +1,226 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_system.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Metrics registry with Prometheus text export. Metrics are static
+// variables owned by the module that updates them and join the registry
+// on their first update. Updates are single atomic operations, so they are
+// safe from any task without a lock; histogram sums are 64-bit, which the
+// toolchain's atomics emulate.
+//
+// Metrics sharing a name form one family and differ in their labels.
+
+#define METRICS_LINE_MAX 128
+#define METRICS_LATENCY_BUCKETS 10
+#define METRICS_SPARE_TASKS 2 // tasks created between counting and the snapshot
+
+typedef enum
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct Metric
+{
+    const char *name;
+    const char *help;
+    const char *labels; // e.g. "class=\"2xx\"", or NULL
+    MetricType type;
+
+    int32_t value; // counter or gauge
+    uint32_t buckets[METRICS_LATENCY_BUCKETS + 1]; // per bucket, last is +Inf
+    uint32_t count;
+    uint64_t sum_us;
+
+    bool registered;
+    struct Metric *next;
+} Metric;
+
+// Histogram upper bounds, shared by all latency metrics.
+static const uint32_t metrics_latency_us[METRICS_LATENCY_BUCKETS] = {
+    100, 250, 1000, 2500, 10000, 25000, 100000, 250000, 1000000, 2500000};
+
+#define METRIC_COUNTER_INIT(name, help) {name, help, NULL, METRIC_COUNTER}
+#define METRIC_GAUGE_INIT(name, help) {name, help, NULL, METRIC_GAUGE}
+#define METRIC_HISTOGRAM_INIT(name, help) {name, help, NULL, METRIC_HISTOGRAM}
+#define METRIC_LABELED_INIT(name, help, labels, type) {name, help, labels, type}
+
+static Metric *metrics_head;
+
+static void metricRegister(Metric *metric)
+{
+    if (__atomic_exchange_n(&metric->registered, true, __ATOMIC_ACQ_REL))
+        return;
+
+    Metric *head = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE);
+    do
+        metric->next = head;
+    while (!__atomic_compare_exchange_n(&metrics_head, &head, metric, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+static inline void metricTouch(Metric *metric)
+{
+    if (!__atomic_load_n(&metric->registered, __ATOMIC_RELAXED))
+        metricRegister(metric);
+}
+
+static void metricAdd(Metric *metric, int32_t delta)
+{
+    metricTouch(metric);
+    __atomic_fetch_add(&metric->value, delta, __ATOMIC_RELAXED);
+}
+
+static void metricInc(Metric *metric)
+{
+    metricAdd(metric, 1);
+}
+
+static void metricObserveUs(Metric *metric, int64_t elapsed_us)
+{
+    uint64_t us = elapsed_us > 0 ? (uint64_t)elapsed_us : 0;
+    size_t bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS && us > metrics_latency_us[bucket])
+        bucket++;
+
+    metricTouch(metric);
+    __atomic_fetch_add(&metric->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metric->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metric->sum_us, us, __ATOMIC_RELAXED);
+}
+
+// Export. Every line is handed to write() on its own, shorter than
+// METRICS_LINE_MAX.
+
+typedef void (*MetricsWriter)(void *arg, const char *line);
+
+static const char *metricTypeName(MetricType type)
+{
+    switch (type)
+    {
+    case METRIC_COUNTER:
+        return "counter";
+    case METRIC_GAUGE:
+        return "gauge";
+    default:
+        return "histogram";
+    }
+}
+
+// Formats "<name><suffix>{<labels>,<extra>} " into line.
+static int metricFormatSeries(char *line, const Metric *metric, const char *suffix, const char *extra)
+{
+    bool labels = metric->labels != NULL;
+    bool braces = labels || extra != NULL;
+    return snprintf(line, METRICS_LINE_MAX, "%s%s%s%s%s%s%s ", metric->name, suffix,
+                    braces ? "{" : "", labels ? metric->labels : "",
+                    labels && extra != NULL ? "," : "", extra != NULL ? extra : "",
+                    braces ? "}" : "");
+}
+
+static void metricWrite(const Metric *metric, MetricsWriter write, void *arg)
+{
+    char line[METRICS_LINE_MAX];
+    if (metric->type != METRIC_HISTOGRAM)
+    {
+        int length = metricFormatSeries(line, metric, "", NULL);
+        snprintf(line + length, sizeof(line) - length, "%d\n", (int)__atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+        write(arg, line);
+        return;
+    }
+
+    uint32_t cumulative = 0;
+    char le[24];
+    for (size_t i = 0; i <= METRICS_LATENCY_BUCKETS; i++)
+    {
+        cumulative += __atomic_load_n(&metric->buckets[i], __ATOMIC_RELAXED);
+        if (i < METRICS_LATENCY_BUCKETS)
+            snprintf(le, sizeof(le), "le=\"%u.%06u\"", (unsigned)(metrics_latency_us[i] / 1000000),
+                     (unsigned)(metrics_latency_us[i] % 1000000));
+        else
+            snprintf(le, sizeof(le), "le=\"+Inf\"");
+
+        int length = metricFormatSeries(line, metric, "_bucket", le);
+        snprintf(line + length, sizeof(line) - length, "%u\n", (unsigned)cumulative);
+        write(arg, line);
+    }
+
+    uint64_t sum_us = __atomic_load_n(&metric->sum_us, __ATOMIC_RELAXED);
+    int length = metricFormatSeries(line, metric, "_sum", NULL);
+    snprintf(line + length, sizeof(line) - length, "%llu.%06u\n", (unsigned long long)(sum_us / 1000000), (unsigned)(sum_us % 1000000));
+    write(arg, line);
+
+    length = metricFormatSeries(line, metric, "_count", NULL);
+    snprintf(line + length, sizeof(line) - length, "%u\n", (unsigned)__atomic_load_n(&metric->count, __ATOMIC_RELAXED));
+    write(arg, line);
+}
+
+static void metricsWriteHeader(const char *name, const char *help, const char *type, MetricsWriter write, void *arg)
+{
+    char line[METRICS_LINE_MAX];
+    snprintf(line, sizeof(line), "# HELP %s %s\n", name, help);
+    write(arg, line);
+    snprintf(line, sizeof(line), "# TYPE %s %s\n", name, type);
+    write(arg, line);
+}
+
+// Heap and stack figures are read at export time rather than tracked.
+static void metricsWriteSystem(MetricsWriter write, void *arg)
+{
+    char line[METRICS_LINE_MAX];
+    metricsWriteHeader("heap_free_bytes", "Free heap.", "gauge", write, arg);
+    snprintf(line, sizeof(line), "heap_free_bytes %u\n", (unsigned)esp_get_free_heap_size());
+    write(arg, line);
+
+    metricsWriteHeader("heap_min_free_bytes", "Lowest free heap since boot.", "gauge", write, arg);
+    snprintf(line, sizeof(line), "heap_min_free_bytes %u\n", (unsigned)esp_get_minimum_free_heap_size());
+    write(arg, line);
+
+#if configUSE_TRACE_FACILITY
+    // uxTaskGetSystemState() returns nothing if the array is too small.
+    UBaseType_t size = uxTaskGetNumberOfTasks() + METRICS_SPARE_TASKS;
+    TaskStatus_t *tasks = calloc(size, sizeof(TaskStatus_t));
+    if (tasks == NULL)
+        return;
+
+    UBaseType_t count = uxTaskGetSystemState(tasks, size, NULL);
+    metricsWriteHeader("task_stack_free_bytes", "Lowest free stack of each task.", "gauge", write, arg);
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        snprintf(line, sizeof(line), "task_stack_free_bytes{task=\"%s\"} %u\n", tasks[i].pcTaskName,
+                 (unsigned)tasks[i].usStackHighWaterMark);
+        write(arg, line);
+    }
+    free(tasks);
+#endif
+}
+
+static void metricsExport(MetricsWriter write, void *arg)
+{
+    const Metric *head = __atomic_load_n(&metrics_head, __ATOMIC_ACQUIRE);
+    for (const Metric *metric = head; metric != NULL; metric = metric->next)
+    {
+        // A family is written once, at its first member in the list.
+        const Metric *first = head;
+        while (strcmp(first->name, metric->name) != 0)
+            first = first->next;
+        if (first != metric)
+            continue;
+
+        metricsWriteHeader(metric->name, metric->help, metricTypeName(metric->type), write, arg);
+        for (const Metric *member = metric; member != NULL; member = member->next)
+        {
+            if (strcmp(member->name, metric->name) == 0)
+                metricWrite(member, write, arg);
+        }
+    }
+
+    metricsWriteSystem(write, arg);
+}
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include "esp_system.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
@@ -11,20 +13,112 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
 #include "lwip/netdb.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
 
+#include "cbor.h"
+
 extern uint16_t humidity;
 extern int16_t temperature;
 
+#define MQTT_BATCH_SIZE 6
+#define MQTT_REPLAY_BATCH_SIZE 24
+#define MQTT_MAX_INFLIGHT 4
+#define MQTT_STATS_PERIOD_MS 60000
+#define MQTT_POLL_MS 1000
+#define MQTT_PAYLOAD_MAX 512
+// JSON keeps the per-quantity topics, but each message is now a batch
+// object instead of one bare value; subscribers must parse the new format.
+// CBOR is opt-in.
+#ifndef MQTT_PAYLOAD_FORMAT
+#define MQTT_PAYLOAD_FORMAT PAYLOAD_FORMAT_JSON
+#endif
+
 static const char *TAG_MQTT =           "MQTT";
-static const char *TOPIC_HUMIDITY =     "/destiny/sensor/humidity";
-static const char *TOPIC_TEMPERATURE =  "/destiny/sensor/temperature";
+
+typedef struct
+{
+    const char *topic;
+    int qos;
+} MqttTopic;
+
+// Temperature is the primary reading and must not be lost, humidity is
+// best effort.
+static const MqttTopic kTopicHumidity =     {"/destiny/sensor/humidity", 0};
+static const MqttTopic kTopicTemperature =  {"/destiny/sensor/temperature", 1};
+// CBOR batches carry both values in one record per sample.
+static const MqttTopic kTopicSamples =      {"/destiny/sensor/samples", 1};
+
+typedef struct
+{
+    uint32_t timestamp; // seconds since boot
+    int16_t temperature;
+    uint16_t humidity;
+} TelemetrySample;
+
+// A published batch waiting for its PUBACK; end is the record after it.
+typedef struct
+{
+    int msg_id;
+    uint32_t end;
+    bool acked;
+    int64_t sent_us;
+} TelemetryInflight;
+
+// A JSON batch goes out as one message per topic. If the client refuses
+// one of them after others went out, the batch is retried from the first
+// topic not yet published, over the same records, instead of sending the
+// others twice.
+typedef struct
+{
+    uint32_t session;
+    uint32_t start;
+    uint32_t end;
+    size_t topics_sent; // 0 if no batch is partly published
+    int confirm_id;
+} TelemetryPartial;
+
+// Telemetry is published from the flash log rather than from a queue of
+// its own, so nothing is lost while the broker is unreachable. The cursor
+// only moves past records the broker acknowledged; after a reboot or a
+// lost connection publishing resumes from there.
+static struct
+{
+    esp_mqtt_client_handle_t client;
+    TaskHandle_t task;
+    SemaphoreHandle_t lock;
+    bool connected;
+    uint32_t session; // bumped on every disconnect
+
+    FlashLogCursor cursor;
+    uint32_t next;  // next record to publish
+    uint32_t acked; // everything below was acknowledged
+    TelemetryInflight inflight[MQTT_MAX_INFLIGHT];
+    size_t inflight_count;
+    int early_acks[MQTT_MAX_INFLIGHT]; // PUBACKs that came before their batch was recorded
+    size_t early_ack_next;
+    TelemetryPartial partial; // only used by the telemetry task
+
+    struct
+    {
+        uint32_t published;
+        uint32_t acked;
+        uint32_t failed;
+        uint32_t lost;
+    } stats;
+} telemetry;
+
+static Metric mqtt_published = METRIC_COUNTER_INIT("mqtt_published_total", "Telemetry messages handed to the MQTT client.");
+static Metric mqtt_publish_failed = METRIC_COUNTER_INIT("mqtt_publish_failed_total", "Telemetry messages the MQTT client refused.");
+static Metric mqtt_acked = METRIC_COUNTER_INIT("mqtt_acked_total", "Telemetry messages acknowledged by the broker.");
+static Metric mqtt_ack_latency = METRIC_HISTOGRAM_INIT("mqtt_ack_seconds", "Time from publish to broker acknowledgement.");
 
 static void logErrorIfNonZero(const char *message, int error_code)
 {
@@ -34,6 +128,52 @@ static void logErrorIfNonZero(const char *message, int error_code)
     }
 }
 
+// Called with the lock held.
+static bool takeEarlyAck(int msg_id)
+{
+    for (size_t i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    {
+        if (msg_id > 0 && telemetry.early_acks[i] == msg_id)
+        {
+            telemetry.early_acks[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Acknowledgements may arrive out of order; the acked position only moves
+// over a contiguous run of acknowledged batches. A PUBACK can also beat the
+// batch into the inflight list, e.g. the temperature message of a batch
+// whose humidity message is retried; it is kept until the batch arrives.
+static void ackTelemetry(int msg_id)
+{
+    xSemaphoreTake(telemetry.lock, portMAX_DELAY);
+    bool matched = msg_id == 0;
+    for (size_t i = 0; i < telemetry.inflight_count; i++)
+    {
+        if (telemetry.inflight[i].msg_id == msg_id && !telemetry.inflight[i].acked)
+        {
+            telemetry.inflight[i].acked = true;
+            matched = true;
+            metricObserveUs(&mqtt_ack_latency, esp_timer_get_time() - telemetry.inflight[i].sent_us);
+        }
+    }
+    if (!matched)
+    {
+        telemetry.early_acks[telemetry.early_ack_next] = msg_id;
+        telemetry.early_ack_next = (telemetry.early_ack_next + 1) % MQTT_MAX_INFLIGHT;
+    }
+
+    size_t done = 0;
+    while (done < telemetry.inflight_count && telemetry.inflight[done].acked)
+        telemetry.acked = telemetry.inflight[done++].end;
+
+    telemetry.inflight_count -= done;
+    memmove(telemetry.inflight, telemetry.inflight + done, telemetry.inflight_count * sizeof(TelemetryInflight));
+    xSemaphoreGive(telemetry.lock);
+}
+
 static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     ESP_LOGD(TAG_MQTT, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
@@ -44,21 +184,20 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG_MQTT, "MQTT_EVENT_CONNECTED");
-        
-        char temperature_string[16];
-        sprintf(temperature_string, "%f", temperature / 100.f);
-        msg_id = esp_mqtt_client_publish(client, TOPIC_TEMPERATURE, temperature_string, 0, 1, 0);
-        ESP_LOGI(TAG_MQTT, "sent publish successful, msg_id=%d", msg_id);
-
-        char humidity_string[16];
-        sprintf(humidity_string, "%f", humidity / 100.f);
-        msg_id = esp_mqtt_client_publish(client, TOPIC_HUMIDITY, humidity_string, 0, 1, 0);
-        ESP_LOGI(TAG_MQTT, "sent publish successful, msg_id=%d", msg_id);
-
+        // The telemetry task flushes whatever was queued meanwhile.
+        telemetry.connected = true;
         break;
 
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG_MQTT, "MQTT_EVENT_DISCONNECTED");
+        telemetry.connected = false;
+        // Unacknowledged batches are published again after reconnecting.
+        xSemaphoreTake(telemetry.lock, portMAX_DELAY);
+        telemetry.inflight_count = 0;
+        memset(telemetry.early_acks, 0, sizeof(telemetry.early_acks));
+        telemetry.next = telemetry.acked;
+        telemetry.session++;
+        xSemaphoreGive(telemetry.lock);
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
@@ -70,7 +209,11 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
         ESP_LOGI(TAG_MQTT, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG_MQTT, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG_MQTT, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        telemetry.stats.acked++;
+        metricInc(&mqtt_acked);
+        ackTelemetry(event->msg_id);
+        xTaskNotifyGive(telemetry.task);
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG_MQTT, "MQTT_EVENT_DATA");
@@ -93,14 +236,248 @@ static void mqttEventHandler(void *handler_args, esp_event_base_t base, int32_t
     }
 }
 
+static int formatFixedPoint(char *buffer, size_t size, int32_t value)
+{
+    return snprintf(buffer, size, "%s%d.%02d", value < 0 ? "-" : "", abs(value) / 100, abs(value) % 100);
+}
+
+// One PUBLISH per topic carrying {"boot": n, "samples": [[timestamp, value], ...]}.
+static int formatTelemetryBatch(char *payload, size_t size, uint16_t boot, const TelemetrySample *batch, size_t count,
+                                bool temperature_values)
+{
+    int length = snprintf(payload, size, "{\"boot\":%u,\"samples\":[", boot);
+    for (size_t i = 0; i < count; i++)
+    {
+        char value[16];
+        formatFixedPoint(value, sizeof(value), temperature_values ? batch[i].temperature : batch[i].humidity);
+        length += snprintf(payload + length, size - length, "%s[%u,%s]", i > 0 ? "," : "", (unsigned)batch[i].timestamp, value);
+        if (length >= (int)size)
+            return -1;
+    }
+    length += snprintf(payload + length, size - length, "]}");
+    return length < (int)size ? length : -1;
+}
+
+static int encodeTelemetryBatch(uint8_t *payload, size_t size, uint16_t boot, const TelemetrySample *batch, size_t count)
+{
+    CborWriter writer;
+    cborInit(&writer, payload, size);
+    cborWriteMap(&writer, 2);
+    cborWriteText(&writer, "boot");
+    cborWriteUint(&writer, boot);
+    cborWriteText(&writer, "samples");
+    cborWriteArray(&writer, count);
+    for (size_t i = 0; i < count; i++)
+        cborWriteSample(&writer, batch[i].timestamp, batch[i].temperature, batch[i].humidity);
+
+    return cborFinish(&writer);
+}
+
+// Returns the message id, 0 for QoS 0, or -1 if the client refused it.
+static int publishTelemetryPayload(const MqttTopic *topic, const char *payload, int length)
+{
+    int msg_id = length < 0 ? -1 : esp_mqtt_client_publish(telemetry.client, topic->topic, payload, length, topic->qos, 0);
+    if (msg_id < 0)
+    {
+        telemetry.stats.failed++;
+        metricInc(&mqtt_publish_failed);
+        return -1;
+    }
+
+    telemetry.stats.published++;
+    metricInc(&mqtt_published);
+    return msg_id;
+}
+
+// Returns the id of the message whose PUBACK confirms the batch, 0 if
+// nothing will be acknowledged, or -1 on failure. Topics already sent are
+// skipped and the progress of a failed batch is kept in partial.
+static int publishTelemetryBatch(uint16_t boot, const TelemetrySample *batch, size_t count, TelemetryPartial *partial)
+{
+    char payload[MQTT_PAYLOAD_MAX];
+    if (MQTT_PAYLOAD_FORMAT == PAYLOAD_FORMAT_CBOR)
+    {
+        int length = encodeTelemetryBatch((uint8_t *)payload, sizeof(payload), boot, batch, count);
+        return publishTelemetryPayload(&kTopicSamples, payload, length);
+    }
+
+    const MqttTopic *topics[] = {&kTopicTemperature, &kTopicHumidity};
+    int confirm_id = partial->topics_sent > 0 ? partial->confirm_id : 0;
+
+    for (size_t i = partial->topics_sent; i < sizeof(topics) / sizeof(topics[0]); i++)
+    {
+        int length = formatTelemetryBatch(payload, sizeof(payload), boot, batch, count, topics[i] == &kTopicTemperature);
+        int msg_id = publishTelemetryPayload(topics[i], payload, length);
+        if (msg_id < 0)
+        {
+            partial->topics_sent = i;
+            partial->confirm_id = confirm_id;
+            return -1;
+        }
+        if (topics[i]->qos > 0)
+            confirm_id = msg_id;
+    }
+
+    partial->topics_sent = 0;
+    return confirm_id;
+}
+
+// Reads up to max valid records starting at *next, all from the same boot.
+// Records that do not read back, e.g. torn by a power loss, are skipped
+// and counted in *unreadable.
+static size_t readTelemetryBatch(uint32_t *next, uint32_t head, TelemetrySample *batch, size_t max, uint16_t *boot,
+                                 uint32_t *unreadable)
+{
+    size_t count = 0;
+    for (; *next < head && count < max; (*next)++)
+    {
+        FlashLogRecord record;
+        if (!flashLogRead(*next, &record))
+        {
+            ESP_LOGW(TAG_MQTT, "Record %u is unreadable, skipped", (unsigned)*next);
+            (*unreadable)++;
+            continue;
+        }
+        if (count > 0 && record.boot != *boot)
+            break;
+
+        *boot = record.boot;
+        batch[count++] = (TelemetrySample){record.timestamp, record.temperature, record.humidity};
+    }
+
+    return count;
+}
+
+// Live data goes out in batches of MQTT_BATCH_SIZE. A larger backlog, left
+// by an outage, is replayed in MQTT_REPLAY_BATCH_SIZE batches back to back,
+// limited only by MQTT_MAX_INFLIGHT unacknowledged messages. After a
+// reconnect a trailing partial batch is flushed as well.
+static void drainTelemetry(bool flush)
+{
+    while (telemetry.connected)
+    {
+        uint32_t head = flashLogHead();
+        uint32_t tail = flashLogTail();
+
+        xSemaphoreTake(telemetry.lock, portMAX_DELAY);
+        if (telemetry.next < tail)
+        {
+            telemetry.stats.lost += tail - telemetry.next;
+            telemetry.next = tail;
+        }
+        uint32_t next = telemetry.next;
+        uint32_t session = telemetry.session;
+        bool room = telemetry.inflight_count < MQTT_MAX_INFLIGHT;
+        xSemaphoreGive(telemetry.lock);
+
+        // A partly published batch is finished first, whatever its size.
+        // After a disconnect everything unacknowledged goes out again anyway.
+        TelemetryPartial *partial = &telemetry.partial;
+        if (partial->topics_sent > 0 && (partial->session != session || partial->start != next))
+            partial->topics_sent = 0;
+        bool resume = partial->topics_sent > 0;
+
+        uint32_t backlog = head - next;
+        size_t batch_size = backlog > MQTT_REPLAY_BATCH_SIZE ? MQTT_REPLAY_BATCH_SIZE : MQTT_BATCH_SIZE;
+        if (!room || backlog == 0 || (backlog < batch_size && !flush && !resume))
+            return;
+
+        TelemetrySample batch[MQTT_REPLAY_BATCH_SIZE];
+        uint16_t boot = 0;
+        uint32_t start = next;
+        uint32_t unreadable = 0;
+        size_t count = resume ? readTelemetryBatch(&next, partial->end, batch, MQTT_REPLAY_BATCH_SIZE, &boot, &unreadable)
+                              : readTelemetryBatch(&next, head, batch, batch_size, &boot, &unreadable);
+
+        int msg_id = count > 0 ? publishTelemetryBatch(boot, batch, count, partial) : 0;
+        if (msg_id < 0)
+        {
+            partial->session = session;
+            partial->start = start;
+            partial->end = next;
+            return;
+        }
+
+        xSemaphoreTake(telemetry.lock, portMAX_DELAY);
+        // A disconnect meanwhile rewound the position; leave it there.
+        bool acked = false;
+        if (telemetry.session == session)
+        {
+            telemetry.stats.lost += unreadable;
+            telemetry.next = next;
+            acked = msg_id == 0 || takeEarlyAck(msg_id);
+            telemetry.inflight[telemetry.inflight_count++] = (TelemetryInflight){msg_id, next, acked, esp_timer_get_time()};
+        }
+        xSemaphoreGive(telemetry.lock);
+
+        if (acked)
+            ackTelemetry(0);
+    }
+}
+
+static void logTelemetryStats(uint32_t elapsed_ms)
+{
+    static uint32_t last_published;
+    uint32_t published = telemetry.stats.published;
+
+    ESP_LOGI(TAG_MQTT, "%u msg/min, backlog %u, published %u, acked %u, failed %u, lost %u",
+             (unsigned)((published - last_published) * 60000ULL / elapsed_ms),
+             (unsigned)(flashLogHead() - telemetry.acked), telemetry.stats.published, telemetry.stats.acked,
+             telemetry.stats.failed, telemetry.stats.lost);
+    last_published = published;
+}
+
+static void telemetryTask(void *param)
+{
+    TickType_t last_stats = xTaskGetTickCount();
+    bool was_connected = false;
+
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MQTT_POLL_MS));
+
+        bool connected = telemetry.connected;
+        drainTelemetry(connected && !was_connected);
+        was_connected = connected;
+        flashLogCursorSave(&telemetry.cursor, telemetry.acked, false);
+
+        TickType_t now = xTaskGetTickCount();
+        if (now - last_stats >= pdMS_TO_TICKS(MQTT_STATS_PERIOD_MS))
+        {
+            logTelemetryStats(pdTICKS_TO_MS(now - last_stats));
+            last_stats = now;
+        }
+    }
+}
+
+// Waits until everything in the log was acknowledged by the broker and
+// saves the cursor, e.g. before going to deep sleep.
+static bool mqttWaitForDelivery(TickType_t timeout)
+{
+    TickType_t started = xTaskGetTickCount();
+    bool delivered;
+    while (!(delivered = telemetry.acked == flashLogHead()) && xTaskGetTickCount() - started < timeout)
+        vTaskDelay(pdMS_TO_TICKS(100));
+
+    flashLogCursorSave(&telemetry.cursor, telemetry.acked, true);
+    return delivered;
+}
+
 static void mqttAppStart(void)
 {
+    if (telemetry.client != NULL)
+        return;
+
     esp_mqtt_client_config_t mqtt_cfg = {
         .uri = "mqtt://broker.mqttdashboard.com:1883",
     };
 
-    esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
+    telemetry.lock = xSemaphoreCreateMutex();
+    telemetry.next = telemetry.acked = flashLogCursorOpen(&telemetry.cursor, "mqtt");
+    xTaskCreate(telemetryTask, "mqttTelemetry", 4096, NULL, 5, &telemetry.task);
+
+    telemetry.client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqttEventHandler */
-    esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqttEventHandler, NULL);
-    esp_mqtt_client_start(client);
-}
\ No newline at end of file
+    esp_mqtt_client_register_event(telemetry.client, ESP_EVENT_ANY_ID, mqttEventHandler, NULL);
+    esp_mqtt_client_start(telemetry.client);
+}
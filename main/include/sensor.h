@@ -1,6 +1,17 @@
+#include <sys/param.h>
+
 #include <esp_nimble_hci.h>
+#include <esp_timer.h>
 #include <driver/i2c.h>
 
+#include <freertos/queue.h>
+
+#include "aht20_decode.h"
+#include "boot.h"
+#include "metrics.h"
+#include "ess_trigger.h"
+#include "history.h"
+
 #include <nimble/nimble_port.h>
 #include <nimble/nimble_port_freertos.h>
 #include <host/ble_hs.h>
@@ -10,7 +21,6 @@
 #include <services/gatt/ble_svc_gatt.h>
 
 // Hardware configuration
-#define LED_GPIO_PIN GPIO_NUM_1
 #define I2C_PORT_NUMBER I2C_NUM_0
 #define I2C_CLK_FREQUENCY 100000
 #define I2C_SDA_PIN GPIO_NUM_4
@@ -23,31 +33,262 @@
 #define CMD_TRIGGER 0xAC
 #define CMD_CALIBRATE 0xE1
 #define STATUS_CALIBRATED 0x08
+#define STATUS_BUSY 0x80
+#define AHT20_POWER_ON_DELAY_MS 40
+#define AHT20_CALIBRATION_DELAY_MS 10
+#define AHT20_CONVERSION_TIME_MS 80
+#define AHT20_POLL_INTERVAL_MS 5
+#define AHT20_POLL_TIMEOUT_MS 100
+#define AHT20_SAMPLE_PERIOD_MS 10000
+#define AHT20_TASK_PRIORITY 6
+#define AHT20_TASK_CORE (portNUM_PROCESSORS - 1)
+#define SAMPLE_BUS_MAX_SINKS 6
 
 // Bluetooth configuration (Environmental Sensing Service)
 #define GATT_ESS_UUID 0x181A
 #define GATT_ESS_TEMPERATURE_UUID 0x2A6E
 #define GATT_ESS_HUMIDITY_UUID 0x2A6F
+#define ESS_UPDATE_INTERVAL_S 10
+#define ESS_SAMPLING_INSTANTANEOUS 0x01
+#define ESS_APPLICATION_AIR 0x01
+#define BLE_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define BLE_PREFERRED_MTU 517
+#define BLE_DATA_LENGTH_OCTETS 251
+#define BLE_DATA_LENGTH_TIME_US 2120
+#define BLE_DEFAULT_MTU 23
+#define BLE_ATT_HEADER_LENGTH 3
+
+// History transfer service (vendor specific)
+#define HISTORY_OP_START 0x01
+#define HISTORY_OP_STOP 0x02
+#define HISTORY_OP_RESUME 0x03
+#define HISTORY_PACKET_HEADER_LENGTH 5
+#define HISTORY_RECORD_LENGTH 8
+#define HISTORY_CONGESTION_DELAY_MS 10
 
 uint16_t humidity;
 int16_t temperature;
 
-static bool device_connected;
-static uint16_t conn_handle;
+typedef struct
+{
+    esp_err_t status;
+    uint32_t timestamp;  // seconds since boot
+    int16_t temperature; // 0.01 degC
+    uint16_t humidity;   // 0.01 %RH
+} Aht20Sample;
+
+typedef enum
+{
+    AHT20_UNINITIALIZED,
+    AHT20_IDLE,
+    AHT20_MEASURING,
+} Aht20State;
+
+static struct
+{
+    Aht20State state;
+} aht20 = {
+    .state = AHT20_UNINITIALIZED,
+};
+
+// Every consumer of sensor readings subscribes to the sample bus and gets
+// its own bounded queue. When a consumer falls behind only its queue
+// overflows, according to its drop policy.
+typedef enum
+{
+    SAMPLE_DROP_OLDEST, // keep the freshest readings
+    SAMPLE_DROP_NEWEST, // keep what is already queued
+} SampleDropPolicy;
+
+typedef struct
+{
+    const char *name;
+    QueueHandle_t queue;
+    SampleDropPolicy policy;
+    uint32_t delivered;
+    uint32_t dropped;
+} SampleSink;
+
+static struct
+{
+    SampleSink sinks[SAMPLE_BUS_MAX_SINKS];
+    size_t count;
+    portMUX_TYPE lock;
+} sample_bus = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+typedef enum
+{
+    ESS_TEMPERATURE,
+    ESS_HUMIDITY,
+    ESS_CHARACTERISTIC_COUNT
+} EssCharacteristicIndex;
+
+typedef struct
+{
+    const char *name;
+    EssCharacteristicIndex index;
+    bool is_signed;
+    uint8_t measurement[11]; // ES Measurement descriptor value
+} EssCharacteristic;
+
+// Trigger settings are kept per central, so every client picks its own rate.
+typedef struct
+{
+    bool used;
+    uint16_t conn_handle;
+    bool subscribed[ESS_CHARACTERISTIC_COUNT];
+    EssTrigger triggers[ESS_CHARACTERISTIC_COUNT];
+    uint16_t mtu;
+
+    // History transfer state
+    bool history_subscribed;
+    bool transferring;
+    uint32_t next_sequence;
+    uint32_t transfer_id;
+    uint32_t transfer_bytes;
+    int64_t transfer_started_us;
+} BleConnection;
+
+// Uncertainty is in 0.5 % steps: AHT20 is +-0.3 degC and +-2 %RH.
+static const EssCharacteristic ess_temperature = {
+    .name = "temperature",
+    .index = ESS_TEMPERATURE,
+    .is_signed = true,
+    .measurement = {0x00, 0x00, ESS_SAMPLING_INSTANTANEOUS, ESS_UPDATE_INTERVAL_S, 0x00, 0x00,
+                    ESS_UPDATE_INTERVAL_S, 0x00, 0x00, ESS_APPLICATION_AIR, 2},
+};
+
+static const EssCharacteristic ess_humidity = {
+    .name = "humidity",
+    .index = ESS_HUMIDITY,
+    .is_signed = false,
+    .measurement = {0x00, 0x00, ESS_SAMPLING_INSTANTANEOUS, ESS_UPDATE_INTERVAL_S, 0x00, 0x00,
+                    ESS_UPDATE_INTERVAL_S, 0x00, 0x00, ESS_APPLICATION_AIR, 4},
+};
+
+static portMUX_TYPE ble_connections_lock = portMUX_INITIALIZER_UNLOCKED;
+static BleConnection ble_connections[BLE_MAX_CONNECTIONS];
 static uint16_t humidity_handle;
 static uint16_t temperature_handle;
+static uint16_t history_data_handle;
+static TaskHandle_t history_transfer_task;
+
+// Runs on the NimBLE host task whenever a central connects or disconnects.
+// Keep it short and non-blocking.
+typedef void (*BleConnectionHook)(bool connected);
+static BleConnectionHook ble_connection_hook;
 
 static void startAdvertisement(void);
 
-static void setLedState(bool state)
+// Callers must hold ble_connections_lock.
+static BleConnection *findBleConnection(uint16_t conn_handle)
+{
+    for (size_t i = 0; i < BLE_MAX_CONNECTIONS; i++)
+    {
+        if (ble_connections[i].used && ble_connections[i].conn_handle == conn_handle)
+            return &ble_connections[i];
+    }
+
+    return NULL;
+}
+
+static size_t countBleConnections(void)
+{
+    size_t count = 0;
+    taskENTER_CRITICAL(&ble_connections_lock);
+    for (size_t i = 0; i < BLE_MAX_CONNECTIONS; i++)
+        count += ble_connections[i].used;
+    taskEXIT_CRITICAL(&ble_connections_lock);
+    return count;
+}
+
+static bool addBleConnection(uint16_t conn_handle)
+{
+    bool added = false;
+    taskENTER_CRITICAL(&ble_connections_lock);
+    for (size_t i = 0; i < BLE_MAX_CONNECTIONS && !added; i++)
+    {
+        if (ble_connections[i].used)
+            continue;
+
+        ble_connections[i] = (BleConnection){.used = true, .conn_handle = conn_handle, .mtu = BLE_DEFAULT_MTU};
+        for (size_t c = 0; c < ESS_CHARACTERISTIC_COUNT; c++)
+            ble_connections[i].triggers[c].setting.condition = ESS_TRIGGER_ON_CHANGE;
+        added = true;
+    }
+    taskEXIT_CRITICAL(&ble_connections_lock);
+    return added;
+}
+
+static void removeBleConnection(uint16_t conn_handle)
+{
+    taskENTER_CRITICAL(&ble_connections_lock);
+    BleConnection *connection = findBleConnection(conn_handle);
+    if (connection != NULL)
+        connection->used = false;
+    taskEXIT_CRITICAL(&ble_connections_lock);
+}
+
+static void setBleMtu(uint16_t conn_handle, uint16_t mtu)
+{
+    taskENTER_CRITICAL(&ble_connections_lock);
+    BleConnection *connection = findBleConnection(conn_handle);
+    if (connection != NULL)
+        connection->mtu = mtu;
+    taskEXIT_CRITICAL(&ble_connections_lock);
+}
+
+static void setBleSubscription(uint16_t conn_handle, uint16_t attr_handle, bool subscribed)
+{
+    if (attr_handle == history_data_handle)
+    {
+        taskENTER_CRITICAL(&ble_connections_lock);
+        BleConnection *connection = findBleConnection(conn_handle);
+        if (connection != NULL)
+            connection->history_subscribed = subscribed;
+        taskEXIT_CRITICAL(&ble_connections_lock);
+        return;
+    }
+
+    EssCharacteristicIndex index;
+    if (attr_handle == temperature_handle)
+        index = ESS_TEMPERATURE;
+    else if (attr_handle == humidity_handle)
+        index = ESS_HUMIDITY;
+    else
+        return;
+
+    taskENTER_CRITICAL(&ble_connections_lock);
+    BleConnection *connection = findBleConnection(conn_handle);
+    if (connection != NULL)
+    {
+        connection->subscribed[index] = subscribed;
+        // A fresh subscription reports the current value on the next sample.
+        connection->triggers[index] = (EssTrigger){.setting = connection->triggers[index].setting};
+    }
+    taskEXIT_CRITICAL(&ble_connections_lock);
+}
+
+// Set before initializeBluetooth().
+static void bleSetConnectionHook(BleConnectionHook hook)
+{
+    ble_connection_hook = hook;
+}
+
+static void reportBleConnections(void)
 {
-    gpio_set_direction(LED_GPIO_PIN, GPIO_MODE_OUTPUT);
-    gpio_set_level(LED_GPIO_PIN, state ? 1 : 0);
+    if (ble_connection_hook != NULL)
+        ble_connection_hook(countBleConnections() > 0);
 }
 
+// At 100 Hz anything below 10 ms would be vTaskDelay(0), which does not
+// block at all. Waits always yield for at least one tick.
 static void waitMs(unsigned delay)
 {
-    vTaskDelay(delay / portTICK_PERIOD_MS);
+    TickType_t ticks = pdMS_TO_TICKS(delay);
+    vTaskDelay(ticks > 0 ? ticks : 1);
 }
 
 static int getTemperature(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
@@ -62,6 +303,96 @@ static int getHumidity(uint16_t conn_handle, uint16_t attr_handle, struct ble_ga
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
+static int accessMeasurement(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const EssCharacteristic *characteristic = arg;
+    int rc = os_mbuf_append(ctxt->om, characteristic->measurement, sizeof(characteristic->measurement));
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int accessTriggerSetting(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const EssCharacteristic *characteristic = arg;
+    uint8_t data[ESS_TRIGGER_MAX_LENGTH];
+
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_DSC)
+    {
+        EssTriggerSetting setting = {.condition = ESS_TRIGGER_ON_CHANGE};
+        taskENTER_CRITICAL(&ble_connections_lock);
+        BleConnection *connection = findBleConnection(conn_handle);
+        if (connection != NULL)
+            setting = connection->triggers[characteristic->index].setting;
+        taskEXIT_CRITICAL(&ble_connections_lock);
+
+        size_t length = essTriggerSerialize(&setting, sizeof(int16_t), data);
+        return os_mbuf_append(ctxt->om, data, length) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    uint16_t length;
+    if (ble_hs_mbuf_to_flat(ctxt->om, data, sizeof(data), &length) != 0)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    EssTriggerSetting setting;
+    if (!essTriggerParse(data, length, sizeof(int16_t), characteristic->is_signed, &setting))
+        return ESS_ERR_CONDITION_NOT_SUPPORTED;
+
+    // Restart evaluation so the new condition reports the current value once.
+    taskENTER_CRITICAL(&ble_connections_lock);
+    BleConnection *connection = findBleConnection(conn_handle);
+    if (connection != NULL)
+        connection->triggers[characteristic->index] = (EssTrigger){.setting = setting};
+    taskEXIT_CRITICAL(&ble_connections_lock);
+
+    ESP_LOGI("BLE GATT", "%s trigger condition 0x%02X, operand %d",
+             characteristic->name, setting.condition, setting.operand);
+    return 0;
+}
+
+static int accessHistoryData(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+}
+
+// Control point: START <u32 sequence>, STOP, RESUME. Records are streamed
+// as notifications on the data characteristic; a packet with no records
+// marks the end of the transfer and carries the next sequence to resume from.
+static int accessHistoryControl(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t data[5];
+    uint16_t length;
+    if (ble_hs_mbuf_to_flat(ctxt->om, data, sizeof(data), &length) != 0 || length < 1)
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    uint8_t opcode = data[0];
+    if ((opcode == HISTORY_OP_START && length != 5) || (opcode != HISTORY_OP_START && length != 1))
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    if (opcode < HISTORY_OP_START || opcode > HISTORY_OP_RESUME)
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+
+    int rc = 0;
+    taskENTER_CRITICAL(&ble_connections_lock);
+    BleConnection *connection = findBleConnection(conn_handle);
+    if (connection == NULL || !connection->history_subscribed)
+        rc = BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    else if (opcode == HISTORY_OP_STOP)
+        connection->transferring = false;
+    else
+    {
+        if (opcode == HISTORY_OP_START)
+            connection->next_sequence = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t)data[4] << 24);
+        connection->transferring = true;
+        connection->transfer_id++;
+        connection->transfer_bytes = 0;
+        connection->transfer_started_us = esp_timer_get_time();
+    }
+    taskEXIT_CRITICAL(&ble_connections_lock);
+
+    if (rc == 0 && opcode != HISTORY_OP_STOP)
+        xTaskNotifyGive(history_transfer_task);
+
+    return rc;
+}
+
 static const struct ble_gatt_svc_def kBleServices[] = {
     {.type = BLE_GATT_SVC_TYPE_PRIMARY,
      .uuid = BLE_UUID16_DECLARE(GATT_ESS_UUID),
@@ -70,14 +401,70 @@ static const struct ble_gatt_svc_def kBleServices[] = {
              .uuid = BLE_UUID16_DECLARE(GATT_ESS_TEMPERATURE_UUID),
              .access_cb = getTemperature,
              .val_handle = &temperature_handle,
-             .flags = BLE_GATT_CHR_F_NOTIFY,
+             .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+             .descriptors = (struct ble_gatt_dsc_def[]){
+                 {
+                     .uuid = BLE_UUID16_DECLARE(ESS_MEASUREMENT_UUID),
+                     .att_flags = BLE_ATT_F_READ,
+                     .access_cb = accessMeasurement,
+                     .arg = (void *)&ess_temperature,
+                 },
+                 {
+                     .uuid = BLE_UUID16_DECLARE(ESS_TRIGGER_SETTING_UUID),
+                     .att_flags = BLE_ATT_F_READ | BLE_ATT_F_WRITE,
+                     .access_cb = accessTriggerSetting,
+                     .arg = (void *)&ess_temperature,
+                 },
+                 {
+                     0,
+                 },
+             },
          },
          {
              .uuid = BLE_UUID16_DECLARE(GATT_ESS_HUMIDITY_UUID),
              .access_cb = getHumidity,
              .val_handle = &humidity_handle,
+             .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+             .descriptors = (struct ble_gatt_dsc_def[]){
+                 {
+                     .uuid = BLE_UUID16_DECLARE(ESS_MEASUREMENT_UUID),
+                     .att_flags = BLE_ATT_F_READ,
+                     .access_cb = accessMeasurement,
+                     .arg = (void *)&ess_humidity,
+                 },
+                 {
+                     .uuid = BLE_UUID16_DECLARE(ESS_TRIGGER_SETTING_UUID),
+                     .att_flags = BLE_ATT_F_READ | BLE_ATT_F_WRITE,
+                     .access_cb = accessTriggerSetting,
+                     .arg = (void *)&ess_humidity,
+                 },
+                 {
+                     0,
+                 },
+             },
+         },
+         {
+             0,
+         },
+     }},
+    {.type = BLE_GATT_SVC_TYPE_PRIMARY,
+     // 6e4f0001-8a5c-4f6b-9d1e-3a2b6c7d8e9f
+     .uuid = BLE_UUID128_DECLARE(0x9f, 0x8e, 0x7d, 0x6c, 0x2b, 0x3a, 0x1e, 0x9d,
+                                 0x6b, 0x4f, 0x5c, 0x8a, 0x01, 0x00, 0x4f, 0x6e),
+     .characteristics = (struct ble_gatt_chr_def[]){
+         {
+             .uuid = BLE_UUID128_DECLARE(0x9f, 0x8e, 0x7d, 0x6c, 0x2b, 0x3a, 0x1e, 0x9d,
+                                         0x6b, 0x4f, 0x5c, 0x8a, 0x02, 0x00, 0x4f, 0x6e),
+             .access_cb = accessHistoryData,
+             .val_handle = &history_data_handle,
              .flags = BLE_GATT_CHR_F_NOTIFY,
          },
+         {
+             .uuid = BLE_UUID128_DECLARE(0x9f, 0x8e, 0x7d, 0x6c, 0x2b, 0x3a, 0x1e, 0x9d,
+                                         0x6b, 0x4f, 0x5c, 0x8a, 0x03, 0x00, 0x4f, 0x6e),
+             .access_cb = accessHistoryControl,
+             .flags = BLE_GATT_CHR_F_WRITE,
+         },
          {
              0,
          },
@@ -87,22 +474,63 @@ static const struct ble_gatt_svc_def kBleServices[] = {
     },
 };
 
+// Asks for the largest ATT MTU, LE Data Length Extension and the 2M PHY.
+// Each request may be refused by the central, the transfer then just uses
+// smaller packets.
+static void negotiateBulkLink(uint16_t conn_handle)
+{
+    if (ble_gattc_exchange_mtu(conn_handle, NULL, NULL) != 0)
+        ESP_LOGW("BLE", "MTU exchange not started");
+    if (ble_gap_set_data_len(conn_handle, BLE_DATA_LENGTH_OCTETS, BLE_DATA_LENGTH_TIME_US) != 0)
+        ESP_LOGW("BLE", "Data length extension not available");
+    if (ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY) != 0)
+        ESP_LOGW("BLE", "2M PHY not available");
+}
+
 static int onBleGapEvent(struct ble_gap_event *event, void *arg)
 {
     switch (event->type)
     {
     case BLE_GAP_EVENT_CONNECT:
-        ESP_LOGI("BLE GAP Event", "Connected");
-        setLedState(true);
-        device_connected = true;
-        conn_handle = event->connect.conn_handle;
+        if (event->connect.status != 0 || !addBleConnection(event->connect.conn_handle))
+        {
+            ESP_LOGI("BLE GAP Event", "Connection failed");
+            if (event->connect.status == 0)
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_CONN_LIMIT);
+            startAdvertisement();
+            break;
+        }
+
+        ESP_LOGI("BLE GAP Event", "Connected (%u/%u)", (unsigned)countBleConnections(), BLE_MAX_CONNECTIONS);
+        reportBleConnections();
+        negotiateBulkLink(event->connect.conn_handle);
+        // Advertising stops on connect; keep it going while slots are free.
+        if (countBleConnections() < BLE_MAX_CONNECTIONS)
+            startAdvertisement();
         break;
 
     case BLE_GAP_EVENT_DISCONNECT:
-        ESP_LOGI("BLE GAP Event", "Disconnected");
-        setLedState(false);
-        startAdvertisement();
-        device_connected = false;
+        removeBleConnection(event->disconnect.conn.conn_handle);
+        ESP_LOGI("BLE GAP Event", "Disconnected (%u/%u)", (unsigned)countBleConnections(), BLE_MAX_CONNECTIONS);
+        reportBleConnections();
+        if (!ble_gap_adv_active())
+            startAdvertisement();
+        break;
+
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        ESP_LOGI("BLE GAP Event", "Subscribe: conn=%u attr=%u notify=%u",
+                 event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.cur_notify);
+        setBleSubscription(event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.cur_notify);
+        break;
+
+    case BLE_GAP_EVENT_MTU:
+        ESP_LOGI("BLE GAP Event", "MTU: conn=%u mtu=%u", event->mtu.conn_handle, event->mtu.value);
+        setBleMtu(event->mtu.conn_handle, event->mtu.value);
+        break;
+
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        if (countBleConnections() < BLE_MAX_CONNECTIONS)
+            startAdvertisement();
         break;
 
     default:
@@ -152,6 +580,14 @@ static void setDeviceName(const char *device_name)
     ble_svc_gap_device_name_set(device_name);
 }
 
+static void onBleSync(void)
+{
+    bootMark("ble sync");
+    // The GAP calls fail with BLE_HS_ENOTSYNCED before this point.
+    setDeviceName("AHT20 Destiny");
+    startAdvertisement();
+}
+
 static void startBleService(void *param)
 {
     ESP_LOGI("BLE task", "BLE Host Task Started");
@@ -175,67 +611,447 @@ static void initializeI2C(void)
     i2c_driver_install(I2C_PORT_NUMBER, conf.mode, 0, 0, 0);
 }
 
-static void writeToTheSensor(uint8_t *data, size_t length)
+static Metric i2c_write_latency = METRIC_LABELED_INIT("aht20_i2c_seconds", "AHT20 I2C transaction time.", "op=\"write\"", METRIC_HISTOGRAM);
+static Metric i2c_read_latency = METRIC_LABELED_INIT("aht20_i2c_seconds", "AHT20 I2C transaction time.", "op=\"read\"", METRIC_HISTOGRAM);
+static Metric i2c_errors = METRIC_COUNTER_INIT("aht20_i2c_errors_total", "Failed AHT20 I2C transactions.");
+
+static esp_err_t writeToTheSensor(const uint8_t *data, size_t length)
 {
-    i2c_master_write_to_device(I2C_PORT_NUMBER, I2C_AHT20_ADDRESS, data, length, I2C_TIMEOUT);
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = i2c_master_write_to_device(I2C_PORT_NUMBER, I2C_AHT20_ADDRESS, data, length, I2C_TIMEOUT);
+    metricObserveUs(&i2c_write_latency, esp_timer_get_time() - started_us);
+    if (err != ESP_OK)
+        metricInc(&i2c_errors);
+    return err;
 }
 
-static void readFromTheSensor(uint8_t *buffer, size_t length)
+static esp_err_t readFromTheSensor(uint8_t *buffer, size_t length)
 {
-    i2c_master_read_from_device(I2C_PORT_NUMBER, I2C_AHT20_ADDRESS, buffer, length, I2C_TIMEOUT);
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = i2c_master_read_from_device(I2C_PORT_NUMBER, I2C_AHT20_ADDRESS, buffer, length, I2C_TIMEOUT);
+    metricObserveUs(&i2c_read_latency, esp_timer_get_time() - started_us);
+    if (err != ESP_OK)
+        metricInc(&i2c_errors);
+    return err;
 }
 
-void getValuesFromSensor()
+static esp_err_t readSensorStatus(uint8_t *status)
 {
-    uint8_t cmd_softreset = CMD_SOFTRESET;
-    writeToTheSensor(&cmd_softreset, 1);
-    waitMs(20);
+    return readFromTheSensor(status, 1);
+}
 
-    uint8_t cmd_calibrate = {CMD_CALIBRATE, STATUS_CALIBRATED, 0x00};
-    writeToTheSensor(&cmd_calibrate, 3);
-    waitMs(100);
+// Checks the calibration bit once and only calibrates when it is missing.
+static esp_err_t aht20Calibrate(void)
+{
+    uint8_t status;
+    esp_err_t err = readSensorStatus(&status);
+    if (err != ESP_OK || (status & STATUS_CALIBRATED))
+        return err;
 
-    uint8_t cmd_trigger[3] = {CMD_TRIGGER, 0x33, 0};
-    writeToTheSensor(&cmd_trigger, 3);
-    waitMs(300);
+    ESP_LOGI("AHT20", "Sensor not calibrated, calibrating...");
+    const uint8_t cmd_calibrate[3] = {CMD_CALIBRATE, STATUS_CALIBRATED, 0x00};
+    err = writeToTheSensor(cmd_calibrate, sizeof(cmd_calibrate));
+    if (err != ESP_OK)
+        return err;
 
-    uint8_t data[6];
-    readFromTheSensor(&data, 6);
+    waitMs(AHT20_CALIBRATION_DELAY_MS);
+    err = readSensorStatus(&status);
+    if (err == ESP_OK && !(status & STATUS_CALIBRATED))
+        err = ESP_ERR_INVALID_STATE;
 
-    uint32_t hData = data[1];
-    hData <<= 8;
-    hData |= data[2];
-    hData <<= 4;
-    hData |= data[3] >> 4;
-    humidity = ((float)hData * 100) / 0x100000 * 100;
+    return err;
+}
 
-    uint32_t tData = data[3] & 0x0F;
-    tData <<= 8;
-    tData |= data[4];
-    tData <<= 8;
-    tData |= data[5];
-    temperature = (((float)tData * 200 / 0x100000) - 50) * 100;
+static esp_err_t aht20Trigger(void)
+{
+    const uint8_t cmd_trigger[3] = {CMD_TRIGGER, 0x33, 0x00};
+    return writeToTheSensor(cmd_trigger, sizeof(cmd_trigger));
+}
 
+// Waits for the conversion time, then polls the busy bit instead of
+// sleeping for a worst-case delay. The timeout is measured on esp_timer:
+// a poll interval below the tick period waits a whole tick, so counting
+// intervals would not add up to AHT20_POLL_TIMEOUT_MS.
+static esp_err_t aht20WaitReady(void)
+{
+    waitMs(AHT20_CONVERSION_TIME_MS);
+
+    int64_t deadline_us = esp_timer_get_time() + AHT20_POLL_TIMEOUT_MS * 1000LL;
+    while (1)
+    {
+        uint8_t status;
+        esp_err_t err = readSensorStatus(&status);
+        if (err != ESP_OK)
+            return err;
+        if (!(status & STATUS_BUSY))
+            return ESP_OK;
+        if (esp_timer_get_time() >= deadline_us)
+            return ESP_ERR_TIMEOUT;
+
+        waitMs(AHT20_POLL_INTERVAL_MS);
+    }
+}
+
+// Corrupt or incomplete frames are reported as errors and never published.
+static esp_err_t aht20Read(Aht20Sample *sample)
+{
+    uint8_t frame[AHT20_FRAME_LENGTH];
+    esp_err_t err = readFromTheSensor(frame, sizeof(frame));
+    if (err != ESP_OK)
+        return err;
+
+    switch (aht20Decode(frame, &sample->temperature, &sample->humidity))
+    {
+    case AHT20_DECODE_OK:
+        return ESP_OK;
+    case AHT20_DECODE_BUSY:
+        return ESP_ERR_TIMEOUT;
+    default:
+        return ESP_ERR_INVALID_CRC;
+    }
+}
+
+static SampleSink *sampleBusSubscribe(const char *name, size_t depth, SampleDropPolicy policy)
+{
+    QueueHandle_t queue = xQueueCreate(depth, sizeof(Aht20Sample));
+    if (queue == NULL)
+        return NULL;
+
+    SampleSink *sink = NULL;
+    taskENTER_CRITICAL(&sample_bus.lock);
+    if (sample_bus.count < SAMPLE_BUS_MAX_SINKS)
+    {
+        sink = &sample_bus.sinks[sample_bus.count];
+        *sink = (SampleSink){.name = name, .queue = queue, .policy = policy};
+        __atomic_store_n(&sample_bus.count, sample_bus.count + 1, __ATOMIC_RELEASE);
+    }
+    taskEXIT_CRITICAL(&sample_bus.lock);
+
+    if (sink == NULL)
+    {
+        ESP_LOGE("Sample bus", "No free slot for %s", name);
+        vQueueDelete(queue);
+    }
+
+    return sink;
+}
+
+// Called from the sampling task only, never blocks.
+static void sampleBusPublish(const Aht20Sample *sample)
+{
+    size_t count = __atomic_load_n(&sample_bus.count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; i++)
+    {
+        SampleSink *sink = &sample_bus.sinks[i];
+        if (xQueueSend(sink->queue, sample, 0) == pdTRUE)
+        {
+            sink->delivered++;
+            continue;
+        }
+
+        sink->dropped++;
+        if (sink->policy == SAMPLE_DROP_OLDEST)
+        {
+            Aht20Sample stale;
+            xQueueReceive(sink->queue, &stale, 0);
+            if (xQueueSend(sink->queue, sample, 0) == pdTRUE)
+                sink->delivered++;
+        }
+    }
+}
+
+static bool sampleSinkReceive(SampleSink *sink, Aht20Sample *sample, TickType_t timeout)
+{
+    return sink != NULL && xQueueReceive(sink->queue, sample, timeout) == pdTRUE;
+}
+
+// For depth-1 sinks that are read as "the latest sample" without consuming it.
+static bool sampleSinkPeek(SampleSink *sink, Aht20Sample *sample)
+{
+    return sink != NULL && xQueuePeek(sink->queue, sample, 0) == pdTRUE;
+}
+
+// A measurement owns the bus from trigger to read; a second one started
+// meanwhile is refused rather than interleaved with it. Fails before setup.
+static bool aht20Claim(void)
+{
+    Aht20State idle = AHT20_IDLE;
+    return __atomic_compare_exchange_n(&aht20.state, &idle, AHT20_MEASURING, false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+static void aht20Release(void)
+{
+    __atomic_store_n(&aht20.state, AHT20_IDLE, __ATOMIC_RELEASE);
+}
+
+// Runs one trigger/poll/read cycle and updates the globals and the history.
+static void aht20Measure(Aht20Sample *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+
+    if (!aht20Claim())
+    {
+        ESP_LOGW("AHT20", "Measurement already in progress");
+        sample->status = ESP_ERR_INVALID_STATE;
+        return;
+    }
+
+    sample->timestamp = esp_timer_get_time() / 1000000;
+    sample->status = aht20Trigger();
+    if (sample->status == ESP_OK)
+        sample->status = aht20WaitReady();
+    if (sample->status == ESP_OK)
+        sample->status = aht20Read(sample);
+    aht20Release();
+
+    if (sample->status != ESP_OK)
+    {
+        ESP_LOGE("AHT20", "Measurement failed: %s", esp_err_to_name(sample->status));
+        return;
+    }
+
+    humidity = sample->humidity;
+    temperature = sample->temperature;
+    historyAppend(sample->timestamp, sample->temperature, sample->humidity);
     ESP_LOGI("Values from sensors", "Humidity: %f, Temperature: %f", (float)humidity / 100, (float)temperature / 100);
 }
 
-void getAndNotifyValues()
+// The only task that talks to the sensor. Each reading is taken once and
+// published to every sink, so consumers never touch the I2C bus or block
+// the timer service task.
+static void aht20Task(void *param)
 {
-    getValuesFromSensor();
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1)
+    {
+        Aht20Sample sample;
+        aht20Measure(&sample);
+        if (sample.status == ESP_OK)
+        {
+            bootMark("first sample");
+            sampleBusPublish(&sample);
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(AHT20_SAMPLE_PERIOD_MS));
+    }
+}
 
-    if (device_connected)
+static esp_err_t aht20Setup(void)
+{
+    if (aht20.state != AHT20_UNINITIALIZED)
+        return ESP_OK;
+
+    initializeI2C();
+    waitMs(AHT20_POWER_ON_DELAY_MS);
+
+    esp_err_t err = aht20Calibrate();
+    if (err != ESP_OK)
     {
-        int rc;
-        struct os_mbuf *om;
-        om = ble_hs_mbuf_from_flat(&humidity, sizeof(humidity));
-        rc = ble_gattc_notify_custom(conn_handle, humidity_handle, om);
+        ESP_LOGE("AHT20", "Initialization failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    aht20.state = AHT20_IDLE;
+    return ESP_OK;
+}
 
-        om = ble_hs_mbuf_from_flat(&temperature, sizeof(temperature));
-        rc = ble_gattc_notify_custom(conn_handle, temperature_handle, om);
+static esp_err_t aht20Init(void)
+{
+    bool started = aht20.state != AHT20_UNINITIALIZED;
+    esp_err_t err = aht20Setup();
+    if (err != ESP_OK || started)
+        return err;
+
+    xTaskCreatePinnedToCore(aht20Task, "aht20", 3072, NULL, AHT20_TASK_PRIORITY, NULL, AHT20_TASK_CORE);
+    return ESP_OK;
+}
+
+// One blocking measurement without the sampling task or the bus, for a
+// short wake-up from deep sleep.
+static esp_err_t aht20MeasureOnce(Aht20Sample *sample)
+{
+    esp_err_t err = aht20Setup();
+    if (err != ESP_OK)
+        return err;
+
+    aht20Measure(sample);
+    return sample->status;
+}
+
+static Metric ble_notify_sent = METRIC_LABELED_INIT("ble_notify_total", "BLE notifications by result.", "result=\"sent\"", METRIC_COUNTER);
+static Metric ble_notify_failed = METRIC_LABELED_INIT("ble_notify_total", "BLE notifications by result.", "result=\"failed\"", METRIC_COUNTER);
+
+// Consumes om, like ble_gattc_notify_custom(); a NULL mbuf counts as a failure.
+static int bleNotify(uint16_t conn_handle, uint16_t attr_handle, struct os_mbuf *om)
+{
+    int rc = om != NULL ? ble_gattc_notify_custom(conn_handle, attr_handle, om) : BLE_HS_ENOMEM;
+    metricInc(rc == 0 ? &ble_notify_sent : &ble_notify_failed);
+    return rc;
+}
+
+// Sends one encoded value to every peer in the list. The mbuf is built once
+// and duplicated for all but the last peer, since notify consumes it.
+static void notifyPeers(const uint16_t *peers, size_t count, uint16_t attr_handle, const void *value, size_t length)
+{
+    if (count == 0)
+        return;
+
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(value, length);
+    for (size_t i = 0; i + 1 < count; i++)
+        bleNotify(peers[i], attr_handle, om != NULL ? os_mbuf_dup(om) : NULL);
+
+    bleNotify(peers[count - 1], attr_handle, om);
+}
+
+static void notifyValues(const Aht20Sample *sample)
+{
+    // Triggers are evaluated for every sample, so interval conditions are
+    // only as precise as the sampling period.
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+    const int32_t values[ESS_CHARACTERISTIC_COUNT] = {
+        [ESS_TEMPERATURE] = sample->temperature,
+        [ESS_HUMIDITY] = sample->humidity,
+    };
+
+    uint16_t peers[ESS_CHARACTERISTIC_COUNT][BLE_MAX_CONNECTIONS];
+    size_t peer_count[ESS_CHARACTERISTIC_COUNT] = {0};
+
+    taskENTER_CRITICAL(&ble_connections_lock);
+    for (size_t i = 0; i < BLE_MAX_CONNECTIONS; i++)
+    {
+        BleConnection *connection = &ble_connections[i];
+        for (size_t c = 0; connection->used && c < ESS_CHARACTERISTIC_COUNT; c++)
+        {
+            if (connection->subscribed[c] && essTriggerShouldNotify(&connection->triggers[c], values[c], now_ms))
+                peers[c][peer_count[c]++] = connection->conn_handle;
+        }
     }
+    taskEXIT_CRITICAL(&ble_connections_lock);
+
+    notifyPeers(peers[ESS_HUMIDITY], peer_count[ESS_HUMIDITY], humidity_handle,
+                &sample->humidity, sizeof(sample->humidity));
+    notifyPeers(peers[ESS_TEMPERATURE], peer_count[ESS_TEMPERATURE], temperature_handle,
+                &sample->temperature, sizeof(sample->temperature));
 }
 
-void initializeBluetoothI2C()
+// Fills one notification for the given MTU. Returns its length and the
+// sequence number following the last packed record.
+static size_t packHistory(uint8_t *packet, uint16_t mtu, uint32_t sequence, uint32_t *next_sequence)
+{
+    size_t capacity = (mtu - BLE_ATT_HEADER_LENGTH - HISTORY_PACKET_HEADER_LENGTH) / HISTORY_RECORD_LENGTH;
+    uint32_t head = historyHead();
+    uint32_t tail = historyTail(head);
+    if (sequence < tail)
+        sequence = tail;
+
+    size_t count = 0;
+    uint8_t *record = packet + HISTORY_PACKET_HEADER_LENGTH;
+    uint32_t first = sequence;
+    for (; sequence < head && count < capacity; sequence++)
+    {
+        HistorySample sample;
+        if (!historyRead(sequence, &sample))
+        {
+            // Overwritten while packing, restart from the oldest sample.
+            sequence = first = historyTail(historyHead());
+            count = 0;
+            record = packet + HISTORY_PACKET_HEADER_LENGTH;
+            continue;
+        }
+
+        memcpy(record, &sample.timestamp, sizeof(sample.timestamp));
+        memcpy(record + 4, &sample.temperature, sizeof(sample.temperature));
+        memcpy(record + 6, &sample.humidity, sizeof(sample.humidity));
+        record += HISTORY_RECORD_LENGTH;
+        count++;
+    }
+
+    if (count == 0)
+        first = sequence;
+
+    memcpy(packet, &first, sizeof(first));
+    packet[4] = count;
+    *next_sequence = sequence;
+    return HISTORY_PACKET_HEADER_LENGTH + count * HISTORY_RECORD_LENGTH;
+}
+
+// Streams history to every central with an active transfer, one full-MTU
+// notification per connection per round. Runs until NimBLE runs out of
+// buffers, then backs off briefly.
+static void historyTransferTask(void *param)
+{
+    static uint8_t packet[BLE_PREFERRED_MTU];
+
+    while (1)
+    {
+        bool active = false;
+        bool congested = false;
+
+        for (size_t i = 0; i < BLE_MAX_CONNECTIONS; i++)
+        {
+            taskENTER_CRITICAL(&ble_connections_lock);
+            BleConnection connection = ble_connections[i];
+            taskEXIT_CRITICAL(&ble_connections_lock);
+
+            if (!connection.used || !connection.transferring || !connection.history_subscribed)
+                continue;
+
+            uint32_t next_sequence;
+            size_t length = packHistory(packet, MIN(connection.mtu, BLE_PREFERRED_MTU), connection.next_sequence, &next_sequence);
+            bool finished = length == HISTORY_PACKET_HEADER_LENGTH;
+
+            struct os_mbuf *om = ble_hs_mbuf_from_flat(packet, length);
+            if (bleNotify(connection.conn_handle, history_data_handle, om) != 0)
+            {
+                congested = true;
+                continue;
+            }
+
+            taskENTER_CRITICAL(&ble_connections_lock);
+            BleConnection *current = &ble_connections[i];
+            bool same_transfer = current->used && current->transfer_id == connection.transfer_id;
+            if (same_transfer)
+            {
+                current->next_sequence = next_sequence;
+                current->transfer_bytes += length;
+                current->transferring = !finished;
+            }
+            taskEXIT_CRITICAL(&ble_connections_lock);
+
+            if (same_transfer && finished)
+            {
+                int64_t elapsed_us = esp_timer_get_time() - connection.transfer_started_us;
+                uint32_t bytes = connection.transfer_bytes + length;
+                ESP_LOGI("BLE History", "conn=%u: %u bytes in %lld ms (%u B/s)", connection.conn_handle,
+                         (unsigned)bytes, (long long)(elapsed_us / 1000),
+                         (unsigned)(elapsed_us > 0 ? bytes * 1000000LL / elapsed_us : 0));
+            }
+
+            active = active || !finished;
+        }
+
+        if (congested)
+            waitMs(HISTORY_CONGESTION_DELAY_MS);
+        else if (!active)
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// ESS notifications follow the sensor rate; the triggers decide per central
+// whether a sample goes out.
+static void bleNotifyTask(void *param)
+{
+    SampleSink *sink = param;
+    Aht20Sample sample;
+    while (1)
+    {
+        if (sampleSinkReceive(sink, &sample, portMAX_DELAY))
+            notifyValues(&sample);
+    }
+}
+
+void initializeBluetooth()
 {
     // Initialize BLE peripheral
     esp_nimble_hci_and_controller_init();
@@ -244,6 +1060,7 @@ void initializeBluetoothI2C()
     // Initialize BLE library (nimble)
     ble_svc_gap_init();
     ble_svc_gatt_init();
+    ble_att_set_preferred_mtu(BLE_PREFERRED_MTU);
 
     // Configure BLE library (nimble)
     int rc = ble_gatts_count_cfg(kBleServices);
@@ -258,11 +1075,19 @@ void initializeBluetoothI2C()
         ESP_LOGE("BLE GATT", "Service registration failed");
     }
 
+    xTaskCreate(historyTransferTask, "bleHistory", 3072, NULL, 5, &history_transfer_task);
+
+    SampleSink *sink = sampleBusSubscribe("ble", 2, SAMPLE_DROP_OLDEST);
+    if (sink != NULL)
+        xTaskCreate(bleNotifyTask, "bleNotify", 3072, sink, 5, NULL);
+
     // Run BLE
+    ble_hs_cfg.sync_cb = onBleSync;
     nimble_port_freertos_init(startBleService);
+}
 
-    setDeviceName("AHT20 Destiny");
-    startAdvertisement();
-
-    initializeI2C();
+void initializeBluetoothI2C()
+{
+    initializeBluetooth();
+    aht20Init();
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Page templates are compiled once, when an asset is loaded, into a list of
+// static text segments each followed by an optional placeholder slot.
+// Rendering then only walks that list, without scanning the text again.
+
+#define TEMPLATE_MAX_SEGMENTS 16
+#define TEMPLATE_OPEN "{{"
+#define TEMPLATE_CLOSE "}}"
+
+typedef enum
+{
+    TEMPLATE_SLOT_NONE = -1,
+    TEMPLATE_SLOT_LED,
+    TEMPLATE_SLOT_TEMPERATURE,
+    TEMPLATE_SLOT_HUMIDITY,
+    TEMPLATE_SLOT_UPTIME,
+    TEMPLATE_SLOT_COUNT
+} TemplateSlot;
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+    TemplateSlot slot;
+} TemplateSegment;
+
+typedef struct
+{
+    size_t count;
+    TemplateSegment segments[TEMPLATE_MAX_SEGMENTS];
+} Template;
+
+static const char *const kTemplateSlotNames[TEMPLATE_SLOT_COUNT] = {
+    [TEMPLATE_SLOT_LED] = "led",
+    [TEMPLATE_SLOT_TEMPERATURE] = "temperature",
+    [TEMPLATE_SLOT_HUMIDITY] = "humidity",
+    [TEMPLATE_SLOT_UPTIME] = "uptime",
+};
+
+static TemplateSlot findTemplateSlot(const char *name, size_t length)
+{
+    for (int slot = 0; slot < TEMPLATE_SLOT_COUNT; slot++)
+    {
+        if (strlen(kTemplateSlotNames[slot]) == length && memcmp(kTemplateSlotNames[slot], name, length) == 0)
+            return (TemplateSlot)slot;
+    }
+
+    return TEMPLATE_SLOT_NONE;
+}
+
+static const char *findText(const char *text, size_t size, const char *pattern)
+{
+    size_t pattern_length = strlen(pattern);
+    for (size_t i = 0; i + pattern_length <= size; i++)
+    {
+        if (memcmp(text + i, pattern, pattern_length) == 0)
+            return text + i;
+    }
+
+    return NULL;
+}
+
+// Unknown placeholders are kept as plain text. Returns false when the page
+// has more placeholders than TEMPLATE_MAX_SEGMENTS; the remainder is then
+// emitted verbatim as the last segment.
+static bool compileTemplate(const char *text, size_t size, Template *compiled)
+{
+    compiled->count = 0;
+
+    size_t segment_start = 0;
+    size_t position = 0;
+    while (compiled->count < TEMPLATE_MAX_SEGMENTS - 1)
+    {
+        const char *open = findText(text + position, size - position, TEMPLATE_OPEN);
+        if (open == NULL)
+            break;
+
+        const char *name = open + strlen(TEMPLATE_OPEN);
+        const char *close = findText(name, size - (name - text), TEMPLATE_CLOSE);
+        if (close == NULL)
+            break;
+
+        position = close + strlen(TEMPLATE_CLOSE) - text;
+
+        TemplateSlot slot = findTemplateSlot(name, close - name);
+        if (slot == TEMPLATE_SLOT_NONE)
+            continue;
+
+        compiled->segments[compiled->count++] = (TemplateSegment){
+            .offset = segment_start,
+            .length = (open - text) - segment_start,
+            .slot = slot};
+        segment_start = position;
+    }
+
+    compiled->segments[compiled->count++] = (TemplateSegment){
+        .offset = segment_start,
+        .length = size - segment_start,
+        .slot = TEMPLATE_SLOT_NONE};
+
+    return findText(text + position, size - position, TEMPLATE_OPEN) == NULL ||
+           compiled->count < TEMPLATE_MAX_SEGMENTS;
+}
@@ -14,19 +14,17 @@
 #include "argtable3/argtable3.h"
 #include "ping/ping_sock.h"
 
+#include "wifi_fast.h"
+
 #define ESP_WIFI_SSID "iot"
 #define ESP_WIFI_PASS "iotpasswd"
-#define ESP_MAXIMUM_RETRY 5
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT BIT1
 
 static const char *TAG_WIFI = "Wi-Fi station";
-static int retry_num = 0;
-
-static xTimerHandle timerHTTP; 
 
 void initializePing();
-void httpPutSensorValues();
+void httpUplinkStart(void);
 
 static void eventHandler(void *arg, esp_event_base_t event_base,
                          int32_t event_id, void *event_data)
@@ -35,26 +33,17 @@ static void eventHandler(void *arg, esp_event_base_t event_base,
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
     {
         ESP_LOGI(TAG_WIFI, "wifi started");
-        esp_wifi_connect();
+        wifiFastConnect();
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
-        if (retry_num < ESP_MAXIMUM_RETRY)
-        {
-            esp_wifi_connect();
-            retry_num++;
-            ESP_LOGI(TAG_WIFI, "retry to connect to the AP");
-        }
-        ESP_LOGI(TAG_WIFI, "connect to the AP fail");
+        wifiFastOnDisconnected((wifi_event_sta_disconnected_t *)event_data);
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
     {
-        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-        ESP_LOGI(TAG_WIFI, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        retry_num = 0;
+        wifiFastOnGotIp((ip_event_got_ip_t *)event_data);
         // initializePing();
-        timerHTTP = xTimerCreate("timerHTTP", pdMS_TO_TICKS(10000), pdTRUE, (void *)0, httpPutSensorValues);
-        xTimerStart(timerHTTP, 1);
+        httpUplinkStart();
     }
 }
 
@@ -63,10 +52,11 @@ void wifiInitSTA(void)
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    esp_netif_t *netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    wifiFastInit(netif);
 
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
@@ -87,6 +77,7 @@ void wifiInitSTA(void)
             .password = ESP_WIFI_PASS,
             .threshold.authmode = WIFI_AUTH_WPA2_PSK},
     };
+    wifiFastApply(&wifi_config);
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
@@ -0,0 +1,206 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_wifi.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <nvs.h>
+
+// Fast Wi-Fi (re)connect. The BSSID and channel of the last AP that handed
+// out an address are kept in NVS, so the next connect goes straight to it
+// instead of scanning all channels. The DHCP client asks for its previous
+// lease (CONFIG_LWIP_DHCP_RESTORE_LAST_IP), or is skipped altogether when
+// WIFI_STATIC_IP is defined. Reconnects back off exponentially and never
+// give up.
+
+#define WIFI_FAST_NVS_NAMESPACE "wifi"
+#define WIFI_FAST_NVS_KEY "last_ap"
+#define WIFI_FAST_CACHED_ATTEMPTS 2
+#define WIFI_FAST_BACKOFF_MIN_MS 250
+#define WIFI_FAST_BACKOFF_MAX_MS 60000
+
+// Static addressing, e.g.:
+// #define WIFI_STATIC_IP "192.168.1.50"
+// #define WIFI_STATIC_NETMASK "255.255.255.0"
+// #define WIFI_STATIC_GATEWAY "192.168.1.1"
+// #define WIFI_STATIC_DNS "192.168.1.1"
+
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t valid;
+} WifiFastCache;
+
+static struct
+{
+    esp_netif_t *netif;
+    esp_timer_handle_t retry_timer;
+    WifiFastCache cache;
+    bool using_cache;
+    bool connected;
+    uint32_t failures;
+    int64_t down_since_us;
+
+    struct
+    {
+        int64_t last_time_to_ip_us;
+        uint32_t connects;
+        uint32_t fast_connects;
+        uint32_t disconnects;
+    } stats;
+} wifi_fast;
+
+static void wifiFastLoad(void)
+{
+    nvs_handle_t nvs;
+    size_t size = sizeof(wifi_fast.cache);
+    if (nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return;
+
+    if (nvs_get_blob(nvs, WIFI_FAST_NVS_KEY, &wifi_fast.cache, &size) != ESP_OK || size != sizeof(wifi_fast.cache))
+        memset(&wifi_fast.cache, 0, sizeof(wifi_fast.cache));
+    nvs_close(nvs);
+}
+
+// Only written when the AP actually changed, not on every connect.
+static void wifiFastSave(const WifiFastCache *cache)
+{
+    if (memcmp(cache, &wifi_fast.cache, sizeof(*cache)) == 0)
+        return;
+
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_FAST_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK)
+        return;
+
+    if (nvs_set_blob(nvs, WIFI_FAST_NVS_KEY, cache, sizeof(*cache)) == ESP_OK && nvs_commit(nvs) == ESP_OK)
+        wifi_fast.cache = *cache;
+    nvs_close(nvs);
+}
+
+// Directed connect to the cached AP, or a full scan for the strongest one
+// once the cached AP failed WIFI_FAST_CACHED_ATTEMPTS times.
+static void wifiFastApply(wifi_config_t *config)
+{
+    wifi_fast.using_cache = wifi_fast.cache.valid && wifi_fast.failures < WIFI_FAST_CACHED_ATTEMPTS;
+    if (wifi_fast.using_cache)
+    {
+        config->sta.bssid_set = true;
+        memcpy(config->sta.bssid, wifi_fast.cache.bssid, sizeof(config->sta.bssid));
+        config->sta.channel = wifi_fast.cache.channel;
+        config->sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else
+    {
+        config->sta.bssid_set = false;
+        config->sta.channel = 0;
+        config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+}
+
+static void wifiFastConnect(void)
+{
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK)
+        ESP_LOGW("Wi-Fi", "Connect failed: %s", esp_err_to_name(err));
+}
+
+static void wifiFastRetry(void *arg)
+{
+    wifiFastConnect();
+}
+
+static void wifiFastApplyStaticIp(void)
+{
+#ifdef WIFI_STATIC_IP
+    esp_netif_ip_info_t ip_info = {
+        .ip.addr = esp_ip4addr_aton(WIFI_STATIC_IP),
+        .netmask.addr = esp_ip4addr_aton(WIFI_STATIC_NETMASK),
+        .gw.addr = esp_ip4addr_aton(WIFI_STATIC_GATEWAY),
+    };
+    esp_netif_dns_info_t dns = {
+        .ip.u_addr.ip4.addr = esp_ip4addr_aton(WIFI_STATIC_DNS),
+        .ip.type = ESP_IPADDR_TYPE_V4,
+    };
+
+    // With the DHCP client stopped, esp_netif posts IP_EVENT_STA_GOT_IP as
+    // soon as the link is up.
+    esp_netif_dhcpc_stop(wifi_fast.netif);
+    esp_netif_set_ip_info(wifi_fast.netif, &ip_info);
+    esp_netif_set_dns_info(wifi_fast.netif, ESP_NETIF_DNS_MAIN, &dns);
+#endif
+}
+
+// Call after esp_wifi_init() and before esp_wifi_set_config(), passing the
+// config through wifiFastApply().
+static void wifiFastInit(esp_netif_t *netif)
+{
+    wifi_fast.netif = netif;
+    wifi_fast.down_since_us = esp_timer_get_time();
+    wifiFastLoad();
+    wifiFastApplyStaticIp();
+
+    esp_timer_create_args_t timer = {
+        .callback = wifiFastRetry,
+        .name = "wifiRetry",
+    };
+    esp_timer_create(&timer, &wifi_fast.retry_timer);
+}
+
+static void wifiFastOnDisconnected(const wifi_event_sta_disconnected_t *event)
+{
+    if (wifi_fast.connected)
+    {
+        wifi_fast.connected = false;
+        wifi_fast.down_since_us = esp_timer_get_time();
+        wifi_fast.stats.disconnects++;
+    }
+
+    wifi_fast.failures++;
+    if (wifi_fast.using_cache && wifi_fast.failures == WIFI_FAST_CACHED_ATTEMPTS)
+    {
+        // The AP may have moved to another channel or been replaced.
+        wifi_config_t config;
+        esp_wifi_get_config(WIFI_IF_STA, &config);
+        wifiFastApply(&config);
+        esp_wifi_set_config(WIFI_IF_STA, &config);
+    }
+
+    uint32_t shift = MIN(wifi_fast.failures - 1, 16);
+    uint32_t delay_ms = MIN((uint32_t)WIFI_FAST_BACKOFF_MIN_MS << shift, WIFI_FAST_BACKOFF_MAX_MS);
+    ESP_LOGI("Wi-Fi", "Disconnected (reason %d), retry %u in %u ms", event->reason, wifi_fast.failures, delay_ms);
+
+    esp_timer_stop(wifi_fast.retry_timer);
+    esp_timer_start_once(wifi_fast.retry_timer, delay_ms * 1000ULL);
+}
+
+static void wifiFastOnGotIp(const ip_event_got_ip_t *event)
+{
+    int64_t time_to_ip_us = esp_timer_get_time() - wifi_fast.down_since_us;
+    bool fast = wifi_fast.using_cache;
+
+    wifi_fast.connected = true;
+    wifi_fast.failures = 0;
+    wifi_fast.stats.connects++;
+    wifi_fast.stats.fast_connects += fast;
+    wifi_fast.stats.last_time_to_ip_us = time_to_ip_us;
+
+    ESP_LOGI("Wi-Fi", "Got IP " IPSTR " in %lld ms (%s, %s)", IP2STR(&event->ip_info.ip),
+             (long long)(time_to_ip_us / 1000), fast ? "cached AP" : "full scan",
+#ifdef WIFI_STATIC_IP
+             "static IP"
+#else
+             "DHCP"
+#endif
+    );
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+    {
+        WifiFastCache cache = {.channel = ap.primary, .valid = true};
+        memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+        wifiFastSave(&cache);
+    }
+}
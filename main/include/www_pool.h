@@ -0,0 +1,278 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_http_server.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+// Worker pool for slow HTTP handlers. esp_http_server runs every handler
+// on its single task; this ESP-IDF version has no way to finish a request
+// after the handler returned. A pooled handler therefore copies what it
+// needs out of the request (URI, conditional and encoding headers) into a
+// job and returns at once, and a worker writes a complete HTTP/1.1 response
+// to the session socket with httpd_socket_send(). Keep-alive is preserved,
+// since clients do not send the next request before the response is
+// complete.
+//
+// A session may close while its job waits or runs, and the descriptor may
+// then be reused by a new connection. Each descriptor has one atomic word:
+// a serial that every close bumps, and a busy bit a worker sets while it
+// writes, as long as the serial still matches the one captured with the
+// job. wwwPoolOnClose() must be called from the server's close_fn and never
+// waits: when a worker is busy on the socket, it leaves the close(2) to
+// that worker, so the descriptor cannot be reused under the write.
+
+#define WWW_POOL_WORKERS 2
+#define WWW_POOL_QUEUE_DEPTH 8
+#define WWW_POOL_URI_MAX 128
+#define WWW_POOL_HEADERS_MAX 256
+#define WWW_POOL_TASK_PRIORITY 5
+#define WWW_POOL_TASK_STACK 4096
+
+typedef struct
+{
+    int fd;
+    uint32_t serial;
+    int64_t queued_us;
+    char uri[WWW_POOL_URI_MAX];
+    char if_none_match[16];
+    char accept_encoding[64];
+} WwwJob;
+
+// Response written by a worker. Headers are collected until the body starts.
+typedef struct
+{
+    const WwwJob *job;
+    const char *status;
+    const char *type;
+    char headers[WWW_POOL_HEADERS_MAX];
+    size_t headers_length;
+    bool head_sent;
+    esp_err_t err;
+} WwwResponse;
+
+typedef esp_err_t (*WwwJobHandler)(WwwResponse *response);
+
+static struct
+{
+    httpd_handle_t server;
+    QueueHandle_t jobs;
+    WwwJobHandler handler;
+    uint32_t states[FD_SETSIZE]; // serial << 1 | busy
+} www_pool;
+
+static Metric www_pool_queued = METRIC_COUNTER_INIT("www_pool_queued_total", "Requests handed to the worker pool.");
+static Metric www_pool_rejected = METRIC_COUNTER_INIT("www_pool_rejected_total", "Requests refused with 503, queue full.");
+static Metric www_pool_abandoned = METRIC_COUNTER_INIT("www_pool_abandoned_total", "Pooled responses that could not be completed.");
+static Metric www_pool_wait = METRIC_HISTOGRAM_INIT("www_pool_wait_seconds", "Time a request waited for a worker.");
+
+static uint32_t wwwPoolSerial(int fd)
+{
+    return __atomic_load_n(&www_pool.states[fd], __ATOMIC_ACQUIRE) >> 1;
+}
+
+// Returns false when the caller must not close the socket, because a
+// worker writing to it will.
+static bool wwwPoolOnClose(int fd)
+{
+    if (www_pool.jobs == NULL || fd < 0 || fd >= FD_SETSIZE)
+        return true;
+
+    uint32_t state = __atomic_add_fetch(&www_pool.states[fd], 2, __ATOMIC_ACQ_REL);
+    return (state & 1) == 0;
+}
+
+// Marks the job's session busy, if it is still open. Another worker may
+// still be finishing the previous response on a keep-alive session; that
+// takes no longer than a send, so this waits for it.
+static bool wwwPoolAcquire(const WwwJob *job)
+{
+    uint32_t idle = job->serial << 1;
+    while (1)
+    {
+        uint32_t state = idle;
+        if (__atomic_compare_exchange_n(&www_pool.states[job->fd], &state, idle | 1, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            return true;
+        if (state != (idle | 1))
+            return false;
+
+        vTaskDelay(1);
+    }
+}
+
+// Returns false when the session closed meanwhile; the socket is closed
+// here then.
+static bool wwwPoolRelease(const WwwJob *job)
+{
+    uint32_t state = __atomic_fetch_and(&www_pool.states[job->fd], ~1u, __ATOMIC_ACQ_REL);
+    if (state >> 1 == job->serial)
+        return true;
+
+    close(job->fd);
+    return false;
+}
+
+static esp_err_t wwwPoolWrite(WwwResponse *response, const char *data, size_t length)
+{
+    const WwwJob *job = response->job;
+    while (response->err == ESP_OK && length > 0)
+    {
+        int sent = -1;
+        if (wwwPoolAcquire(job))
+        {
+            sent = httpd_socket_send(www_pool.server, job->fd, data, length, 0);
+            if (!wwwPoolRelease(job))
+                sent = -1;
+        }
+
+        if (sent <= 0)
+        {
+            response->err = ESP_FAIL;
+            break;
+        }
+
+        data += sent;
+        length -= sent;
+    }
+    return response->err;
+}
+
+static void wwwResponseSetStatus(WwwResponse *response, const char *status)
+{
+    response->status = status;
+}
+
+static void wwwResponseSetType(WwwResponse *response, const char *type)
+{
+    response->type = type;
+}
+
+static void wwwResponseSetHeader(WwwResponse *response, const char *name, const char *value)
+{
+    size_t free_space = sizeof(response->headers) - response->headers_length;
+    int length = snprintf(response->headers + response->headers_length, free_space, "%s: %s\r\n", name, value);
+    if (length > 0 && (size_t)length < free_space)
+        response->headers_length += length;
+    else
+        ESP_LOGE("WWW pool", "Header %s does not fit", name);
+}
+
+// content_length < 0 selects chunked transfer encoding.
+static esp_err_t wwwResponseSendHead(WwwResponse *response, int content_length)
+{
+    char head[WWW_POOL_HEADERS_MAX + 128];
+    char length_header[40];
+    if (content_length < 0)
+        snprintf(length_header, sizeof(length_header), "Transfer-Encoding: chunked\r\n");
+    else
+        snprintf(length_header, sizeof(length_header), "Content-Length: %d\r\n", content_length);
+
+    int length = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n%.*s%s\r\n",
+                          response->status, response->type, (int)response->headers_length,
+                          response->headers, length_header);
+    response->head_sent = true;
+    return wwwPoolWrite(response, head, MIN((size_t)length, sizeof(head) - 1));
+}
+
+// The whole body at once, with Content-Length.
+static esp_err_t wwwResponseSend(WwwResponse *response, const char *data, size_t length)
+{
+    if (wwwResponseSendHead(response, length) == ESP_OK)
+        wwwPoolWrite(response, data, length);
+    return response->err;
+}
+
+// Like httpd_resp_send_chunk(): a NULL chunk ends the response.
+static esp_err_t wwwResponseSendChunk(WwwResponse *response, const char *data, size_t length)
+{
+    if (!response->head_sent)
+        wwwResponseSendHead(response, -1);
+
+    if (data == NULL)
+        return wwwPoolWrite(response, "0\r\n\r\n", 5);
+
+    char size[12];
+    int size_length = snprintf(size, sizeof(size), "%x\r\n", (unsigned)length);
+    wwwPoolWrite(response, size, size_length);
+    wwwPoolWrite(response, data, length);
+    return wwwPoolWrite(response, "\r\n", 2);
+}
+
+static void wwwPoolWorker(void *param)
+{
+    WwwJob job;
+    while (1)
+    {
+        if (xQueueReceive(www_pool.jobs, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        metricObserveUs(&www_pool_wait, esp_timer_get_time() - job.queued_us);
+        WwwResponse response = {.job = &job, .status = "200 OK", .type = "text/html"};
+        if (www_pool.handler(&response) == ESP_OK)
+            continue;
+
+        // A half-written response leaves the connection unusable.
+        metricInc(&www_pool_abandoned);
+        if (wwwPoolAcquire(&job))
+        {
+            httpd_sess_trigger_close(www_pool.server, job.fd);
+            wwwPoolRelease(&job);
+        }
+    }
+}
+
+// Called from a URI handler on the server task. Returns ESP_OK once the job
+// is queued or a 503 was sent because the queue is full.
+static esp_err_t wwwPoolSubmit(httpd_req_t *request)
+{
+    int fd = httpd_req_to_sockfd(request);
+    WwwJob job = {.fd = fd, .queued_us = esp_timer_get_time()};
+    bool valid = fd >= 0 && fd < FD_SETSIZE && strlen(request->uri) < sizeof(job.uri);
+    if (valid)
+    {
+        job.serial = wwwPoolSerial(fd);
+        strcpy(job.uri, request->uri);
+        httpd_req_get_hdr_value_str(request, "If-None-Match", job.if_none_match, sizeof(job.if_none_match));
+        httpd_req_get_hdr_value_str(request, "Accept-Encoding", job.accept_encoding, sizeof(job.accept_encoding));
+    }
+
+    if (valid && xQueueSend(www_pool.jobs, &job, 0) == pdTRUE)
+    {
+        metricInc(&www_pool_queued);
+        return ESP_OK;
+    }
+
+    metricInc(&www_pool_rejected);
+    httpd_resp_set_status(request, "503 Service Unavailable");
+    httpd_resp_set_hdr(request, "Retry-After", "1");
+    return httpd_resp_send(request, NULL, 0);
+}
+
+static bool wwwPoolStart(httpd_handle_t server, WwwJobHandler handler)
+{
+    if (www_pool.jobs != NULL)
+        return true;
+
+    www_pool.server = server;
+    www_pool.handler = handler;
+
+    // Created last: a non-NULL queue means the pool is running.
+    www_pool.jobs = xQueueCreate(WWW_POOL_QUEUE_DEPTH, sizeof(WwwJob));
+    if (www_pool.jobs == NULL)
+        return false;
+
+    // Spread across the cores; the server task itself is not pinned.
+    for (int i = 0; i < WWW_POOL_WORKERS; i++)
+        xTaskCreatePinnedToCore(wwwPoolWorker, "wwwWorker", WWW_POOL_TASK_STACK, NULL,
+                                WWW_POOL_TASK_PRIORITY, NULL, i % portNUM_PROCESSORS);
+    return true;
+}
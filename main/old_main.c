@@ -4,11 +4,11 @@
 #include <driver/gpio.h>
 
 #include "include/wifi.h"
-#include "include/mqtt.h"
 #include "include/sensor.h"
+#include "include/flash_log.h"
+#include "include/mqtt.h"
 #include "include/http.h"
 
-static xTimerHandle timerBT;
 static xTimerHandle timerMQTT;
 
 void app_main(void)
@@ -23,11 +23,9 @@ void app_main(void)
     }
 
     initializeBluetoothI2C();
+    flashLogInit();
     wifiInitSTA();
 
-    timerBT = xTimerCreate("timerBT", pdMS_TO_TICKS(10000), pdTRUE, (void *)0, getAndNotifyValues);
-    xTimerStart(timerBT, 1);
-
     timerMQTT = xTimerCreate("timerMQTT", pdMS_TO_TICKS(30000), pdTRUE, (void *)0, mqttAppStart);
     xTimerStart(timerMQTT, 1);
 }
\ No newline at end of file
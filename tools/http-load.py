@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# HTTP load generator for the device web server. Keeps one keep-alive
+# connection per client thread and reports requests/s and latency
+# percentiles per status code.
+#
+#   usage: http-load.py <url> [clients] [seconds]
+#          http-load.py --stand-in <www directory> [delay ms] [clients] [seconds]
+#
+# With --stand-in a local server serves the www directory, each request
+# taking the given delay, so the tool can be tried without a device.
+
+import http.client
+import http.server
+import os
+import socket
+import sys
+import threading
+import time
+import urllib.parse
+
+
+def run_client(url, deadline, results, lock):
+    connection = None
+    path = url.path or "/"
+    latencies = {}
+    while time.monotonic() < deadline:
+        if connection is None:
+            connection = http.client.HTTPConnection(url.hostname, url.port or 80, timeout=10)
+        started = time.monotonic()
+        try:
+            connection.request("GET", path)
+            response = connection.getresponse()
+            response.read()
+            status = response.status
+            if response.getheader("Connection", "").lower() == "close":
+                connection.close()
+                connection = None
+        except (OSError, http.client.HTTPException):
+            status = "error"
+            connection.close()
+            connection = None
+        latencies.setdefault(status, []).append(time.monotonic() - started)
+
+    with lock:
+        for status, values in latencies.items():
+            results.setdefault(status, []).extend(values)
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def run(url, clients, seconds):
+    url = urllib.parse.urlsplit(url)
+    results = {}
+    lock = threading.Lock()
+    deadline = time.monotonic() + seconds
+    threads = [threading.Thread(target=run_client, args=(url, deadline, results, lock)) for _ in range(clients)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    total = sum(len(values) for values in results.values())
+    print("%d clients, %d s: %d requests, %.1f requests/s" % (clients, seconds, total, total / seconds))
+    for status, values in sorted(results.items(), key=lambda item: str(item[0])):
+        values.sort()
+        print("  %-6s %6d  mean %7.1f ms  p50 %7.1f ms  p99 %7.1f ms" % (
+            status, len(values), 1000 * sum(values) / len(values),
+            1000 * percentile(values, 0.50), 1000 * percentile(values, 0.99)))
+
+
+def start_stand_in(root, delay_ms):
+    class Handler(http.server.SimpleHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def __init__(self, *args, **kwargs):
+            super().__init__(*args, directory=root, **kwargs)
+
+        def setup(self):
+            super().setup()
+            self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+        def do_GET(self):
+            time.sleep(delay_ms / 1000)
+            super().do_GET()
+
+        def log_message(self, *args):
+            pass
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return "http://127.0.0.1:%d/index.html" % server.server_address[1]
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    if args[:1] == ["--stand-in"] and len(args) >= 2:
+        url = start_stand_in(os.path.abspath(args[1]), float(args[2]) if len(args) > 2 else 0)
+        args = args[3:]
+    elif len(args) >= 1 and not args[0].startswith("-"):
+        url = args[0]
+        args = args[1:]
+    else:
+        sys.exit("usage: %s <url> [clients] [seconds]\n"
+                 "       %s --stand-in <www directory> [delay ms] [clients] [seconds]" % (sys.argv[0], sys.argv[0]))
+
+    run(url, int(args[0]) if len(args) > 0 else 4, int(args[1]) if len(args) > 1 else 10)
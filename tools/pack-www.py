@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+#
+# Packs the web assets into the flat image read by main/include/asset_pack.h.
+#
+#   usage: pack-www.py <www directory> <output image>
+
+import gzip
+import os
+import struct
+import sys
+
+MAGIC = 0x50575757
+VERSION = 1
+PATH_LENGTH = 40
+
+FLAG_GZIP = 0x01
+FLAG_TEMPLATE = 0x02
+
+HEADER = struct.Struct("<4I")
+ENTRY = struct.Struct("<%ds6I" % PATH_LENGTH)
+
+
+def fnv1a(data):
+    value = 0x811C9DC5
+    for byte in data:
+        value = ((value ^ byte) * 0x01000193) & 0xFFFFFFFF
+    return value
+
+
+def collect(root):
+    for directory, _, files in sorted(os.walk(root)):
+        for name in sorted(files):
+            full_path = os.path.join(directory, name)
+            yield "/" + os.path.relpath(full_path, root).replace(os.sep, "/"), full_path
+
+
+def encode(data):
+    # Pages with placeholders are rendered on the device, keep them as text.
+    if b"{{" in data:
+        return data, FLAG_TEMPLATE
+
+    compressed = gzip.compress(data, compresslevel=9, mtime=0)
+    if len(compressed) < len(data):
+        return compressed, FLAG_GZIP
+
+    return data, 0
+
+
+def main(root, output):
+    assets = []
+    for path, full_path in collect(root):
+        if len(path) >= PATH_LENGTH:
+            sys.exit("asset path too long: %s" % path)
+
+        with open(full_path, "rb") as file:
+            raw = file.read()
+
+        data, flags = encode(raw)
+        assets.append((path, data, fnv1a(raw), flags))
+
+    offset = HEADER.size + ENTRY.size * len(assets)
+    entries = b""
+    blobs = b""
+    for path, data, etag, flags in assets:
+        entries += ENTRY.pack(path.encode(), offset + len(blobs), len(data), etag, flags, 0, 0)
+        blobs += data
+        blobs += b"\0" * (-len(blobs) % 4)
+
+    image = HEADER.pack(MAGIC, VERSION, len(assets), offset + len(blobs)) + entries + blobs
+    with open(output, "wb") as file:
+        file.write(image)
+
+    print("Packed %d assets into %s (%d bytes)" % (len(assets), output, len(image)))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s <www directory> <output image>" % sys.argv[0])
+    main(sys.argv[1], sys.argv[2])